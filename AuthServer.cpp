@@ -2,18 +2,35 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
+#include <openssl/crypto.h>
+
 #include <was/common.h>
 #include <was/table.h>
 
+#include "BloomFilter.h"
+#include "CredentialCache.h"
+#include "PasswordVerifier.h"
+#include "SasSigner.h"
 #include "TableCache.h"
+#include "TokenCache.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
@@ -23,8 +40,11 @@ using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
+using azure::storage::table_query;
+using azure::storage::table_query_iterator;
 using azure::storage::table_request_options;
 using azure::storage::table_result;
 using azure::storage::table_shared_access_policy;
@@ -52,6 +72,8 @@ using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
+using credential_lookup_t = pair<status_code,CredentialCache::credential_t>;
+
 
 constexpr const char* def_url = "http://localhost:34570";
 
@@ -65,12 +87,103 @@ const string data_table_name {"DataTable"};
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
 const string get_update_data_op {"GetUpdateData"};
+const string get_update_data_batch_op {"GetUpdateDataBatch"};
+const string refresh_update_tokens_op {"RefreshUpdateTokens"};
+const string invalidate_auth_op {"InvalidateAuth"};
+const string invalidate_key_prop {"Key"};
+const string auth_cache_metrics_op {"AuthCacheMetrics"};
+const string hash_password_op {"HashPassword"};
+const string check_data_row_opt {"CheckDataRow"};
+const string data_row_exists_prop {"DataRowExists"};
+
+// Most tokens renewed by one RefreshUpdateTokens request
+constexpr size_t max_refresh_batch {100};
+
+// Most users signed on by one GetUpdateDataBatch request
+constexpr size_t max_update_data_batch {100};
+const string batch_userid_prop {"Userid"};
+
+// Bounds on the AuthTable entries kept in memory
+constexpr size_t credential_cache_entries {100000};
+constexpr std::chrono::seconds credential_cache_ttl {60};
+constexpr std::chrono::seconds credential_cache_absent_ttl {10};
+
+// Password hashes are checked on one thread per core, with at most this many waiting
+constexpr size_t max_pending_verifications {256};
+
+// Tokens last 24 hours, and are handed out again until this close to expiring
+constexpr std::chrono::hours token_lifetime {24};
+constexpr std::chrono::hours token_refresh_margin {2};
+constexpr size_t token_cache_entries {100000};
+
+// utility::datetime counts 100 ns ticks from 1601, this many seconds before 1970
+constexpr uint64_t datetime_ticks_per_second {10000000};
+constexpr uint64_t datetime_unix_epoch {11644473600};
+
+// Filter of the userids in AuthTable, rebuilt from a scan now and then
+constexpr size_t userid_filter_min_entries {10000};
+constexpr double userid_filter_false_positives {0.01};
+constexpr std::chrono::minutes userid_filter_rebuild_interval {10};
+constexpr std::chrono::seconds userid_filter_tick {1};
 
 /*
   Cache of opened tables
  */
 TableCache table_cache {};
 
+/*
+  Key that InvalidateAuth requests must carry, set once table_cache
+  is ready
+ */
+string invalidate_key {};
+
+/*
+  Cache of AuthTable entries, so that repeated sign-ons do not read
+  AuthTable. BasicServer invalidates entries it changes.
+ */
+CredentialCache credential_cache {credential_cache_entries, credential_cache_ttl, credential_cache_absent_ttl};
+
+/*
+  Bloom filter of every userid in AuthTable, so that requests for
+  unknown userids are answered NotFound without reading AuthTable.
+
+  It is built by a scan of AuthTable at startup and every
+  userid_filter_rebuild_interval, and userids are added as BasicServer
+  reports writes to AuthTable. A userid added to AuthTable some
+  other way is not known until the next rebuild. Until the first
+  scan succeeds, known_userids is null and every userid is looked up.
+
+  known_userids is only read and replaced with std::atomic_load and
+  std::atomic_store. Userids added while a rebuild is scanning are
+  also kept in added_during_rebuild, and added to the new filter
+  before it replaces the old one.
+ */
+std::shared_ptr<BloomFilter> known_userids {};
+std::mutex userid_filter_lock;
+bool userid_filter_rebuilding {false};
+vector<string> added_during_rebuild {};
+std::atomic<uint64_t> userid_filter_rejections {0};
+std::atomic<bool> auth_stopping {false};
+
+/*
+  Native token signer, or null if it did not reproduce the storage
+  library's tokens at startup and tokens are signed by the library
+ */
+std::unique_ptr<SasSigner> sas_signer {};
+
+/*
+  Cache of issued tokens, so that repeated sign-ons reuse a token
+  rather than sign a new one
+ */
+TokenCache token_cache {token_cache_entries, token_refresh_margin};
+
+/*
+  Pool that checks passwords against their AuthTable hashes, off the
+  listener's threads
+ */
+PasswordVerifier password_verifier {std::max(1u, std::thread::hardware_concurrency()),
+                                    max_pending_verifications};
+
 /*
   Convert properties represented in Azure Storage type
   to prop_str_vals_t type.
@@ -127,6 +240,322 @@ unordered_map<string,string> get_json_body(http_request message) {
   return results;
 }
 
+/*
+  Given an HTTP message whose JSON body is an array of objects
+  {"Userid": ..., "Password": ...}, set users to the userid and
+  password pairs in order.
+
+  Returns false if the body is not such an array.
+ */
+bool get_json_users (http_request message, vector<pair<string,string>>& users) {
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  if (content_type == headers.end() ||
+      content_type->second != "application/json")
+    return false;
+
+  value json {};
+  message.extract_json(true)
+    .then([&json](value v) -> bool
+          {
+            json = v;
+            return true;
+          })
+    .wait();
+
+  if ( ! json.is_array())
+    return false;
+  for (const auto& user : json.as_array()) {
+    if ( ! user.is_object() || user.size() != 2 ||
+         ! user.has_field(batch_userid_prop) || ! user.at(batch_userid_prop).is_string() ||
+         ! user.has_field(auth_table_password_prop) || ! user.at(auth_table_password_prop).is_string())
+      return false;
+    users.push_back(make_pair(user.at(batch_userid_prop).as_string(),
+                              user.at(auth_table_password_prop).as_string()));
+  }
+  return true;
+}
+
+/*
+  Answer a lookup of userid without reading AuthTable, if
+  known_userids or credential_cache can: set code to OK and credential
+  to the cached entry, or code to NotFound, and return true. Return
+  false if AuthTable must be read.
+ */
+bool cached_credential (const string& userid, status_code& code, CredentialCache::credential_t& credential) {
+  std::shared_ptr<BloomFilter> filter {std::atomic_load(&known_userids)};
+  if (filter && ! filter->might_contain(userid)) {
+    ++userid_filter_rejections;
+    code = status_codes::NotFound;
+    return true;
+  }
+
+  switch (credential_cache.lookup(userid, credential)) {
+  case CredentialCache::lookup_t::found:
+    code = status_codes::OK;
+    return true;
+  case CredentialCache::lookup_t::absent:
+    code = status_codes::NotFound;
+    return true;
+  case CredentialCache::lookup_t::miss:
+    break;
+  }
+  return false;
+}
+
+/*
+  Set credential from retrieve_result, the AuthTable read of userid
+  begun at credential_cache epoch, and cache what it found
+ */
+status_code read_credential (const string& userid,
+                             const table_result& retrieve_result,
+                             std::uint64_t epoch,
+                             CredentialCache::credential_t& credential) {
+  cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
+  if (retrieve_result.http_status_code() == status_codes::NotFound)
+    credential_cache.insert_absent(userid, epoch);
+  if (retrieve_result.http_status_code() != status_codes::OK)
+    return retrieve_result.http_status_code();
+
+  table_entity::properties_type properties {retrieve_result.entity().properties()};
+  credential = CredentialCache::credential_t {properties[auth_table_password_prop].string_value(),
+                                              properties[auth_table_partition_prop].string_value(),
+                                              properties[auth_table_row_prop].string_value()};
+  credential_cache.insert(userid, credential, epoch);
+  return status_codes::OK;
+}
+
+/*
+  Set credential to the AuthTable entry of userid, from
+  credential_cache if it is there and otherwise from table
+
+  Returns OK, NotFound if table has no such user, or the status of
+  the failed read. A userid that known_userids or credential_cache
+  shows is not in table is NotFound without reading it.
+ */
+status_code lookup_credential (const cloud_table& table,
+                               const string& userid,
+                               CredentialCache::credential_t& credential) {
+  status_code code {status_codes::OK};
+  if (cached_credential(userid, code, credential))
+    return code;
+
+  const auto epoch (credential_cache.epoch());
+  table_result retrieve_result {table.execute(table_operation::retrieve_entity(auth_table_userid_partition, userid))};
+  return read_credential(userid, retrieve_result, epoch, credential);
+}
+
+/*
+  lookup_credential() without blocking: the task's result is the
+  status and credential it would set. A failed read of AuthTable is
+  InternalError.
+ */
+pplx::task<credential_lookup_t> lookup_credential_async (const cloud_table& table, const string& userid) {
+  credential_lookup_t found {status_codes::OK, CredentialCache::credential_t {}};
+  if (cached_credential(userid, found.first, found.second))
+    return pplx::task_from_result(found);
+
+  const auto epoch (credential_cache.epoch());
+  return table.execute_async(table_operation::retrieve_entity(auth_table_userid_partition, userid))
+    .then([userid, epoch] (pplx::task<table_result> read) {
+        credential_lookup_t found {status_codes::InternalError, CredentialCache::credential_t {}};
+        try {
+          found.first = read_credential(userid, read.get(), epoch, found.second);
+        }
+        catch (const storage_exception& e) {
+          cout << "Azure Table Storage error: " << e.what() << endl;
+        }
+        return found;
+      });
+}
+
+/*
+  Return OK if data_table has the entity partition/row, NotFound if
+  it or the table does not exist, and InternalError if it cannot be
+  read
+ */
+status_code data_row_status (const cloud_table& data_table, const string& partition, const string& row) {
+  try {
+    table_result result {data_table.execute(table_operation::retrieve_entity(partition, row))};
+    if (result.http_status_code() == status_codes::OK || result.http_status_code() == status_codes::NotFound)
+      return result.http_status_code();
+  }
+  catch (const storage_exception& e) {
+    if (e.result().http_status_code() == status_codes::NotFound)
+      return status_codes::NotFound;
+    cout << "Azure Table Storage error: " << e.what() << endl;
+  }
+  return status_codes::InternalError;
+}
+
+/*
+  Record that userid may now be in AuthTable
+ */
+void add_known_userid (const string& userid) {
+  std::lock_guard<std::mutex> guard {userid_filter_lock};
+  std::shared_ptr<BloomFilter> filter {std::atomic_load(&known_userids)};
+  if (filter)
+    filter->add(userid);
+  if (userid_filter_rebuilding)
+    added_during_rebuild.push_back(userid);
+}
+
+/*
+  Replace known_userids with a filter built from a scan of AuthTable
+
+  The filter is sized for twice the userids found, so that it stays
+  accurate as users are added until the next rebuild. Returns false,
+  keeping the old filter, if the scan fails.
+ */
+bool build_userid_filter () {
+  {
+    std::lock_guard<std::mutex> guard {userid_filter_lock};
+    userid_filter_rebuilding = true;
+    added_during_rebuild.clear();
+  }
+
+  vector<string> userids {};
+  bool scanned {true};
+  try {
+    cloud_table table {table_cache.lookup_table(auth_table_name)};
+    table_query query {};
+    query.set_filter_string(table_query::generate_filter_condition("PartitionKey",
+                                                                   query_comparison_operator::equal,
+                                                                   auth_table_userid_partition));
+    query.set_select_columns(vector<string> {"RowKey"});
+    table_query_iterator end;
+    for (table_query_iterator it {table.execute_query(query)}; it != end; ++it)
+      userids.push_back(it->row_key());
+  }
+  catch (const storage_exception& e) {
+    cout << "AuthServer: scan of " << auth_table_name << " failed: " << e.what() << endl;
+    scanned = false;
+  }
+
+  std::shared_ptr<BloomFilter> filter {};
+  if (scanned) {
+    filter = std::make_shared<BloomFilter>(std::max(2 * userids.size(), userid_filter_min_entries),
+                                           userid_filter_false_positives);
+    for (const auto& userid : userids)
+      filter->add(userid);
+  }
+
+  std::lock_guard<std::mutex> guard {userid_filter_lock};
+  userid_filter_rebuilding = false;
+  if ( ! scanned)
+    return false;
+  for (const auto& userid : added_during_rebuild)
+    filter->add(userid);
+  added_during_rebuild.clear();
+  std::atomic_store(&known_userids, filter);
+  cout << "AuthServer: filter of " << userids.size() << " userids in "
+       << filter->bit_count() / 8 << " bytes" << endl;
+  return true;
+}
+
+/*
+  Rebuild known_userids every userid_filter_rebuild_interval, until
+  auth_stopping
+ */
+void rebuild_userid_filter () {
+  std::chrono::steady_clock::time_point next {std::chrono::steady_clock::now() + userid_filter_rebuild_interval};
+  while ( ! auth_stopping) {
+    std::this_thread::sleep_for(userid_filter_tick);
+    if (std::chrono::steady_clock::now() < next)
+      continue;
+    build_userid_filter();
+    next = std::chrono::steady_clock::now() + userid_filter_rebuild_interval;
+  }
+}
+
+/*
+  Return a token for the single entity partition/row of data_table
+  with permissions, expiring at exptime, signed by the storage library
+
+  exptime is truncated to whole seconds, which is all a token carries,
+  so that the token does not depend on how the library formats
+  fractions of a second.
+ */
+string library_token (const cloud_table& data_table,
+                      const string& partition,
+                      const string& row,
+                      uint8_t permissions,
+                      const utility::datetime& exptime) {
+  const utility::datetime whole {utility::datetime {} +
+                                 exptime.to_interval() / datetime_ticks_per_second * datetime_ticks_per_second};
+  return data_table.get_shared_access_signature(table_shared_access_policy {whole, permissions},
+                                                string(), // Unnamed policy
+                                                // Start of range (inclusive)
+                                                partition,
+                                                row,
+                                                // End of range (inclusive)
+                                                partition,
+                                                row);
+}
+
+/*
+  Return the token of library_token() signed by signer
+ */
+string native_token (SasSigner& signer,
+                     const cloud_table& data_table,
+                     const string& partition,
+                     const string& row,
+                     uint8_t permissions,
+                     const utility::datetime& exptime) {
+  const std::time_t expiry {static_cast<std::time_t>(exptime.to_interval() / datetime_ticks_per_second -
+                                                     datetime_unix_epoch)};
+  return signer.table_token(data_table.name(), partition, row,
+                            table_shared_access_policy {exptime, permissions}.permissions_to_string(),
+                            expiry);
+}
+
+/*
+  Return a token for the single entity partition/row of data_table,
+  signed by sas_signer if there is one and otherwise by the library
+
+  Throws storage_exception if the library fails.
+ */
+string sign_token (const cloud_table& data_table,
+                   const string& partition,
+                   const string& row,
+                   uint8_t permissions,
+                   const utility::datetime& exptime) {
+  if (sas_signer)
+    return native_token(*sas_signer, data_table, partition, row, permissions, exptime);
+  return library_token(data_table, partition, row, permissions, exptime);
+}
+
+/*
+  Set sas_signer to a signer keyed with the account key of data_table,
+  if it signs a few sample tokens exactly as the storage library does
+ */
+void start_sas_signer (const cloud_table& data_table) {
+  const azure::storage::storage_credentials& credentials (data_table.service_client().credentials());
+  std::unique_ptr<SasSigner> signer {new SasSigner {credentials.account_name(), credentials.account_key()}};
+
+  const utility::datetime exptime {utility::datetime::utc_now() +
+                                   utility::datetime::from_hours(static_cast<unsigned int>(token_lifetime.count()))};
+  const vector<pair<string,string>> samples {make_pair("USA", "Franklin,Aretha"),
+                                             make_pair("Canada", "Cohen Leonard"),
+                                             make_pair("A&B=C+D/E?F", "caf\xc3\xa9 ~-._%")};
+  for (const auto& sample : samples) {
+    for (uint8_t permissions : {table_shared_access_policy::permissions::read,
+                                table_shared_access_policy::permissions::read |
+                                table_shared_access_policy::permissions::update}) {
+      const string expected {library_token(data_table, sample.first, sample.second, permissions, exptime)};
+      const string native {native_token(*signer, data_table, sample.first, sample.second, permissions, exptime)};
+      if (native != expected) {
+        cout << "AuthServer: native signer disagrees with the storage library, not using it" << endl
+             << "  library " << expected << endl
+             << "  native  " << native << endl;
+        return;
+      }
+    }
+  }
+  sas_signer = std::move(signer);
+  cout << "AuthServer: using native token signer" << endl;
+}
+
 /*
   Return a token for 24 hours of access to the specified table,
   for the single entity defind by the partition and row.
@@ -145,22 +574,10 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
                    const string& row,
                    uint8_t permissions) {
 
-  utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_days(1)};
+  utility::datetime exptime {utility::datetime::utc_now() +
+                             utility::datetime::from_hours(static_cast<unsigned int>(token_lifetime.count()))};
   try {
-    string limited_access_token {
-      data_table.get_shared_access_signature(table_shared_access_policy {
-                                               exptime,
-                                               permissions},
-                                             string(), // Unnamed policy
-                                             // Start of range (inclusive)
-                                             partition,
-                                             row,
-                                             // End of range (inclusive)
-                                             partition,
-                                             row)
-        // Following token allows read access to entire table
-        //table.get_shared_access_signature(table_shared_access_policy {exptime, permissions})
-      };
+    string limited_access_token {sign_token(data_table, partition, row, permissions, exptime)};
     cout << "Token " << limited_access_token << endl;
     return make_pair(status_codes::OK, limited_access_token);
   }
@@ -171,118 +588,368 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
   }
 }
 
+/*
+  Return a token for the entity partition/row of data_table with
+  permissions: one from token_cache with at least token_refresh_margin
+  left, or else a new one, which is cached
+ */
+pair<status_code,string> get_token (const cloud_table& data_table,
+                                    const string& partition,
+                                    const string& row,
+                                    uint8_t permissions) {
+  string token {};
+  if (token_cache.lookup(partition, row, permissions, token))
+    return make_pair(status_codes::OK, token);
+
+  // No later than the expiry do_get_token sets
+  const TokenCache::wall_time_t expires {std::chrono::system_clock::now() + token_lifetime};
+  pair<status_code,string> result {do_get_token(data_table, partition, row, permissions)};
+  if (result.first == status_codes::OK)
+    token_cache.insert(partition, row, permissions, result.second, expires);
+  return result;
+}
+
+/*
+  Return true if token is an unexpired read and update token
+  issued by do_get_token for the entity partition/row of data_table.
+
+  A token is verified by signing its expiry time, permissions and
+  range again with the account key and comparing the result, in time
+  that does not depend on where they differ, so that the signature
+  cannot be found a byte at a time.
+ */
+bool is_update_token (const cloud_table& data_table,
+                      const string& token,
+                      const string& partition,
+                      const string& row) {
+  std::map<string,string> params {uri::split_query(token)};
+  auto expiry (params.find("se"));
+  if (expiry == params.end())
+    return false;
+
+  utility::datetime exptime {utility::datetime::from_string(uri::decode(expiry->second),
+                                                            utility::datetime::ISO_8601)};
+  if ( ! exptime.is_initialized() ||
+       exptime.to_interval() <= utility::datetime::utc_now().to_interval())
+    return false;
+
+  try {
+    string expected {sign_token(data_table,
+                                partition,
+                                row,
+                                table_shared_access_policy::permissions::read |
+                                table_shared_access_policy::permissions::update,
+                                exptime)};
+    return token.size() == expected.size() &&
+      CRYPTO_memcmp(token.data(), expected.data(), token.size()) == 0;
+  }
+  catch (const storage_exception& e) {
+    cout << "Azure Table Storage error: " << e.what() << endl;
+    return false;
+  }
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
+
+  GetReadToken, GetUpdateToken and GetUpdateData take the user's
+  password as the JSON body {"Password": ...}. The user's AuthTable
+  entry is usually found in credential_cache, so a repeated sign-on
+  does not touch storage at all.
+
+  AuthCacheMetrics reports the state of credential_cache:
+    Hits, Misses: lookups since start
+    HitRate: Hits / (Hits + Misses)
+    AbsentHits: lookups of userids cached as not in AuthTable
+    Expirations, Evictions, Invalidations: entries dropped since start
+    Size: entries now cached
+  and of known_userids:
+    FilterRejections: userids rejected without a lookup
+    FilterUserids: userids added to the filter
+  and of token_cache:
+    TokenHits, TokenMisses: tokens reused and newly signed
+  and of password_verifier:
+    Verified: passwords checked
+    VerifyBusy: sign-ons refused because too many were waiting
+    VerifyPending: passwords waiting to be checked
+
+  The password is checked by password_verifier, and the reply sent
+  when it is done; a sign-on refused because the verifier is
+  saturated is answered ServiceUnavailable.
+
+  GetUpdateData/userid/CheckDataRow also reads the user's DataTable
+  entity, and adds "DataRowExists" (true or false) to the reply, so
+  that UserServer can sign a user on with this one request.
  */
 void handle_get(http_request message) { 
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** AuthServer GET " << path << endl;
   auto paths = uri::split_path(path);
+
+  if (paths.size() == 1 && paths[0] == auth_cache_metrics_op) {
+    CredentialCache::metrics_t metrics {credential_cache.metrics()};
+    TokenCache::metrics_t token_metrics {token_cache.metrics()};
+    PasswordVerifier::metrics_t verify_metrics {password_verifier.metrics()};
+    std::shared_ptr<BloomFilter> filter {std::atomic_load(&known_userids)};
+    const uint64_t lookups {metrics.hits + metrics.misses};
+    message.reply(status_codes::OK,
+                  value::object(vector<pair<string,value>> {
+                      make_pair("Hits", value::number(metrics.hits)),
+                      make_pair("Misses", value::number(metrics.misses)),
+                      make_pair("HitRate", value::number(lookups == 0 ? 0.0 :
+                                                         static_cast<double>(metrics.hits) / lookups)),
+                      make_pair("AbsentHits", value::number(metrics.absent_hits)),
+                      make_pair("FilterRejections", value::number(userid_filter_rejections.load())),
+                      make_pair("FilterUserids", value::number(static_cast<uint64_t>(filter ? filter->size() : 0))),
+                      make_pair("Expirations", value::number(metrics.expirations)),
+                      make_pair("Evictions", value::number(metrics.evictions)),
+                      make_pair("Invalidations", value::number(metrics.invalidations)),
+                      make_pair("Size", value::number(static_cast<uint64_t>(metrics.size))),
+                      make_pair("TokenHits", value::number(token_metrics.hits)),
+                      make_pair("TokenMisses", value::number(token_metrics.misses)),
+                      make_pair("Verified", value::number(verify_metrics.verified)),
+                      make_pair("VerifyBusy", value::number(verify_metrics.rejected_busy)),
+                      make_pair("VerifyPending", value::number(static_cast<uint64_t>(verify_metrics.pending)))}));
+    return;
+  }
+
   // Need at least an operation and userid
   if (paths.size() < 2) {
     message.reply(status_codes::BadRequest);
     return;
   }
 
+  // An AuthTable that does not exist answers NotFound for every user
   cloud_table table {table_cache.lookup_table(auth_table_name)};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
+  cloud_table data_table {table_cache.lookup_table(data_table_name)};
+
+  string userid = paths[1];
+  CredentialCache::credential_t credential {};
+  status_code code {lookup_credential(table, userid, credential)};
+  if (code != status_codes::OK) {
+    message.reply(code == status_codes::NotFound ? status_codes::NotFound : status_codes::InternalError);
     return;
   }
 
-  cloud_table data_table {table_cache.lookup_table(data_table_name)};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
+  unordered_map<string,string> message_properties = get_json_body(message);
+  if (message_properties.size() != 1
+      || message_properties.begin()->first != auth_table_password_prop
+      || message_properties.begin()->second.empty()) {
+    message.reply(status_codes::BadRequest);
     return;
   }
 
-  string userid = paths[1];
-  table_operation retrieve_operation {table_operation::retrieve_entity(auth_table_userid_partition, userid)};
-  table_result retrieve_result {table.execute(retrieve_operation)};
-  cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
-  if (retrieve_result.http_status_code() == status_codes::NotFound) {
-    message.reply(status_codes::NotFound);
+  uint8_t permissions {0};
+  if (paths[0] == get_read_token_op) {
+    permissions = table_shared_access_policy::permissions::read;
+  }
+  else if (paths[0] == get_update_token_op || paths[0] == get_update_data_op) {
+    permissions = table_shared_access_policy::permissions::read |
+      table_shared_access_policy::permissions::update;
+  }
+  else {
+    message.reply(status_codes::BadRequest);
     return;
   }
 
-  table_entity entity {retrieve_result.entity()};
-  table_entity::properties_type properties {entity.properties()};
-  unordered_map<string,string> message_properties = get_json_body(message);
+  const bool with_data {paths[0] == get_update_data_op};
+  const bool check_data_row {with_data && paths.size() == 3 && paths[2] == check_data_row_opt};
+  password_verifier.verify(message_properties.begin()->second, credential.password)
+    .then([message, data_table, credential, permissions, with_data, check_data_row]
+          (PasswordVerifier::verdict_t verdict) {
+        if (verdict == PasswordVerifier::verdict_t::busy) {
+          message.reply(status_codes::ServiceUnavailable);
+          return;
+        }
+        if (verdict != PasswordVerifier::verdict_t::match) {
+          message.reply(status_codes::NotFound);
+          return;
+        }
 
-  if (message_properties.size() == 1 
-    && message_properties.begin()->first == auth_table_password_prop
-    && !(message_properties.begin()->second.empty())) {
+        pair<status_code,string> token = get_token(data_table,
+                                                   credential.partition,
+                                                   credential.row,
+                                                   permissions);
 
-    // GetReadToken
-    if(paths[0] == get_read_token_op) {
-      if (message_properties.begin()->second == properties[auth_table_password_prop].string_value()) {
-        pair<status_code,string> token = do_get_token(data_table, 
-        properties[auth_table_partition_prop].string_value(), 
-        properties[auth_table_row_prop].string_value(), 
-        table_shared_access_policy::permissions::read);
+        vector<pair<string,value>> json_data {make_pair("token", value::string(token.second))};
+        if (with_data) {
+          json_data.push_back(make_pair(auth_table_partition_prop, value::string(credential.partition)));
+          json_data.push_back(make_pair(auth_table_row_prop, value::string(credential.row)));
+        }
+        if (check_data_row && token.first == status_codes::OK) {
+          status_code row_code {data_row_status(data_table, credential.partition, credential.row)};
+          if (row_code == status_codes::InternalError) {
+            message.reply(row_code);
+            return;
+          }
+          json_data.push_back(make_pair(data_row_exists_prop, value::boolean(row_code == status_codes::OK)));
+        }
+        message.reply(token.first, value::object(json_data));
+      });
+}
 
-        vector<pair<string,value>> json_token {make_pair("token", value::string(token.second))};
-        message.reply(token.first, value::object(json_token));
-      }
+/*
+  Reply to a GetUpdateDataBatch request, as described for handle_post()
 
-      else {
-        message.reply(status_codes::NotFound);
-        return;
-      }
-    }
+  The AuthTable reads of users missing from credential_cache are
+  issued together and overlap rather than queue. No pool thread waits
+  on them: the password checks and the reply run as continuations.
+ */
+void handle_update_data_batch (http_request message) {
+  vector<pair<string,string>> users {};
+  if ( ! get_json_users(message, users) || users.empty() || users.size() > max_update_data_batch) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
 
-    // GetUpdateToken
-    else if(paths[0] == get_update_token_op) {
-      if (message_properties.begin()->second == properties[auth_table_password_prop].string_value()) {
-        pair<status_code,string> token = do_get_token(data_table, 
-        properties[auth_table_partition_prop].string_value(), 
-        properties[auth_table_row_prop].string_value(), 
-        table_shared_access_policy::permissions::read | 
-        table_shared_access_policy::permissions::update);
-
-        vector<pair<string,value>> json_token {make_pair("token", value::string(token.second))};
-        message.reply(token.first, value::object(json_token));
-      }
+  cloud_table table {table_cache.lookup_table(auth_table_name)};
+  cloud_table data_table {table_cache.lookup_table(data_table_name)};
 
-      else {
-        message.reply(status_codes::NotFound);
-        return;
-      }
-    }
+  vector<pplx::task<credential_lookup_t>> lookups {};
+  for (const auto& user : users)
+    lookups.push_back(lookup_credential_async(table, user.first));
 
-    else if (paths[0] == get_update_data_op) {
-      if (message_properties.begin()->second == properties[auth_table_password_prop].string_value()) {
-        pair<status_code,string> token = do_get_token(data_table, 
-        properties[auth_table_partition_prop].string_value(), 
-        properties[auth_table_row_prop].string_value(), 
-        table_shared_access_policy::permissions::read | 
-        table_shared_access_policy::permissions::update);
-
-        vector<pair<string,value>> json_data {make_pair("token", value::string(token.second)), 
-                                              make_pair(auth_table_partition_prop, value::string(properties[auth_table_partition_prop].string_value())), 
-                                              make_pair(auth_table_row_prop, value::string(properties[auth_table_row_prop].string_value()))};
-        
-        message.reply(token.first, value::object(json_data));
-      }
+  pplx::when_all(lookups.begin(), lookups.end())
+    .then([message, data_table, users] (vector<credential_lookup_t> found) {
+        vector<CredentialCache::credential_t> credentials (users.size());
+        vector<pplx::task<PasswordVerifier::verdict_t>> checks {};
+        for (size_t i {0}; i < users.size(); ++i) {
+          credentials[i] = found[i].second;
+          if (found[i].first == status_codes::OK && ! users[i].second.empty())
+            checks.push_back(password_verifier.verify(users[i].second, credentials[i].password));
+          else
+            checks.push_back(pplx::task_from_result(PasswordVerifier::verdict_t::mismatch));
+        }
 
-      else {
-        message.reply(status_codes::NotFound);
-        return;
-      }
-    }
-  }
-  else {
-    message.reply(status_codes::BadRequest);
-    return;
-  }
+        return pplx::when_all(checks.begin(), checks.end())
+          .then([message, data_table, users, credentials] (vector<PasswordVerifier::verdict_t> verdicts) {
+              if (std::find(verdicts.begin(), verdicts.end(), PasswordVerifier::verdict_t::busy) != verdicts.end()) {
+                message.reply(status_codes::ServiceUnavailable);
+                return;
+              }
+
+              const uint8_t permissions {table_shared_access_policy::permissions::read |
+                                         table_shared_access_policy::permissions::update};
+              vector<pair<string,value>> signed_on {};
+              for (size_t i {0}; i < users.size(); ++i) {
+                if (verdicts[i] != PasswordVerifier::verdict_t::match)
+                  continue;
+                pair<status_code,string> token {get_token(data_table,
+                                                          credentials[i].partition,
+                                                          credentials[i].row,
+                                                          permissions)};
+                if (token.first != status_codes::OK)
+                  continue;
+                signed_on.push_back(make_pair(users[i].first,
+                                              value::object(vector<pair<string,value>> {
+                                                  make_pair("token", value::string(token.second)),
+                                                  make_pair(auth_table_partition_prop, value::string(credentials[i].partition)),
+                                                  make_pair(auth_table_row_prop, value::string(credentials[i].row))})));
+              }
+              message.reply(status_codes::OK, value::object(signed_on));
+            });
+      });
 }
 
 /*
   Top-level routine for processing all HTTP POST requests.
+
+  RefreshUpdateTokens renews the update tokens of a batch of users.
+  The body maps each userid to its current update token; a userid
+  whose token is unexpired and valid for its own data entity gets a
+  fresh 24-hour token. The reply maps each renewed userid to its new
+  token. Userids that are unknown or whose tokens fail verification
+  are left out of the reply, as are all of them if AuthTable does not
+  exist.
+
+  GetUpdateDataBatch signs on a batch of users at once, for services
+  acting for many users. The body is an array of objects
+  {"Userid": ..., "Password": ...}. The users' AuthTable entries are
+  looked up concurrently, and the reply maps each signed-on userid to
+  the {"token", "DataPartition", "DataRow"} that GetUpdateData would
+  return. Userids that are unknown or whose passwords are wrong are
+  left out of the reply. If password_verifier is too busy to check
+  them all, the whole batch is answered ServiceUnavailable.
+
+  InvalidateAuth/userid drops the cached AuthTable entry of userid,
+  and adds userid to known_userids, as it may be a new user.
+  InvalidateAuth alone drops every cached entry. BasicServer sends
+  these after writing AuthTable, with the JSON body {"Key": ...}
+  holding table_cache's service_key() for InvalidateAuth, which only
+  a server with the storage account key can make. Without it, they
+  are Forbidden, so that no client can fill known_userids with
+  made-up userids or empty credential_cache.
  */
 void handle_post(http_request message) {
   string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
+  cout << endl << "**** AuthServer POST " << path << endl;
+  auto paths = uri::split_path(path);
+  if (paths.size() >= 1 && paths.size() <= 2 && paths[0] == invalidate_auth_op) {
+    unordered_map<string,string> body {get_json_body(message)};
+    auto key (body.find(invalidate_key_prop));
+    if (body.size() != 1 || key == body.end() || key->second.size() != invalidate_key.size() ||
+        CRYPTO_memcmp(key->second.data(), invalidate_key.data(), invalidate_key.size()) != 0) {
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+    if (paths.size() == 2) {
+      add_known_userid(paths[1]);
+      credential_cache.invalidate(paths[1]);
+    }
+    else
+      credential_cache.clear();
+    message.reply(status_codes::OK);
+    return;
+  }
+
+  if (paths.size() == 1 && paths[0] == get_update_data_batch_op) {
+    handle_update_data_batch(message);
+    return;
+  }
+
+  if (paths.size() != 1 || paths[0] != refresh_update_tokens_op) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  unordered_map<string,string> tokens {get_json_body(message)};
+  if (tokens.empty() || tokens.size() > max_refresh_batch) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  // A missing AuthTable makes every userid unknown, without a check of its own
+  cloud_table table {table_cache.lookup_table(auth_table_name)};
+  cloud_table data_table {table_cache.lookup_table(data_table_name)};
+
+  vector<pair<string,value>> refreshed {};
+  for (const auto& t : tokens) {
+    CredentialCache::credential_t credential {};
+    try {
+      if (lookup_credential(table, t.first, credential) != status_codes::OK)
+        continue;
+    }
+    catch (const storage_exception& e) {
+      cout << "Azure Table Storage error: " << e.what() << endl;
+      continue;
+    }
+    if ( ! is_update_token(data_table, t.second, credential.partition, credential.row))
+      continue;
+
+    // Always a new token, which later sign-ons then reuse
+    const uint8_t permissions {table_shared_access_policy::permissions::read |
+                               table_shared_access_policy::permissions::update};
+    const TokenCache::wall_time_t expires {std::chrono::system_clock::now() + token_lifetime};
+    pair<status_code,string> token {do_get_token(data_table,
+                                                 credential.partition,
+                                                 credential.row,
+                                                 permissions)};
+    if (token.first == status_codes::OK) {
+      token_cache.insert(credential.partition, credential.row, permissions, token.second, expires);
+      refreshed.push_back(make_pair(t.first, value::string(token.second)));
+    }
+  }
+  message.reply(status_codes::OK, value::object(refreshed));
 }
 
 /*
@@ -308,8 +975,8 @@ void handle_delete(http_request message) {
   which processes each request asynchronously.
 
   Note that, unlike BasicServer, AuthServer only
-  installs the listeners for GET. Any other HTTP
-  method will produce a Method Not Allowed (405)
+  installs the listeners for GET and POST. Any other
+  HTTP method will produce a Method Not Allowed (405)
   response.
 
   If you want to support other methods, uncomment
@@ -317,15 +984,35 @@ void handle_delete(http_request message) {
   listener.
   
   Wait for a carriage return, then shut the server down.
+
+  "authserver HashPassword password" instead prints the hash of
+  password to store as a Password in AuthTable, and exits.
  */
 int main (int argc, char const * argv[]) {
+  if (argc == 3 && argv[1] == hash_password_op) {
+    cout << PasswordVerifier::hash(argv[2]) << endl;
+    return 0;
+  }
+
   cout << "AuthServer: Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
+  invalidate_key = table_cache.service_key(invalidate_auth_op);
+
+  try {
+    start_sas_signer(table_cache.lookup_table(data_table_name));
+  }
+  catch (const std::exception& e) {
+    cout << "AuthServer: native token signer unavailable: " << e.what() << endl;
+  }
+
+  cout << "AuthServer: Scanning " << auth_table_name << endl;
+  build_userid_filter();
+  std::thread rebuild {&rebuild_userid_filter};
 
   cout << "AuthServer: Opening listener" << endl;
   http_listener listener {def_url};
   listener.support(methods::GET, &handle_get);
-  //listener.support(methods::POST, &handle_post);
+  listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
@@ -336,5 +1023,7 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+  auth_stopping = true;
+  rebuild.join();
   cout << "AuthServer closed" << endl;
 }
@@ -2,6 +2,8 @@
  Basic Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <memory>
@@ -20,6 +22,8 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "ClientUtils.h"
+#include "PropertyIndex.h"
 #include "TableCache.h"
 #include "make_unique.h"
 #include "ServerUtils.h"
@@ -33,12 +37,15 @@ using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
+using azure::storage::table_batch_operation;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
 using azure::storage::table_query;
 using azure::storage::table_query_iterator;
 using azure::storage::table_result;
 
+using pplx::task;
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
 
@@ -55,6 +62,7 @@ using std::vector;
 using web::http::http_headers;
 using web::http::http_request;
 using web::http::methods;
+using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
@@ -65,6 +73,7 @@ using web::http::experimental::listener::http_listener;
 using prop_vals_t = vector<pair<string,value>>;
 
 constexpr const char* def_url = "http://localhost:34568";
+constexpr const char* auth_addr {"http://localhost:34570/"};
 
 const string create_table {"CreateTableAdmin"};
 const string delete_table {"DeleteTableAdmin"};
@@ -76,15 +85,69 @@ const string delete_entity {"DeleteEntityAdmin"};
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
 
+// Set-semantics edits of list properties, such as Friends
+const string list_add_auth {"ListAddAuth"};
+const string list_remove_auth {"ListRemoveAuth"};
+
+// Bounded, row-ordered read of a single partition
+const string read_range {"ReadRangeAdmin"};
+
+// Multi-row write to a single partition
+const string update_batch {"UpdateBatchAdmin"};
+
+// Most entities Azure accepts in one entity group transaction
+constexpr vector<table_entity>::size_type max_batch_rows {100};
+
 // The two optional operations from Assignment 1
 const string add_property {"AddPropertyAdmin"};
 const string update_property {"UpdatePropertyAdmin"};
 
+// AuthServer caches AuthTable entries and is told when they change
+const string auth_table_name {"AuthTable"};
+const string auth_table_userid_partition {"Userid"};
+const string invalidate_auth_op {"InvalidateAuth"};
+const string invalidate_key_prop {"Key"};
+
+// Most entities GET by properties reads one by one; more are scanned
+constexpr vector<PropertyIndex::key_t>::size_type max_point_reads {1000};
+
 /*
   Cache of opened tables
  */
 TableCache table_cache {};
 
+/*
+  Entities of each table by property name, for GET by properties
+ */
+PropertyIndex property_index {};
+
+/*
+  Key AuthServer asks of InvalidateAuth, set once table_cache is ready
+ */
+string invalidate_key {};
+
+/*
+  Tell AuthServer that the entity partition/row of table_name has
+  changed, if that table is AuthTable, so that it drops its cached
+  copy. An empty row means any number of entities may have changed.
+
+  AuthServer might not be running; its cached entries then simply
+  expire on their own.
+ */
+void auth_table_changed (const string& table_name, const string& partition, const string& row) {
+  if (table_name != auth_table_name)
+    return;
+  string uri {string(auth_addr) + invalidate_auth_op};
+  if (partition == auth_table_userid_partition && ! row.empty())
+    uri += "/" + row;
+  try {
+    do_request(methods::POST, uri, build_json_value(invalidate_key_prop, invalidate_key));
+  }
+  catch (const std::exception& e) {
+    cout << "AuthServer not told of change to " << table_name << ": " << e.what() << endl;
+  }
+}
+
 /*
   Convert properties represented in Azure Storage type
   to prop_vals_t type.
@@ -117,20 +180,15 @@ prop_vals_t get_properties (const table_entity::properties_type& properties, pro
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+  Given an HTTP message with a JSON body, return the body as a
+  JSON value, or a null value if the message has no JSON body.
  */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
+value get_json_value(http_request message) {
   const http_headers& headers {message.headers()};
   auto content_type (headers.find("Content-Type"));
   if (content_type == headers.end() ||
       content_type->second != "application/json")
-    return results;
+    return value {};
 
   value json{};
   message.extract_json(true)
@@ -140,6 +198,20 @@ unordered_map<string,string> get_json_body(http_request message) {
 	    return true;
 	  })
     .wait();
+  return json;
+}
+
+/*
+  Given an HTTP message with a JSON body, return the JSON
+  body as an unordered map of strings to strings.
+
+  Note that all types of JSON values are returned as strings.
+  Use C++ conversion utilities to convert to numbers or dates
+  as necessary.
+ */
+unordered_map<string,string> get_json_body(http_request message) {  
+  unordered_map<string,string> results {};
+  value json {get_json_value(message)};
 
   if (json.is_object()) {
     for (const auto& v : json.as_object()) {
@@ -155,28 +227,102 @@ unordered_map<string,string> get_json_body(http_request message) {
 }
 
 /*
-	Given entity at table_query_iterator-it, 
-  push entitiy into vector-key_vec if it contains specified properties from map
+  Return the names of properties
  */
-void get_by_properties (const table_query_iterator& it, const unordered_map<string,string>& map, vector<value>& key_vec) {
-  table_entity::properties_type properties = it->properties();
+PropertyIndex::names_t property_names (const table_entity::properties_type& properties) {
+  PropertyIndex::names_t names {};
+  for (const auto& v : properties)
+    names.push_back(v.first);
+  return names;
+}
 
-  bool contains_property {true};
-  for (auto i = map.begin(); i != map.end(); ++i) {
-    if (properties.find(i->first) == properties.end()) {
-      contains_property = false;
-    }
+/*
+  Return the names of the properties of a JSON body, as returned by
+  get_json_body()
+ */
+PropertyIndex::names_t property_names (const unordered_map<string,string>& props) {
+  PropertyIndex::names_t names {};
+  for (const auto& v : props)
+    names.push_back(v.first);
+  return names;
+}
+
+/*
+  Return whether a write answered status was certainly not made, so
+  that its property_index entry is to be taken back. A caller with a
+  bad token gets Forbidden or NotFound, and so cannot leave entries
+  behind.
+ */
+bool refused (status_code status) {
+  return status == status_codes::Forbidden ||
+    status == status_codes::NotFound ||
+    status == status_codes::BadRequest;
+}
+
+/*
+  Push entity into key_vec if it has every property in names
+ */
+void get_by_properties (const table_entity& entity, const PropertyIndex::names_t& names, vector<value>& key_vec) {
+  const table_entity::properties_type& properties = entity.properties();
+  for (const auto& name : names) {
+    if (properties.find(name) == properties.end())
+      return;
   }
 
-  if (contains_property == true) {
-    cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-    prop_vals_t keys
-    {
-      make_pair("Partition",value::string(it->partition_key())),
-      make_pair("Row", value::string(it->row_key()))
-    };
-    keys = get_properties(it->properties(), keys);
-    key_vec.push_back(value::object(keys));
+  cout << "Key: " << entity.partition_key() << " / " << entity.row_key() << endl;
+  prop_vals_t keys
+  {
+    make_pair("Partition",value::string(entity.partition_key())),
+    make_pair("Row", value::string(entity.row_key()))
+  };
+  keys = get_properties(properties, keys);
+  key_vec.push_back(value::object(keys));
+}
+
+/*
+  Set keys to the entities of table table_name that have every
+  property in names, according to property_index, returning false
+  if the table is not indexed
+
+  A table queried for the first time is scanned into the index,
+  unless another request is doing so already.
+ */
+bool indexed_keys (const string& table_name, const cloud_table& table,
+                   const PropertyIndex::names_t& names, vector<PropertyIndex::key_t>& keys) {
+  if (property_index.find(table_name, names, keys))
+    return true;
+  if ( ! property_index.start(table_name))
+    return false;
+
+  try {
+    table_query query {};
+    table_query_iterator end;
+    for (table_query_iterator it {table.execute_query(query)}; it != end; ++it)
+      property_index.add(table_name, it->partition_key(), it->row_key(), property_names(it->properties()));
+  }
+  catch (const storage_exception& e) {
+    property_index.drop(table_name);
+    throw;
+  }
+  property_index.finish(table_name);
+  cout << "Indexed properties of " << table_name << endl;
+  return property_index.find(table_name, names, keys);
+}
+
+/*
+  Push into key_vec each entity of keys that has every property in
+  names, reading the entities in parallel
+ */
+void get_by_keys (const cloud_table& table, const vector<PropertyIndex::key_t>& keys,
+                  const PropertyIndex::names_t& names, vector<value>& key_vec) {
+  vector<task<table_result>> reads {};
+  for (const auto& k : keys)
+    reads.push_back(table.execute_async(table_operation::retrieve_entity(k.first, k.second)));
+  for (auto& r : reads) {
+    table_result result {r.get()};
+    // The index can list an entity just deleted
+    if (result.http_status_code() != status_codes::NotFound)
+      get_by_properties(result.entity(), names, key_vec);
   }
 }
 
@@ -211,28 +357,44 @@ void handle_get(http_request message) {
   
   if (paths[0] == read_entity) {
     if (paths.size() == 2) {
-      table_query query {};
-      table_query_iterator end;
-      table_query_iterator it = table.execute_query(query);
       vector<value> key_vec;
 
-      // GET entries by properties
+      /*
+        GET entries by properties
+
+        The entities are found in property_index and read one by
+        one, unless the index is not ready or lists too many, when
+        the table is scanned.
+       */
       const auto v = get_json_body(message);
       if (v.size() != 0) {
         for (auto i = v.begin(); i != v.end(); ++i) {
           if (i->second != "*") {
             message.reply(status_codes::BadRequest);
+            return;
           }
-        }   
-        while(it != end) {
-          get_by_properties(it, v, key_vec);
-          ++it;
+        }
+        const PropertyIndex::names_t names {property_names(v)};
+        vector<PropertyIndex::key_t> candidates {};
+        if (indexed_keys(paths[1], table, names, candidates) && candidates.size() <= max_point_reads) {
+          // In key order, as a scan returns them
+          std::sort(candidates.begin(), candidates.end());
+          get_by_keys(table, candidates, names, key_vec);
+        }
+        else {
+          table_query query {};
+          table_query_iterator end;
+          for (table_query_iterator it {table.execute_query(query)}; it != end; ++it)
+            get_by_properties(*it, names, key_vec);
         }
         message.reply(status_codes::OK, value::array(key_vec));
         return;
       }
       
       // GET all entries in table
+      table_query query {};
+      table_query_iterator end;
+      table_query_iterator it = table.execute_query(query);
       while (it != end) {
         cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
         prop_vals_t keys {
@@ -287,6 +449,52 @@ void handle_get(http_request message) {
       message.reply(status_codes::OK);
   }
 
+  /*
+    GET the first count entities of a partition, in row key order:
+      ReadRangeAdmin/table/partition/count
+
+    The filter and take count are passed to Azure, so the
+    cost of the read is bounded by count rather than by the
+    size of the table or partition.
+   */
+  else if (paths[0] == read_range) {
+    if (paths.size() != 4) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+
+    vector<value>::size_type count {0};
+    try {
+      int requested {std::stoi(paths[3])};
+      if (requested <= 0) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      count = requested;
+    }
+    catch (const std::exception& e) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+
+    table_query query {};
+    query.set_filter_string(table_query::generate_filter_condition("PartitionKey",
+                                                                   query_comparison_operator::equal,
+                                                                   paths[2]));
+    query.set_take_count(static_cast<int>(count));
+    table_query_iterator end;
+    table_query_iterator it = table.execute_query(query);
+    vector<value> key_vec;
+    while (it != end && key_vec.size() < count) {
+      prop_vals_t keys {
+        make_pair("Row", value::string(it->row_key()))};
+      keys = get_properties(it->properties(), keys);
+      key_vec.push_back(value::object(keys));
+      ++it;
+    }
+    message.reply(status_codes::OK, value::array(key_vec));
+  }
+
   // Read entity with authorization, return them as JSON
   else if (paths[0] == read_entity_auth) { 
     if( !((read_with_token(message, tables_endpoint)).first == status_codes::OK) ) {
@@ -366,12 +574,16 @@ void handle_put(http_request message) {
     	table_entity entity {paths[2], paths[3]};
       cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
       table_entity::properties_type& properties = entity.properties();
-      for (const auto v : get_json_body(message)) {
+      const auto body = get_json_body(message);
+      for (const auto v : body) {
         properties[v.first] = entity_property {v.second};
       }
 
+      // Indexed before the write, so a GET during it cannot miss the entity
+      property_index.add(paths[1], paths[2], paths[3], property_names(body));
       table_operation operation {table_operation::insert_or_merge_entity(entity)};
       table_result op_result {table.execute(operation)};
+      auth_table_changed(paths[1], paths[2], paths[3]);
 
       message.reply(status_codes::OK);
     }
@@ -389,12 +601,15 @@ void handle_put(http_request message) {
           table_entity entity {it->partition_key(), it->row_key()};
           table_entity::properties_type& properties = entity.properties();
           properties[v.begin()->first] = entity_property{v.begin()->second};
+          property_index.add(paths[1], entity.partition_key(), entity.row_key(),
+                             PropertyIndex::names_t {v.begin()->first});
           table_operation operation {table_operation::insert_or_merge_entity(entity)};
           table_result op_result {table.execute(operation)};
           cout << "Update " << entity.partition_key() << "/" << entity.row_key() << endl;
           cout << "Added Property: " << v.begin()->first << " Value: " << properties[v.begin()->first].string_value() << endl;
           ++it;
         }
+        auth_table_changed(paths[1], string {}, string {});
         message.reply(status_codes::OK);
       }
       else {
@@ -402,7 +617,7 @@ void handle_put(http_request message) {
       }
     }
 
-    // Update property
+    // Update property (of the entities that have it, so property_index is unchanged)
     else if (paths[0] == update_property) {
       const auto v = get_json_body(message);
 
@@ -432,6 +647,7 @@ void handle_put(http_request message) {
           }
           ++it;
         }
+        auth_table_changed(paths[1], string {}, string {});
         message.reply(status_codes::OK);
       }
       else {
@@ -439,10 +655,99 @@ void handle_put(http_request message) {
       }
     }
 
+    /*
+      Insert or merge several entities of one partition:
+        UpdateBatchAdmin/table/partition
+      with a JSON body mapping each row key to an object of properties,
+        {"row1": {"Prop": "value", ...}, "row2": {...}}
+
+      The rows are written as entity group transactions of at most
+      max_batch_rows entities, so a body of that size or less costs
+      a single storage round trip and is written all-or-nothing.
+     */
+    else if (paths[0] == update_batch) {
+      if (paths.size() != 3) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+
+      value rows {get_json_value(message)};
+      if ( ! rows.is_object() || rows.size() == 0) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+
+      vector<table_entity> entities {};
+      for (const auto& row : rows.as_object()) {
+        if ( ! row.second.is_object()) {
+          message.reply(status_codes::BadRequest);
+          return;
+        }
+        table_entity entity {paths[2], row.first};
+        table_entity::properties_type& properties = entity.properties();
+        for (const auto& prop : row.second.as_object()) {
+          if (prop.second.is_string())
+            properties[prop.first] = entity_property {prop.second.as_string()};
+          else
+            properties[prop.first] = entity_property {prop.second.serialize()};
+        }
+        entities.push_back(entity);
+      }
+
+      for (const auto& entity : entities)
+        property_index.add(paths[1], entity.partition_key(), entity.row_key(), property_names(entity.properties()));
+      for (vector<table_entity>::size_type start {0}; start < entities.size(); start += max_batch_rows) {
+        table_batch_operation batch {};
+        for (auto i = start; i < std::min(start + max_batch_rows, entities.size()); ++i) {
+          batch.insert_or_merge_entity(entities[i]);
+        }
+        table.execute_batch(batch);
+      }
+      // Each userid written may be new to AuthServer
+      if (paths[2] == auth_table_userid_partition) {
+        for (const auto& entity : entities)
+          auth_table_changed(paths[1], paths[2], entity.row_key());
+      }
+      else {
+        auth_table_changed(paths[1], paths[2], string {});
+      }
+      cout << "Batch update " << paths[2] << ": " << entities.size() << " rows" << endl;
+      message.reply(status_codes::OK);
+    }
+
     // Update entity with authorization
     else if (paths[0] == update_entity_auth) {
       unordered_map<string, string> message_properties = get_json_body(message);
-      message.reply(update_with_token(message, tables_endpoint, message_properties));
+      std::uint64_t stamp {0};
+      if (paths.size() == 5)
+        stamp = property_index.add(paths[1], paths[3], paths[4], property_names(message_properties));
+      status_code status {update_with_token(message, tables_endpoint, message_properties)};
+      if (stamp && refused(status))
+        property_index.undo(paths[1], paths[3], paths[4], stamp);
+      message.reply(status);
+    }
+
+    /*
+      Add an item to list properties of an entity, or remove one:
+        ListAddAuth/table/token/partition/row
+        ListRemoveAuth/table/token/partition/row
+      with a JSON body mapping each list property to the item,
+        {"Friends": "USA;Ann"}
+
+      The edit is made by this server in one request, whatever the
+      list's length, and a concurrent write of the entity is retried
+      rather than overwritten. See list_update_with_token().
+     */
+    else if (paths[0] == list_add_auth || paths[0] == list_remove_auth) {
+      unordered_map<string, string> message_properties = get_json_body(message);
+      std::uint64_t stamp {0};
+      if (paths.size() == 5 && paths[0] == list_add_auth)
+        stamp = property_index.add(paths[1], paths[3], paths[4], property_names(message_properties));
+      status_code status {list_update_with_token(message, tables_endpoint, message_properties,
+                                                 paths[0] == list_add_auth)};
+      if (stamp && refused(status))
+        property_index.undo(paths[1], paths[3], paths[4], stamp);
+      message.reply(status);
     }
 
     else {
@@ -484,6 +789,8 @@ void handle_delete(http_request message) {
     }
     table.delete_table();
     table_cache.delete_entry(table_name);
+    property_index.drop(table_name);
+    auth_table_changed(table_name, string {}, string {});
     message.reply(status_codes::OK);
   }
   // Delete entity
@@ -496,8 +803,12 @@ void handle_delete(http_request message) {
     table_entity entity {paths[2], paths[3]};
     cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
 
+    // A merge that recreates the entity meanwhile keeps it indexed
+    const std::uint64_t stamp {property_index.stamp(table_name, paths[2], paths[3])};
     table_operation operation {table_operation::delete_entity(entity)};
     table_result op_result {table.execute(operation)};
+    property_index.remove(table_name, paths[2], paths[3], stamp);
+    auth_table_changed(table_name, paths[2], paths[3]);
 
     int code {op_result.http_status_code()};
     if (code == status_codes::OK || 
@@ -522,6 +833,7 @@ void handle_delete(http_request message) {
 int main (int argc, char const * argv[]) {
   cout << "Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
+  invalidate_key = table_cache.service_key(invalidate_auth_op);
 
   cout << "Opening listener" << endl;
   http_listener listener {def_url};
@@ -0,0 +1,65 @@
+#include "BloomFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+
+/*
+  Two independent 64-bit hashes of key; the k probe positions are
+  h1 + i * h2 (Kirsch and Mitzenmacher)
+ */
+static void hash_pair (const string& key, uint64_t& h1, uint64_t& h2) {
+  h1 = std::hash<string> {} (key);
+  // FNV-1a
+  h2 = 14695981039346656037ull;
+  for (char c : key) {
+    h2 ^= static_cast<unsigned char>(c);
+    h2 *= 1099511628211ull;
+  }
+  h2 |= 1;  // Odd, so the probes do not repeat early
+}
+
+BloomFilter::BloomFilter (size_t expected, double false_positive_rate) :
+  bits {0},
+  hash_count {0},
+  words {},
+  added {0}
+  {
+    const double n {static_cast<double>(std::max<size_t>(1, expected))};
+    const double p {std::min(std::max(false_positive_rate, 1e-9), 0.5)};
+    const double ln2 {std::log(2.0)};
+    const size_t word_count {(static_cast<size_t>(std::ceil(-n * std::log(p) / (ln2 * ln2))) + 63) / 64};
+    bits = word_count * 64;
+    hash_count = std::max(1u, static_cast<unsigned>(std::lround(bits / n * ln2)));
+    words.reset(new std::atomic<uint64_t>[word_count]);
+    for (size_t i {0}; i < word_count; ++i)
+      words[i].store(0, std::memory_order_relaxed);
+  }
+
+void BloomFilter::add (const string& key) {
+  uint64_t h1 {0};
+  uint64_t h2 {0};
+  hash_pair(key, h1, h2);
+  for (unsigned i {0}; i < hash_count; ++i) {
+    const uint64_t bit {(h1 + i * h2) % bits};
+    words[bit / 64].fetch_or(uint64_t {1} << (bit % 64));
+  }
+  ++added;
+}
+
+bool BloomFilter::might_contain (const string& key) const {
+  uint64_t h1 {0};
+  uint64_t h2 {0};
+  hash_pair(key, h1, h2);
+  for (unsigned i {0}; i < hash_count; ++i) {
+    const uint64_t bit {(h1 + i * h2) % bits};
+    if ((words[bit / 64].load() & (uint64_t {1} << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
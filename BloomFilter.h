@@ -0,0 +1,41 @@
+#ifndef BloomFilter_h
+#define BloomFilter_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/*
+  Bloom filter of strings
+
+  might_contain() is false only for strings never added; it is true
+  for every added string and, wrongly, for about false_positive_rate
+  of the others while no more than expected strings have been added.
+  Strings cannot be removed.
+
+  add() and might_contain() may be called concurrently from any
+  number of threads.
+ */
+class BloomFilter {
+private:
+  std::size_t bits;
+  unsigned hash_count;
+  std::unique_ptr<std::atomic<std::uint64_t>[]> words;
+  std::atomic<std::size_t> added;
+
+public:
+  BloomFilter (std::size_t expected, double false_positive_rate);
+
+  BloomFilter (const BloomFilter&) = delete;
+  BloomFilter& operator= (const BloomFilter&) = delete;
+
+  void add (const std::string& key);
+  bool might_contain (const std::string& key) const;
+
+  std::size_t size () const { return added; }
+  std::size_t bit_count () const { return bits; }
+};
+
+#endif
@@ -9,10 +9,24 @@
 #include "ClientUtils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
 #include <string>
 #include <utility>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
@@ -218,13 +232,48 @@ string get_json_object_prop (const value& v, const string& propname) {
     return propval.serialize();
 }
 
-using pos_t = string::size_type;
-
 char pair_separator {'|'};
 char pair_delimiter {';'};
 
-static pos_t next_delim (const string& s, char delim, pos_t start) {
-  return s.find(delim, start);
+/*
+  Return the first position in [p, end) holding a or b, or end
+
+  Compares 32 characters at a time with AVX2 when the build targets
+  it, otherwise 16 at a time with SSE2 (every x86-64 has it), and
+  finishes the last few one by one.
+ */
+static const char* find_either (const char* p, const char* end, char a, char b) {
+#if defined(__AVX2__)
+  const __m256i wide_a = _mm256_set1_epi8(a);
+  const __m256i wide_b = _mm256_set1_epi8(b);
+  for (; end - p >= 32; p += 32) {
+    const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const unsigned mask {static_cast<unsigned>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, wide_a), _mm256_cmpeq_epi8(chunk, wide_b))))};
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i narrow_a = _mm_set1_epi8(a);
+  const __m128i narrow_b = _mm_set1_epi8(b);
+  for (; end - p >= 16; p += 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const unsigned mask {static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, narrow_a), _mm_cmpeq_epi8(chunk, narrow_b))))};
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p != end; ++p) {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return end;
+}
+
+static std::invalid_argument misformed (const string& friends_list) {
+  return std::invalid_argument(string("Misformed friends list: ") + friends_list);
 }
 
 /*
@@ -257,29 +306,60 @@ static pos_t next_delim (const string& s, char delim, pos_t start) {
 
    "USAMadonna|Canada" (no delimiter in opening "pair")
 
- Note: gcc 4.8.4's version of STL does not include full support for <regexp>,
- so this algorthm uses the more basic (and entirely adequate) string::find.
+ This version copies every country and name into its own string; the
+ version below that fills a vector of views allocates nothing once
+ the vector has grown to fit.
  */
 friends_list_t parse_friends_list (const string& friends_list) {
+  friends_view_t views {};
+  parse_friends_list (friends_list, views);
+
   friends_list_t res {};
+  res.reserve (views.size());
+  for (const auto& v : views)
+    res.push_back (make_pair (v.first.to_string(), v.second.to_string()));
+  return res;
+}
+
+/*
+ Set views to the (country, name) pairs of friends_list, as views
+ into friends_list, which must outlive them
+
+ Accepts and rejects exactly the strings parse_friends_list() above
+ does, throwing the same std::invalid_argument. views is cleared
+ first and keeps its capacity, so a caller that reuses one vector
+ parses without allocating.
 
-  pos_t start {0};
-  if (friends_list[start] == pair_separator)
-    start++; // Skip any initial separator
-  for (pos_t delim {next_delim (friends_list, pair_delimiter, start)};
-       delim != string::npos; 
-       delim = next_delim (friends_list, pair_delimiter, start)) {
-    pos_t end {next_delim (friends_list, pair_separator, start)};
-    if (end == string::npos)
-      end = friends_list.size();
-    if (end <= delim+1)
-      throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
-    string country {friends_list.substr (start, delim-start)};
-    string name {friends_list.substr (delim+1, end-delim-1)};
-    res.push_back (make_pair (country, name));
-    start = end+1;
+ Each pair takes one scan for the first delimiter or separator and
+ one for the separator that ends the name, both vectorized by
+ find_either().
+ */
+void parse_friends_list (const string& friends_list, friends_view_t& views) {
+  views.clear();
+  const char* const end {friends_list.data() + friends_list.size()};
+  const char* start {friends_list.data()};
+  if (start != end && *start == pair_separator)
+    ++start; // Skip any initial separator
+
+  while (start < end) {
+    const char* const first {find_either (start, end, pair_delimiter, pair_separator)};
+    if (first == end)
+      return; // Ignore trailing characters without a delimiter
+    if (*first == pair_separator) {
+      // A pair without a delimiter is an error, unless no pair follows it
+      if (find_either (first + 1, end, pair_delimiter, pair_delimiter) == end)
+        return;
+      throw misformed (friends_list);
+    }
+    const char* const stop {find_either (first + 1, end, pair_separator, pair_separator)};
+    if (stop == first + 1)
+      throw misformed (friends_list); // Empty name
+    views.push_back (make_pair (boost::string_ref (start, first - start),
+                                boost::string_ref (first + 1, stop - first - 1)));
+    if (stop == end)
+      return; // Not past the end: that would be undefined
+    start = stop + 1;
   }
-  return res;
 }
 
 /*
@@ -297,3 +377,88 @@ string friends_list_to_string (const friends_list_t& list) {
   }
   return result;
 }
+
+/*
+  Return the timeline partition key of the user (country, name)
+
+  A user's timeline holds one row per status delivered to them,
+  all in a single partition so that the latest updates can be
+  read with a range query over that partition.
+ */
+string timeline_partition (const string& country, const string& name) {
+  return country + pair_delimiter + name;
+}
+
+/*
+  Return the timeline partition key of a user parsed into views of
+  a friends list: the country, delimiter and name are contiguous
+  there, so the key is copied from the list in one piece
+ */
+string timeline_partition (const friends_view_t::value_type& user) {
+  return string (user.first.data(), user.second.data() + user.second.size());
+}
+
+/*
+  Return a fresh row key for a timeline entry
+
+  Azure Tables return the rows of a partition in ascending row key
+  order, so the key begins with the inverted timestamp (microseconds
+  remaining until the largest int64_t), zero-padded to 19 digits.
+  The most recent entry therefore sorts first. A process-wide sequence
+  number follows, so two entries created in the same microsecond
+  still get distinct keys.
+
+  A single key is meant to be used for every recipient of one status,
+  making a retried delivery overwrite rather than duplicate its row.
+ */
+string make_timeline_row_key () {
+  static std::atomic<std::uint32_t> seq {0};
+
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  using std::chrono::system_clock;
+  const std::int64_t now_us {duration_cast<microseconds>(system_clock::now().time_since_epoch()).count()};
+  const std::int64_t inverted {std::numeric_limits<std::int64_t>::max() - now_us};
+
+  char buf[32];
+  std::snprintf (buf, sizeof buf, "%019lld-%010u",
+                 static_cast<long long>(inverted),
+                 static_cast<unsigned>(seq++));
+  return string {buf};
+}
+
+/*
+  Return the count most recent entries of several timelines
+
+  Each timeline must be in ascending row key order, as returned by
+  ReadRangeAdmin. Because row keys begin with an inverted timestamp,
+  a k-way merge on row key yields the entries of all the timelines,
+  most recent first. An entry present in more than one timeline
+  (same row and author) is returned once.
+ */
+timeline_t merge_timelines (const vector<timeline_t>& timelines, timeline_t::size_type count) {
+  // (timeline index, position in that timeline)
+  using cursor_t = pair<vector<timeline_t>::size_type,timeline_t::size_type>;
+  auto later = [&timelines] (const cursor_t& a, const cursor_t& b) {
+    return timelines[a.first][a.second].row > timelines[b.first][b.second].row;
+  };
+  std::priority_queue<cursor_t,vector<cursor_t>,decltype(later)> heads {later};
+  for (vector<timeline_t>::size_type t {0}; t < timelines.size(); ++t) {
+    if ( ! timelines[t].empty())
+      heads.push(make_pair(t, 0));
+  }
+
+  timeline_t merged {};
+  while (merged.size() < count && ! heads.empty()) {
+    cursor_t head {heads.top()};
+    heads.pop();
+    const timeline_entry_t& entry (timelines[head.first][head.second]);
+    if (merged.empty()
+        || merged.back().row != entry.row
+        || merged.back().author != entry.author)
+      merged.push_back(entry);
+    if (++head.second < timelines[head.first].size())
+      heads.push(head);
+  }
+  return merged;
+}
@@ -6,6 +6,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/utility/string_ref.hpp>
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
@@ -15,9 +17,22 @@ using req_res_t = std::pair<web::http::status_code,web::json::value>;
 // Alias for a vector representing a friends list
 using friends_list_t = std::vector<std::pair<std::string,std::string>>;
 
+// Alias for a vector representing a friends list as views into its string
+using friends_view_t = std::vector<std::pair<boost::string_ref,boost::string_ref>>;
+
 // Alias for an unordered_map representing a JSON object's property/value pairs
 using value_string_t = std::unordered_map<std::string,std::string>;
 
+// One status in a timeline, identified by its row key
+struct timeline_entry_t {
+  std::string row;
+  std::string author;
+  std::string status;
+};
+
+// Alias for a vector of timeline entries, in ascending row key (most recent first) order
+using timeline_t = std::vector<timeline_entry_t>;
+
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body);
 
@@ -52,6 +67,21 @@ extern char pair_delimiter;
 friends_list_t
 parse_friends_list (const std::string& friends_list);
 
+void
+parse_friends_list (const std::string& friends_list, friends_view_t& views);
+
 std::string friends_list_to_string(const friends_list_t& list);
 
+std::string
+timeline_partition (const std::string& country, const std::string& name);
+
+std::string
+timeline_partition (const friends_view_t::value_type& user);
+
+std::string
+make_timeline_row_key ();
+
+timeline_t
+merge_timelines (const std::vector<timeline_t>& timelines, timeline_t::size_type count);
+
 #endif
@@ -0,0 +1,139 @@
+#include "CredentialCache.h"
+
+#include <algorithm>
+#include <string>
+
+using std::string;
+using std::uint64_t;
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+CredentialCache::CredentialCache (std::size_t max_entries,
+                                  milliseconds entry_ttl,
+                                  milliseconds absent_entry_ttl) :
+  capacity {std::max<std::size_t>(1, max_entries)},
+  ttl {entry_ttl},
+  absent_ttl {absent_entry_ttl},
+  lock {},
+  lru {},
+  entries {},
+  invalidation_epoch {0},
+  hit_count {0},
+  absent_hit_count {0},
+  miss_count {0},
+  expiration_count {0},
+  eviction_count {0},
+  invalidation_count {0}
+  {}
+
+/*
+  Remove an entry. Caller holds lock.
+ */
+void CredentialCache::remove (std::unordered_map<string,entry_t>::iterator entry) {
+  lru.erase(entry->second.position);
+  entries.erase(entry);
+}
+
+/*
+  Look up the cached entry of userid, setting credential if it is found
+ */
+CredentialCache::lookup_t CredentialCache::lookup (const string& userid, credential_t& credential) {
+  guard_t guard {lock};
+  auto entry (entries.find(userid));
+  if (entry == entries.end()) {
+    ++miss_count;
+    return lookup_t::miss;
+  }
+  if (entry->second.expires <= steady_clock::now()) {
+    remove(entry);
+    ++expiration_count;
+    ++miss_count;
+    return lookup_t::miss;
+  }
+  lru.splice(lru.begin(), lru, entry->second.position);
+  if ( ! entry->second.present) {
+    ++absent_hit_count;
+    return lookup_t::absent;
+  }
+  credential = entry->second.credential;
+  ++hit_count;
+  return lookup_t::found;
+}
+
+/*
+  Return the count of invalidations so far, to pass to insert()
+ */
+uint64_t CredentialCache::epoch () const {
+  guard_t guard {lock};
+  return invalidation_epoch;
+}
+
+/*
+  Cache entry for userid, read from AuthTable after epoch() returned
+  read_epoch, unless an invalidation has happened since
+ */
+void CredentialCache::put (const string& userid, const entry_t& entry, uint64_t read_epoch) {
+  guard_t guard {lock};
+  if (read_epoch != invalidation_epoch)
+    return;
+
+  auto existing (entries.find(userid));
+  if (existing != entries.end()) {
+    existing->second.present = entry.present;
+    existing->second.credential = entry.credential;
+    existing->second.expires = entry.expires;
+    lru.splice(lru.begin(), lru, existing->second.position);
+    return;
+  }
+
+  if (entries.size() >= capacity) {
+    remove(entries.find(lru.back()));
+    ++eviction_count;
+  }
+  lru.push_front(userid);
+  auto added (entries.emplace(userid, entry).first);
+  added->second.position = lru.begin();
+}
+
+void CredentialCache::insert (const string& userid, const credential_t& credential, uint64_t read_epoch) {
+  put(userid, entry_t {true, credential, steady_clock::now() + ttl, lru_t::iterator {}}, read_epoch);
+}
+
+/*
+  Remember that AuthTable had no entity for userid
+ */
+void CredentialCache::insert_absent (const string& userid, uint64_t read_epoch) {
+  put(userid, entry_t {false, credential_t {}, steady_clock::now() + absent_ttl, lru_t::iterator {}}, read_epoch);
+}
+
+/*
+  Drop the entry of userid, after its AuthTable entity has changed
+ */
+void CredentialCache::invalidate (const string& userid) {
+  guard_t guard {lock};
+  ++invalidation_epoch;
+  ++invalidation_count;
+  auto entry (entries.find(userid));
+  if (entry != entries.end())
+    remove(entry);
+}
+
+/*
+  Drop every entry, after a change to AuthTable as a whole
+ */
+void CredentialCache::clear () {
+  guard_t guard {lock};
+  ++invalidation_epoch;
+  invalidation_count += entries.size();
+  lru.clear();
+  entries.clear();
+}
+
+CredentialCache::metrics_t CredentialCache::metrics () const {
+  guard_t guard {lock};
+  return metrics_t {hit_count, absent_hit_count, miss_count, expiration_count,
+                    eviction_count, invalidation_count, entries.size()};
+}
@@ -0,0 +1,99 @@
+#ifndef CredentialCache_h
+#define CredentialCache_h
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+  Bounded cache of AuthTable entries for AuthServer
+
+  Each entry holds a user's password and the location of their data
+  for at most ttl after it was read from AuthTable. A userid that
+  AuthTable does not have is remembered as absent for the shorter
+  absent_ttl, so that repeated requests for it are answered from
+  memory too. When the cache holds capacity entries, the least
+  recently used one is evicted.
+
+  Writers of AuthTable call invalidate() (or clear()) afterwards. A
+  reader that missed takes epoch() before reading AuthTable and
+  passes it to insert(), which drops the entry if any invalidation
+  happened in between, so that a read racing with a write cannot
+  put the old entry back.
+ */
+class CredentialCache {
+public:
+  struct credential_t {
+    std::string password;
+    std::string partition;
+    std::string row;
+  };
+
+  enum class lookup_t {
+    miss,       // Not cached: read AuthTable
+    found,      // credential is set
+    absent      // AuthTable had no such userid
+  };
+
+  struct metrics_t {
+    std::uint64_t hits;
+    std::uint64_t absent_hits;
+    std::uint64_t misses;
+    std::uint64_t expirations;     // Entries found but past their ttl
+    std::uint64_t evictions;       // Entries dropped to stay within capacity
+    std::uint64_t invalidations;
+    std::size_t size;
+  };
+
+private:
+  using steady_time_t = std::chrono::steady_clock::time_point;
+  using lru_t = std::list<std::string>;
+
+  struct entry_t {
+    bool present;
+    credential_t credential;
+    steady_time_t expires;
+    lru_t::iterator position;      // Position in lru
+  };
+
+  std::size_t capacity;
+  std::chrono::milliseconds ttl;
+  std::chrono::milliseconds absent_ttl;
+
+  mutable std::mutex lock;
+  lru_t lru;                       // Userids, most recently used first
+  std::unordered_map<std::string,entry_t> entries;
+  std::uint64_t invalidation_epoch;
+
+  std::uint64_t hit_count;
+  std::uint64_t absent_hit_count;
+  std::uint64_t miss_count;
+  std::uint64_t expiration_count;
+  std::uint64_t eviction_count;
+  std::uint64_t invalidation_count;
+
+  void remove (std::unordered_map<std::string,entry_t>::iterator entry);
+  void put (const std::string& userid, const entry_t& entry, std::uint64_t read_epoch);
+
+public:
+  CredentialCache (std::size_t max_entries,
+                   std::chrono::milliseconds entry_ttl,
+                   std::chrono::milliseconds absent_entry_ttl);
+
+  CredentialCache (const CredentialCache&) = delete;
+  CredentialCache& operator= (const CredentialCache&) = delete;
+
+  lookup_t lookup (const std::string& userid, credential_t& credential);
+  std::uint64_t epoch () const;
+  void insert (const std::string& userid, const credential_t& credential, std::uint64_t read_epoch);
+  void insert_absent (const std::string& userid, std::uint64_t read_epoch);
+  void invalidate (const std::string& userid);
+  void clear ();
+
+  metrics_t metrics () const;
+};
+
+#endif
@@ -0,0 +1,191 @@
+/*
+  Write-behind delivery buffer for PushServer.
+ */
+
+#include "DeliveryBuffer.h"
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <utility>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using std::chrono::steady_clock;
+
+using guard_t = std::unique_lock<std::mutex>;
+
+DeliveryBuffer::DeliveryBuffer (flush_t flush,
+                                std::chrono::milliseconds flush_window,
+                                std::size_t batch_limit,
+                                unsigned flush_threads) :
+  flush_fn {flush},
+  window {flush_window},
+  max_batch {std::max<std::size_t>(1, batch_limit)},
+  thread_count {std::max(1u, flush_threads)},
+  lock {},
+  wake {},
+  batches {},
+  order {},
+  full {},
+  next_generation {0},
+  pending_count {0},
+  delivery_count {0},
+  write_count {0},
+  failed_count {0},
+  stopping {false},
+  threads {}
+  {}
+
+DeliveryBuffer::~DeliveryBuffer () {
+  stop();
+}
+
+void DeliveryBuffer::start () {
+  for (unsigned i {0}; i < thread_count; ++i)
+    threads.emplace_back(&DeliveryBuffer::run, this);
+}
+
+/*
+  Flush every buffered delivery, then stop the flush threads
+ */
+void DeliveryBuffer::stop () {
+  {
+    guard_t guard {lock};
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+}
+
+/*
+  Buffer a delivery to recipient
+
+  A delivery with the same row as one already buffered for the
+  recipient replaces it, so a retried job is written only once.
+  After stop(), deliveries are written immediately on the calling
+  thread.
+ */
+std::shared_future<bool> DeliveryBuffer::add (const string& recipient, const delivery_t& delivery) {
+  guard_t guard {lock};
+  ++delivery_count;
+
+  if (stopping) {
+    ++write_count;
+    guard.unlock();
+    std::promise<bool> done {};
+    bool ok {false};
+    try {
+      ok = flush_fn(recipient, vector<delivery_t> {delivery});
+    }
+    catch (const std::exception& e) {
+      cout << "DeliveryBuffer: write to " << recipient << " failed: " << e.what() << endl;
+    }
+    if ( ! ok) {
+      guard.lock();
+      ++failed_count;
+    }
+    done.set_value(ok);
+    return done.get_future().share();
+  }
+
+  auto entry (batches.find(recipient));
+  if (entry == batches.end()) {
+    batch_t batch {};
+    batch.generation = next_generation++;
+    batch.result = batch.done.get_future().share();
+    entry = batches.emplace(recipient, std::move(batch)).first;
+    order.push_back(due_t {steady_clock::now() + window, recipient, entry->second.generation});
+    wake.notify_one();
+  }
+
+  batch_t& batch (entry->second);
+  auto same_row = [&delivery] (const delivery_t& d) { return d.row == delivery.row; };
+  auto existing (std::find_if(batch.deliveries.begin(), batch.deliveries.end(), same_row));
+  if (existing != batch.deliveries.end()) {
+    *existing = delivery;
+  }
+  else {
+    batch.deliveries.push_back(delivery);
+    ++pending_count;
+    if (batch.deliveries.size() == max_batch) {
+      full.push_back(due_t {steady_clock::now(), recipient, batch.generation});
+      wake.notify_one();
+    }
+  }
+  return batch.result;
+}
+
+DeliveryBuffer::metrics_t DeliveryBuffer::metrics () const {
+  guard_t guard {lock};
+  return metrics_t {delivery_count, write_count, failed_count, pending_count};
+}
+
+/*
+  Remove the batch named by due, if it has not already been flushed
+  and replaced by a newer one. Caller holds lock.
+ */
+bool DeliveryBuffer::take (const due_t& due, string& recipient, batch_t& batch) {
+  auto entry (batches.find(due.recipient));
+  if (entry == batches.end() || entry->second.generation != due.generation)
+    return false;
+  recipient = due.recipient;
+  batch = std::move(entry->second);
+  batches.erase(entry);
+  pending_count -= batch.deliveries.size();
+  return true;
+}
+
+/*
+  Flush thread: write full batches at once and the rest when their window closes
+ */
+void DeliveryBuffer::run () {
+  guard_t guard {lock};
+  for (;;) {
+    string recipient {};
+    batch_t batch {};
+    bool found {false};
+
+    while ( ! found && ! full.empty()) {
+      due_t due {full.front()};
+      full.pop_front();
+      found = take(due, recipient, batch);
+    }
+    while ( ! found && ! order.empty()
+            && (stopping || order.front().due <= steady_clock::now())) {
+      due_t due {order.front()};
+      order.pop_front();
+      found = take(due, recipient, batch);
+    }
+
+    if ( ! found) {
+      if (stopping && batches.empty())
+        return;
+      if (order.empty())
+        wake.wait(guard);
+      else
+        wake.wait_until(guard, order.front().due);
+      continue;
+    }
+
+    ++write_count;
+    guard.unlock();
+    bool ok {false};
+    try {
+      ok = flush_fn(recipient, batch.deliveries);
+    }
+    catch (const std::exception& e) {
+      cout << "DeliveryBuffer: write to " << recipient << " failed: " << e.what() << endl;
+    }
+    batch.done.set_value(ok);
+    guard.lock();
+    if ( ! ok)
+      ++failed_count;
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef DeliveryBuffer_h
+#define DeliveryBuffer_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+  Write-behind buffer coalescing status deliveries per recipient
+
+  Deliveries to the same recipient that arrive within window of the
+  first one are handed to the flush function together, so they cost
+  a single storage write. A recipient's batch is flushed early once
+  it holds max_batch deliveries, and everything still buffered is
+  flushed by stop().
+
+  add() returns a future that becomes true once the delivery's batch
+  has been written, or false if that write failed.
+ */
+class DeliveryBuffer {
+public:
+  struct delivery_t {
+    std::string row;
+    std::string author;
+    std::string status;
+  };
+
+  using flush_t = std::function<bool (const std::string& recipient,
+                                      const std::vector<delivery_t>& deliveries)>;
+
+  struct metrics_t {
+    std::uint64_t deliveries;  // Deliveries passed to add()
+    std::uint64_t writes;      // Calls to the flush function
+    std::uint64_t failed_writes;
+    std::size_t pending;       // Deliveries buffered now
+  };
+
+private:
+  using steady_time_t = std::chrono::steady_clock::time_point;
+
+  struct batch_t {
+    std::uint64_t generation;
+    std::vector<delivery_t> deliveries;
+    std::promise<bool> done;
+    std::shared_future<bool> result;
+  };
+
+  struct due_t {
+    steady_time_t due;
+    std::string recipient;
+    std::uint64_t generation;
+  };
+
+  flush_t flush_fn;
+  std::chrono::milliseconds window;
+  std::size_t max_batch;
+  unsigned thread_count;
+
+  mutable std::mutex lock;
+  std::condition_variable wake;
+  std::unordered_map<std::string,batch_t> batches;
+  std::deque<due_t> order;    // Batches in the order their windows close
+  std::deque<due_t> full;     // Batches that reached max_batch
+  std::uint64_t next_generation;
+  std::size_t pending_count;
+  std::uint64_t delivery_count;
+  std::uint64_t write_count;
+  std::uint64_t failed_count;
+  bool stopping;
+  std::vector<std::thread> threads;
+
+  void run ();
+  bool take (const due_t& due, std::string& recipient, batch_t& batch);
+
+public:
+  DeliveryBuffer (flush_t flush,
+                  std::chrono::milliseconds flush_window,
+                  std::size_t batch_limit = 100,
+                  unsigned flush_threads = 4);
+  ~DeliveryBuffer ();
+
+  DeliveryBuffer (const DeliveryBuffer&) = delete;
+  DeliveryBuffer& operator= (const DeliveryBuffer&) = delete;
+
+  void start ();
+  void stop ();
+  std::shared_future<bool> add (const std::string& recipient, const delivery_t& delivery);
+  metrics_t metrics () const;
+};
+
+#endif
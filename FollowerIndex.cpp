@@ -0,0 +1,198 @@
+#include "FollowerIndex.h"
+
+#include <algorithm>
+#include <utility>
+
+using guard_t = std::lock_guard<std::mutex>;
+
+FollowerIndex::FollowerIndex () :
+  lock {},
+  index {},
+  loading {},
+  recipient_count {0},
+  load_count {0},
+  change_count {0},
+  ignored_count {0}
+  {}
+
+/*
+  Sort recipients and remove repeats
+ */
+void FollowerIndex::normalize (recipients_t& recipients) {
+  std::sort(recipients.begin(), recipients.end());
+  recipients.erase(std::unique(recipients.begin(), recipients.end()), recipients.end());
+}
+
+/*
+  Make recipients, normalized, the list of author. Caller holds lock.
+ */
+void FollowerIndex::replace (id_t author, recipients_t recipients) {
+  recipients_t& current (index[author]);
+  recipient_count -= current.size();
+  current = std::move(recipients);
+  recipient_count += current.size();
+}
+
+/*
+  Add recipient to recipients, an indexed list, or remove it if adding
+  is false. Caller holds lock.
+ */
+void FollowerIndex::change (recipients_t& recipients, id_t recipient, bool adding) {
+  auto at (std::lower_bound(recipients.begin(), recipients.end(), recipient));
+  const bool listed {at != recipients.end() && *at == recipient};
+  if (adding && ! listed) {
+    recipients.insert(at, recipient);
+    ++recipient_count;
+    ++change_count;
+  }
+  else if ( ! adding && listed) {
+    recipients.erase(at);
+    --recipient_count;
+    ++change_count;
+  }
+}
+
+/*
+  Queue a change to author, who is not indexed, for the load() under
+  way, returning false if none is. Caller holds lock.
+ */
+bool FollowerIndex::queue (id_t author, id_t recipient, bool adding) {
+  auto reading (loading.find(author));
+  if (reading == loading.end()) {
+    ++ignored_count;
+    return false;
+  }
+  reading->second.changes.push_back(std::make_pair(recipient, adding));
+  return true;
+}
+
+/*
+  Count out a reader of author. Caller holds lock.
+ */
+void FollowerIndex::end_load (id_t author) {
+  auto reading (loading.find(author));
+  if (reading != loading.end() && --reading->second.loaders == 0)
+    loading.erase(reading);
+}
+
+/*
+  Make recipients the list of author, whatever it was before
+ */
+void FollowerIndex::set (id_t author, recipients_t recipients) {
+  normalize(recipients);
+  guard_t guard {lock};
+  replace(author, std::move(recipients));
+  // Changes queued for a load are older than this list
+  auto reading (loading.find(author));
+  if (reading != loading.end())
+    reading->second.changes.clear();
+}
+
+/*
+  Record that the list of author is about to be read from storage,
+  so that changes arriving meanwhile are kept for load()
+ */
+void FollowerIndex::begin_load (id_t author) {
+  guard_t guard {lock};
+  loading.emplace(author, loading_t {0, false, {}}).first->second.loaders++;
+}
+
+/*
+  Make recipients, as read from storage since begin_load(), the list
+  of author, with the changes that arrived meanwhile applied, unless
+  author is indexed already
+
+  A list set while storage was being read is newer than what was
+  read, so it is kept, and so is nothing read since a drop().
+ */
+void FollowerIndex::load (id_t author, recipients_t recipients) {
+  normalize(recipients);
+  guard_t guard {lock};
+  auto reading (loading.find(author));
+  if ( ! index.count(author) && (reading == loading.end() || ! reading->second.stale)) {
+    if (reading != loading.end()) {
+      for (const auto& c : reading->second.changes) {
+        auto at (std::lower_bound(recipients.begin(), recipients.end(), c.first));
+        if (c.second && (at == recipients.end() || *at != c.first))
+          recipients.insert(at, c.first);
+        else if ( ! c.second && at != recipients.end() && *at == c.first)
+          recipients.erase(at);
+      }
+      reading->second.changes.clear();
+    }
+    replace(author, std::move(recipients));
+    ++load_count;
+  }
+  end_load(author);
+}
+
+/*
+  Record that the read begun by begin_load() failed
+ */
+void FollowerIndex::abandon (id_t author) {
+  guard_t guard {lock};
+  end_load(author);
+}
+
+/*
+  Add recipient to the list of author, returning false if author is
+  neither indexed nor being loaded
+ */
+bool FollowerIndex::add (id_t author, id_t recipient) {
+  guard_t guard {lock};
+  auto found (index.find(author));
+  if (found == index.end())
+    return queue(author, recipient, true);
+  change(found->second, recipient, true);
+  return true;
+}
+
+/*
+  Remove recipient from the list of author, returning false if author
+  is neither indexed nor being loaded
+ */
+bool FollowerIndex::remove (id_t author, id_t recipient) {
+  guard_t guard {lock};
+  auto found (index.find(author));
+  if (found == index.end())
+    return queue(author, recipient, false);
+  change(found->second, recipient, false);
+  return true;
+}
+
+/*
+  Forget the list of author, which is read from storage again when
+  next needed. A load under way would keep a list that may lack the
+  lost change, so it keeps nothing.
+ */
+void FollowerIndex::drop (id_t author) {
+  guard_t guard {lock};
+  auto reading (loading.find(author));
+  if (reading != loading.end()) {
+    reading->second.stale = true;
+    reading->second.changes.clear();
+  }
+  auto found (index.find(author));
+  if (found == index.end())
+    return;
+  recipient_count -= found->second.size();
+  index.erase(found);
+}
+
+/*
+  Set recipients to the list of author, returning false if author is
+  not indexed
+ */
+bool FollowerIndex::find (id_t author, recipients_t& recipients) const {
+  guard_t guard {lock};
+  auto found (index.find(author));
+  if (found == index.end())
+    return false;
+  recipients = found->second;
+  return true;
+}
+
+FollowerIndex::metrics_t FollowerIndex::metrics () const {
+  guard_t guard {lock};
+  return metrics_t {index.size(), recipient_count, load_count, change_count, ignored_count};
+}
@@ -0,0 +1,94 @@
+#ifndef FollowerIndex_h
+#define FollowerIndex_h
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "InternTable.h"
+
+/*
+  Recipients of each author's statuses, for PushServer
+
+  Authors and recipients are named by their ids in PushServer's
+  InternTable. An author's recipients are the friends in the
+  author's Friends property, so that PushStatus need only name the
+  author and the index says whom to deliver to.
+
+  An author enters the index with set(), when UserServer sends the
+  whole list as it loads it, or with load(), when PushServer reads
+  it from DataTable itself for an author it has never heard of.
+  After that add() and remove() follow each AddFriend and UnFriend
+  one recipient at a time. A change to an author not in the index
+  is ignored, as the list it would apply to is not known; the whole
+  list is read when the author is first needed. drop() forgets an
+  author whose changes may have been lost, so that the list is read
+  again in the same way.
+
+  A change can arrive while the list is being read, and the read may
+  have started before the change was written to storage. So a reader
+  calls begin_load() first, changes arriving meanwhile are queued,
+  and load() applies them to what was read; a reader that fails
+  calls abandon(). A set() meanwhile supersedes the queued changes,
+  and a drop() meanwhile discards what is being read.
+
+  Each author's recipients are kept sorted by id, so add() and
+  remove() are a binary search and a repeated friend is delivered
+  to once.
+ */
+class FollowerIndex {
+public:
+  using id_t = InternTable::id_t;
+  using recipients_t = std::vector<id_t>;
+
+  struct metrics_t {
+    std::size_t authors;       // Authors in the index
+    std::size_t recipients;    // Sum of their recipient counts
+    std::uint64_t loads;       // Authors read from storage by load()
+    std::uint64_t changes;     // add() and remove() calls that changed a list
+    std::uint64_t ignored;     // add() and remove() calls for authors not indexed
+  };
+
+private:
+  struct loading_t {
+    std::size_t loaders;       // Readers between begin_load() and load() or abandon()
+    bool stale;                // Dropped meanwhile, so what they read is not kept
+    std::vector<std::pair<id_t,bool>> changes;   // (recipient, added), in order
+  };
+
+  mutable std::mutex lock;
+  std::unordered_map<id_t,recipients_t> index;
+  std::unordered_map<id_t,loading_t> loading;
+  std::size_t recipient_count;
+  std::uint64_t load_count;
+  std::uint64_t change_count;
+  std::uint64_t ignored_count;
+
+  static void normalize (recipients_t& recipients);
+  void replace (id_t author, recipients_t recipients);
+  void change (recipients_t& recipients, id_t recipient, bool adding);
+  bool queue (id_t author, id_t recipient, bool adding);
+  void end_load (id_t author);
+
+public:
+  FollowerIndex ();
+
+  FollowerIndex (const FollowerIndex&) = delete;
+  FollowerIndex& operator= (const FollowerIndex&) = delete;
+
+  void set (id_t author, recipients_t recipients);
+  void begin_load (id_t author);
+  void load (id_t author, recipients_t recipients);
+  void abandon (id_t author);
+  bool add (id_t author, id_t recipient);
+  bool remove (id_t author, id_t recipient);
+  void drop (id_t author);
+
+  bool find (id_t author, recipients_t& recipients) const;
+
+  metrics_t metrics () const;
+};
+
+#endif
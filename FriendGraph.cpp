@@ -0,0 +1,161 @@
+#include "FriendGraph.h"
+
+#include <algorithm>
+
+using std::shared_ptr;
+using std::vector;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+FriendGraph::FriendGraph (InternTable& user_ids) :
+  users (user_ids),
+  lock {},
+  nodes {},
+  write_count {0},
+  unchanged_count {0}
+  {}
+
+shared_ptr<FriendGraph::node_t> FriendGraph::node_of (id_t owner) const {
+  guard_t guard {lock};
+  auto node (nodes.find(owner));
+  return node == nodes.end() ? nullptr : node->second;
+}
+
+/*
+  Return the position of id in edges, sorted by id, or where it
+  would be inserted. Caller holds the node's lock.
+ */
+vector<FriendGraph::edge_t>::iterator FriendGraph::find_edge (vector<edge_t>& edges, id_t id) {
+  return std::lower_bound(edges.begin(), edges.end(), id,
+                          [] (const edge_t& e, id_t target) { return e.id < target; });
+}
+
+/*
+  Return the friends in node in the order they were added
+ */
+FriendGraph::list_t FriendGraph::list_of (node_t& node) const {
+  vector<edge_t> edges {};
+  {
+    guard_t guard {node.lock};
+    edges = node.edges;
+  }
+  std::sort(edges.begin(), edges.end(),
+            [] (const edge_t& a, const edge_t& b) { return a.added < b.added; });
+
+  list_t list {};
+  list.reserve(edges.size());
+  for (const auto& e : edges)
+    list.push_back(users.user(e.id));
+  return list;
+}
+
+bool FriendGraph::loaded (id_t owner) const {
+  return node_of(owner) != nullptr;
+}
+
+/*
+  Load the friends list of owner, as read from storage, unless it is
+  loaded already, returning true if this call loaded it. Repeated
+  friends are kept once.
+
+  The call that loads the list then calls announce before any change()
+  to it can start. If announce fails, the list is dropped again, so
+  that the next use reads and announces it anew.
+ */
+bool FriendGraph::load (id_t owner, const list_t& friends, const write_t& announce) {
+  shared_ptr<node_t> node {std::make_shared<node_t>()};
+  node->next_added = 0;
+  for (const auto& f : friends) {
+    const id_t id {users.intern(f.first, f.second)};
+    auto at (find_edge(node->edges, id));
+    if (at == node->edges.end() || at->id != id)
+      node->edges.insert(at, edge_t {id, node->next_added++});
+  }
+
+  guard_t write_guard {node->write_lock};
+  {
+    guard_t guard {lock};
+    if ( ! nodes.emplace(owner, node).second)
+      return false;
+  }
+  if ( ! announce()) {
+    guard_t guard {lock};
+    auto current (nodes.find(owner));
+    if (current != nodes.end() && current->second == node)
+      nodes.erase(current);
+  }
+  return true;
+}
+
+/*
+  Forget the friends list of owner, which is read from storage again
+  on its next use
+ */
+void FriendGraph::drop (id_t owner) {
+  guard_t guard {lock};
+  nodes.erase(owner);
+}
+
+/*
+  Set list to the friends of owner, returning false if they are not
+  loaded
+ */
+bool FriendGraph::friends (id_t owner, list_t& list) const {
+  shared_ptr<node_t> node {node_of(owner)};
+  if ( ! node)
+    return false;
+  list = list_of(*node);
+  return true;
+}
+
+/*
+  Add f to the friends of owner, or remove f if adding is false,
+  calling write first to make the same change in storage
+
+  Returns unchanged, without calling write, if f is already listed
+  or not listed, and failed if write fails. A failed write drops the
+  list, so that it is read again from storage.
+ */
+FriendGraph::update_t FriendGraph::change (id_t owner, id_t f, bool adding, const write_t& write) {
+  shared_ptr<node_t> node {node_of(owner)};
+  if ( ! node)
+    return update_t::not_loaded;
+
+  guard_t write_guard {node->write_lock};
+  bool listed {false};
+  {
+    guard_t guard {node->lock};
+    auto at (find_edge(node->edges, f));
+    listed = at != node->edges.end() && at->id == f;
+  }
+  if (listed == adding) {
+    guard_t guard {lock};
+    ++unchanged_count;
+    return update_t::unchanged;
+  }
+
+  if ( ! write()) {
+    guard_t guard {lock};
+    auto current (nodes.find(owner));
+    if (current != nodes.end() && current->second == node)
+      nodes.erase(current);
+    return update_t::failed;
+  }
+  {
+    guard_t guard {node->lock};
+    auto at (find_edge(node->edges, f));
+    listed = at != node->edges.end() && at->id == f;
+    if (adding && ! listed)
+      node->edges.insert(at, edge_t {f, node->next_added++});
+    else if ( ! adding && listed)
+      node->edges.erase(at);
+  }
+  guard_t guard {lock};
+  ++write_count;
+  return update_t::changed;
+}
+
+FriendGraph::metrics_t FriendGraph::metrics () const {
+  guard_t guard {lock};
+  return metrics_t {nodes.size(), users.size(), write_count, unchanged_count};
+}
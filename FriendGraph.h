@@ -0,0 +1,104 @@
+#ifndef FriendGraph_h
+#define FriendGraph_h
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "InternTable.h"
+
+/*
+  In-memory friend lists of the users with sessions, for UserServer
+
+  Users are identified by their id in the server's InternTable, and
+  lists convert to (country, name) pairs only when loaded from
+  storage or returned by friends(). Each loaded user has an
+  adjacency vector of friend ids kept sorted by id, so a membership
+  test, add or remove is a binary search and no friends-list string
+  is parsed or searched. Membership is exact: "USA;Ann" is not taken
+  for a friend because "USA;Anna" is one. Every edge also keeps the
+  order it was added in, so that friends() keeps the order the
+  Friends property has, new friends last.
+
+  A user's list is loaded from storage on first use with load(), and
+  dropped when the session ends, so that the next session reads any
+  change made to the Friends property by other means. While loaded,
+  UserServer changes it with change(), which makes the same one-friend
+  edit in storage before it changes memory.
+
+  Several requests may read a list that is not loaded; only the one
+  whose load() inserts it calls announce, and does so holding the lock
+  change() holds, so whatever announce sends goes ahead of every
+  change to the list.
+
+  change() calls on one user's list are serialized, so storage sees
+  them in the order memory does. A change that memory shows is not
+  needed writes nothing.
+ */
+class FriendGraph {
+public:
+  using id_t = InternTable::id_t;
+  using friend_t = std::pair<std::string,std::string>;    // (country, name)
+  using list_t = std::vector<friend_t>;
+
+  // Make a change in storage, or announce a loaded list, returning
+  // true if it was made
+  using write_t = std::function<bool ()>;
+
+  enum class update_t {changed, unchanged, not_loaded, failed};
+
+  struct metrics_t {
+    std::size_t users;       // Users with a loaded list
+    std::size_t interned;    // Distinct ids in the intern table
+    std::uint64_t writes;    // Changes written to storage
+    std::uint64_t unchanged; // change() calls that needed no write
+  };
+
+private:
+  struct edge_t {
+    id_t id;
+    std::uint64_t added;     // Order of addition, for storage order
+  };
+
+  struct node_t {
+    std::mutex lock;
+    std::vector<edge_t> edges;     // Sorted by id
+    std::uint64_t next_added;
+
+    std::mutex write_lock;         // Held by change() and by load() throughout
+  };
+
+  InternTable& users;
+
+  mutable std::mutex lock;
+  std::unordered_map<id_t,std::shared_ptr<node_t>> nodes;
+  std::uint64_t write_count;
+  std::uint64_t unchanged_count;
+
+  std::shared_ptr<node_t> node_of (id_t owner) const;
+  list_t list_of (node_t& node) const;
+  static std::vector<edge_t>::iterator find_edge (std::vector<edge_t>& edges, id_t id);
+
+public:
+  explicit FriendGraph (InternTable& user_ids);
+
+  FriendGraph (const FriendGraph&) = delete;
+  FriendGraph& operator= (const FriendGraph&) = delete;
+
+  bool loaded (id_t owner) const;
+  bool load (id_t owner, const list_t& friends, const write_t& announce);
+  void drop (id_t owner);
+
+  bool friends (id_t owner, list_t& list) const;
+
+  update_t change (id_t owner, id_t f, bool adding, const write_t& write);
+
+  metrics_t metrics () const;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "InternTable.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <boost/thread/locks.hpp>
+
+using std::string;
+
+using read_lock_t = boost::shared_lock<boost::shared_mutex>;
+using write_lock_t = boost::unique_lock<boost::shared_mutex>;
+
+constexpr char key_delimiter {';'};
+
+InternTable::InternTable (std::size_t shard_count) :
+  shards {},
+  keys_lock {},
+  keys {}
+  {
+    shards.resize(std::max<std::size_t>(1, shard_count));
+    for (auto& shard : shards)
+      shard.reset(new shard_t {});
+  }
+
+InternTable::shard_t& InternTable::shard_for (const string& key) const {
+  return *shards[std::hash<string> {} (key) % shards.size()];
+}
+
+/*
+  Return the key of the user (country, name), as in timeline partitions
+ */
+string InternTable::key_of (const string& country, const string& name) {
+  return country + key_delimiter + name;
+}
+
+/*
+  Return the id of key, giving it the next id if it has none
+ */
+InternTable::id_t InternTable::intern (const string& key) {
+  shard_t& shard (shard_for(key));
+  {
+    read_lock_t guard {shard.lock};
+    auto found (shard.ids.find(key));
+    if (found != shard.ids.end())
+      return found->second;
+  }
+
+  write_lock_t guard {shard.lock};
+  auto found (shard.ids.find(key));
+  if (found != shard.ids.end())
+    return found->second;
+  id_t id {0};
+  {
+    write_lock_t keys_guard {keys_lock};
+    if (keys.size() > std::numeric_limits<id_t>::max())
+      throw std::length_error("InternTable: out of ids");
+    id = static_cast<id_t>(keys.size());
+    keys.push_back(key);
+  }
+  shard.ids.emplace(key, id);
+  return id;
+}
+
+InternTable::id_t InternTable::intern (const string& country, const string& name) {
+  return intern(key_of(country, name));
+}
+
+/*
+  Set id to the id of key, returning false if key was never interned
+ */
+bool InternTable::find (const string& key, id_t& id) const {
+  shard_t& shard (shard_for(key));
+  read_lock_t guard {shard.lock};
+  auto found (shard.ids.find(key));
+  if (found == shard.ids.end())
+    return false;
+  id = found->second;
+  return true;
+}
+
+/*
+  Return the key of id, which must have been returned by intern()
+ */
+const string& InternTable::key (id_t id) const {
+  read_lock_t guard {keys_lock};
+  return keys[id];
+}
+
+/*
+  Return (country, name) of id, which must have been returned by intern()
+ */
+InternTable::user_t InternTable::user (id_t id) const {
+  const string& k (key(id));
+  const string::size_type delim {k.find(key_delimiter)};
+  if (delim == string::npos)
+    return user_t {k, string {}};
+  return user_t {k.substr(0, delim), k.substr(delim + 1)};
+}
+
+std::size_t InternTable::size () const {
+  read_lock_t guard {keys_lock};
+  return keys.size();
+}
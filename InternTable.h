@@ -0,0 +1,69 @@
+#ifndef InternTable_h
+#define InternTable_h
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+/*
+  Concurrent intern table of user identities
+
+  A user is named everywhere by (country, name), which this table
+  maps, as the key "country;name" (the user's timeline partition), to
+  a dense 32-bit id: the first user interned gets 0, the next 1, and
+  so on. Code that compares, hashes or stores many users works on ids
+  and turns them back into strings only to talk to storage or a
+  client.
+
+  Keys are spread over shards by hash, each with its own
+  reader-writer lock, so lookups of known users run in parallel and
+  only the first sight of a user takes a write lock. Ids are never
+  reused, and the strings returned by key() stay valid for the life
+  of the table.
+
+  Each server keeps one table for all its users; ids mean nothing
+  outside the process that assigned them.
+ */
+class InternTable {
+public:
+  using id_t = std::uint32_t;
+  using user_t = std::pair<std::string,std::string>;    // (country, name)
+
+private:
+  struct shard_t {
+    mutable boost::shared_mutex lock;
+    std::unordered_map<std::string,id_t> ids;
+  };
+
+  std::vector<std::unique_ptr<shard_t>> shards;
+
+  mutable boost::shared_mutex keys_lock;
+  std::deque<std::string> keys;    // keys[id]; a deque never moves its elements
+
+  shard_t& shard_for (const std::string& key) const;
+
+public:
+  explicit InternTable (std::size_t shard_count = 64);
+
+  InternTable (const InternTable&) = delete;
+  InternTable& operator= (const InternTable&) = delete;
+
+  static std::string key_of (const std::string& country, const std::string& name);
+
+  id_t intern (const std::string& key);
+  id_t intern (const std::string& country, const std::string& name);
+  bool find (const std::string& key, id_t& id) const;
+
+  const std::string& key (id_t id) const;
+  user_t user (id_t id) const;
+  std::size_t size () const;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "PasswordVerifier.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using guard_t = std::lock_guard<std::mutex>;
+using bytes_t = vector<unsigned char>;
+
+const string scrypt_tag {"scrypt"};
+const string pbkdf2_tag {"pbkdf2-sha256"};
+
+// Cost of new hashes: scrypt takes 16 MB for N = 2^14, r = 8
+constexpr uint64_t scrypt_n {16384};
+constexpr uint64_t scrypt_r {8};
+constexpr uint64_t scrypt_p {1};
+constexpr uint64_t pbkdf2_iterations {100000};
+constexpr size_t salt_bytes {16};
+constexpr size_t hash_bytes {32};
+
+// Highest cost accepted from a stored hash, so a bad entry cannot stall a worker
+constexpr uint64_t max_scrypt_memory {64 * 1024 * 1024};
+constexpr uint64_t max_scrypt_p {16};
+constexpr uint64_t max_pbkdf2_iterations {10000000};
+
+PasswordVerifier::PasswordVerifier (size_t threads, size_t max_pending_jobs) :
+  max_pending {std::max<size_t>(1, max_pending_jobs)},
+  lock {},
+  work_ready {},
+  jobs {},
+  stopping {false},
+  verified_count {0},
+  busy_count {0},
+  workers {}
+  {
+    for (size_t i {0}; i < std::max<size_t>(1, threads); ++i)
+      workers.emplace_back(&PasswordVerifier::work, this);
+  }
+
+PasswordVerifier::~PasswordVerifier () {
+  {
+    guard_t guard {lock};
+    stopping = true;
+  }
+  work_ready.notify_all();
+  for (auto& w : workers)
+    w.join();
+  for (auto& job : jobs)
+    job.done.set(verdict_t::busy);
+}
+
+/*
+  Run queued verifications until stopping
+ */
+void PasswordVerifier::work () {
+  for (;;) {
+    job_t job {};
+    {
+      std::unique_lock<std::mutex> guard {lock};
+      work_ready.wait(guard, [this] () { return stopping || ! jobs.empty(); });
+      if (stopping)
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    const bool match {matches(job.password, job.stored)};
+    {
+      guard_t guard {lock};
+      ++verified_count;
+    }
+    job.done.set(match ? verdict_t::match : verdict_t::mismatch);
+  }
+}
+
+/*
+  Return a task completing with whether password matches the stored
+  password, or with busy if max_pending verifications are waiting
+ */
+pplx::task<PasswordVerifier::verdict_t> PasswordVerifier::verify (const string& password, const string& stored) {
+  pplx::task_completion_event<verdict_t> done {};
+  {
+    guard_t guard {lock};
+    if (stopping || jobs.size() >= max_pending) {
+      ++busy_count;
+      return pplx::task_from_result(verdict_t::busy);
+    }
+    jobs.push_back(job_t {password, stored, done});
+  }
+  work_ready.notify_one();
+  return pplx::create_task(done);
+}
+
+PasswordVerifier::metrics_t PasswordVerifier::metrics () {
+  guard_t guard {lock};
+  return metrics_t {verified_count, busy_count, jobs.size()};
+}
+
+/*
+  Split s at each '$'
+ */
+static vector<string> split_fields (const string& s) {
+  vector<string> fields {};
+  size_t start {0};
+  for (size_t end {s.find('$')}; end != string::npos; end = s.find('$', start)) {
+    fields.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  fields.push_back(s.substr(start));
+  return fields;
+}
+
+/*
+  Set n to the decimal number s, returning false if s is not one
+ */
+static bool parse_count (const string& s, uint64_t& n) {
+  if (s.empty() || s.size() > 19 || ! std::all_of(s.begin(), s.end(), [] (char c) { return c >= '0' && c <= '9'; }))
+    return false;
+  n = std::strtoull(s.c_str(), nullptr, 10);
+  return true;
+}
+
+static string to_base64 (const bytes_t& bytes) {
+  string text (4 * ((bytes.size() + 2) / 3) + 1, '\0');
+  text.resize(EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&text[0]), bytes.data(), static_cast<int>(bytes.size())));
+  return text;
+}
+
+/*
+  Set bytes to the decoding of base64 text, returning false if it is
+  not valid base64
+ */
+static bool from_base64 (const string& text, bytes_t& bytes) {
+  if (text.empty() || text.size() % 4 != 0)
+    return false;
+  bytes.assign(3 * text.size() / 4, 0);
+  const int size {EVP_DecodeBlock(bytes.data(), reinterpret_cast<const unsigned char*>(text.data()),
+                                  static_cast<int>(text.size()))};
+  if (size < 0)
+    return false;
+  // EVP_DecodeBlock counts the padding as decoded zero bytes
+  const size_t padding {static_cast<size_t>(std::count(text.end() - 2, text.end(), '='))};
+  bytes.resize(static_cast<size_t>(size) - padding);
+  return true;
+}
+
+/*
+  Parameters of a hashed password, as parse_hash() reads them
+ */
+struct stored_hash_t {
+  bool scrypt;
+  uint64_t n;
+  uint64_t r;
+  uint64_t p;
+  uint64_t iterations;
+  bytes_t salt;
+  bytes_t expected;
+};
+
+/*
+  Set hash to the parameters of stored, returning false unless it is
+  wholly one of the hashed forms: the right tag, the right number of
+  fields, decimal costs, and base64 salt and hash
+ */
+static bool parse_hash (const string& stored, stored_hash_t& hash) {
+  const vector<string> fields {split_fields(stored)};
+  if (fields.size() < 2 || ! fields[0].empty())
+    return false;
+  hash = stored_hash_t {false, 0, 0, 0, 0, {}, {}};
+  if (fields.size() == 7 && fields[1] == scrypt_tag) {
+    hash.scrypt = true;
+    if ( ! parse_count(fields[2], hash.n) || ! parse_count(fields[3], hash.r) || ! parse_count(fields[4], hash.p))
+      return false;
+  }
+  else if (fields.size() == 5 && fields[1] == pbkdf2_tag) {
+    if ( ! parse_count(fields[2], hash.iterations))
+      return false;
+  }
+  else
+    return false;
+  return from_base64(fields[fields.size() - 2], hash.salt) &&
+         from_base64(fields.back(), hash.expected) &&
+         ! hash.expected.empty();
+}
+
+/*
+  Set key to the hash of password under the parameters of hash,
+  returning false if they are outside the costs accepted or this
+  OpenSSL cannot compute them
+ */
+static bool derive (const string& password, const stored_hash_t& hash, bytes_t& key) {
+  key.assign(hash.expected.size(), 0);
+  if (hash.scrypt) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    const uint64_t n {hash.n};
+    if (n < 2 || (n & (n - 1)) != 0 || hash.r == 0 || hash.r > max_scrypt_memory / (128 * n) ||
+        hash.p == 0 || hash.p > max_scrypt_p)
+      return false;
+    return EVP_PBE_scrypt(password.data(), password.size(), hash.salt.data(), hash.salt.size(),
+                          n, hash.r, hash.p, 2 * max_scrypt_memory, key.data(), key.size()) == 1;
+#else
+    return false;
+#endif
+  }
+
+  if (hash.iterations == 0 || hash.iterations > max_pbkdf2_iterations)
+    return false;
+  return PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()),
+                           hash.salt.data(), static_cast<int>(hash.salt.size()),
+                           static_cast<int>(hash.iterations), EVP_sha256(),
+                           static_cast<int>(key.size()), key.data()) == 1;
+}
+
+/*
+  Return whether password matches the stored password, hashing it on
+  the calling thread
+
+  A stored value is taken as a hash only if parse_hash() reads it
+  wholly, and as a plaintext password otherwise, so a plaintext that
+  happens to start with '$' still signs on. A hash whose costs
+  derive() refuses matches nothing.
+
+  Plaintext passwords are not rehashed on a successful sign-on:
+  AuthTable is written by BasicServer, not here, and stored
+  plaintexts are converted with "authserver HashPassword".
+ */
+bool PasswordVerifier::matches (const string& password, const string& stored) {
+  stored_hash_t hash {};
+  if ( ! parse_hash(stored, hash)) {
+    // Compare digests, so that the time taken does not depend on the lengths either
+    unsigned char given[SHA256_DIGEST_LENGTH];
+    unsigned char kept[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(password.data()), password.size(), given);
+    SHA256(reinterpret_cast<const unsigned char*>(stored.data()), stored.size(), kept);
+    return CRYPTO_memcmp(given, kept, sizeof(given)) == 0;
+  }
+
+  bytes_t key {};
+  if ( ! derive(password, hash, key))
+    return false;
+  return CRYPTO_memcmp(key.data(), hash.expected.data(), key.size()) == 0;
+}
+
+/*
+  Return password hashed with a fresh random salt, in the form to
+  store in AuthTable
+ */
+string PasswordVerifier::hash (const string& password) {
+  bytes_t salt (salt_bytes, 0);
+  if (RAND_bytes(salt.data(), static_cast<int>(salt.size())) != 1)
+    throw std::runtime_error("PasswordVerifier: no random salt");
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  const string stored_prefix {"$" + scrypt_tag + "$" + std::to_string(scrypt_n) + "$" +
+                              std::to_string(scrypt_r) + "$" + std::to_string(scrypt_p) + "$"};
+#else
+  const string stored_prefix {"$" + pbkdf2_tag + "$" + std::to_string(pbkdf2_iterations) + "$"};
+#endif
+  const string stored_salt {stored_prefix + to_base64(salt) + "$"};
+
+  // Derive with the parser's own code, so hash() cannot disagree with matches()
+  stored_hash_t parsed {};
+  bytes_t key {};
+  if ( ! parse_hash(stored_salt + to_base64(bytes_t(hash_bytes, 0)), parsed) || ! derive(password, parsed, key))
+    throw std::runtime_error("PasswordVerifier: cannot hash");
+  return stored_salt + to_base64(key);
+}
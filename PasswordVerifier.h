@@ -0,0 +1,80 @@
+#ifndef PasswordVerifier_h
+#define PasswordVerifier_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Verifier of passwords against the salted hashes stored in AuthTable
+
+  A stored password is one of
+
+    $scrypt$N$r$p$salt$hash      scrypt (memory-hard), OpenSSL 1.1.0 on
+    $pbkdf2-sha256$i$salt$hash   PBKDF2-HMAC-SHA256 with i iterations
+    anything else                a plaintext password, from before hashing
+
+  with salt and hash in base64. Only a value that parses wholly as
+  one of the first two is a hash. hash() makes the strongest form the
+  OpenSSL in use supports.
+
+  Hashing is deliberately slow, so verify() never hashes on the
+  calling thread. It queues the work for a pool of one thread per
+  core and returns a task that completes with the verdict. At most
+  max_pending verifications wait in the queue; beyond that verify()
+  answers busy at once rather than let the queue, and every caller's
+  wait, grow without bound.
+
+  Comparisons take the same time wherever the inputs differ.
+ */
+class PasswordVerifier {
+public:
+  enum class verdict_t {match, mismatch, busy};
+
+  struct metrics_t {
+    std::uint64_t verified;
+    std::uint64_t rejected_busy;
+    std::size_t pending;
+  };
+
+private:
+  struct job_t {
+    std::string password;
+    std::string stored;
+    pplx::task_completion_event<verdict_t> done;
+  };
+
+  std::size_t max_pending;
+
+  std::mutex lock;
+  std::condition_variable work_ready;
+  std::deque<job_t> jobs;
+  bool stopping;
+  std::uint64_t verified_count;
+  std::uint64_t busy_count;
+
+  std::vector<std::thread> workers;
+
+  void work ();
+
+public:
+  PasswordVerifier (std::size_t threads, std::size_t max_pending_jobs);
+  ~PasswordVerifier ();
+
+  PasswordVerifier (const PasswordVerifier&) = delete;
+  PasswordVerifier& operator= (const PasswordVerifier&) = delete;
+
+  pplx::task<verdict_t> verify (const std::string& password, const std::string& stored);
+  metrics_t metrics ();
+
+  static bool matches (const std::string& password, const std::string& stored);
+  static std::string hash (const std::string& password);
+};
+
+#endif
@@ -0,0 +1,325 @@
+#include "PropertyIndex.h"
+
+#include <algorithm>
+#include <utility>
+
+using std::shared_ptr;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+PropertyIndex::PropertyIndex () :
+  lock {},
+  tables {},
+  build_count {0},
+  query_count {0}
+  {}
+
+/*
+  Return the key of entity partition/row in entity_ids. '/' cannot
+  occur in a partition key.
+ */
+string PropertyIndex::entity_key (const string& partition, const string& row) {
+  return partition + '/' + row;
+}
+
+/*
+  Return the index of table, or null if it has none
+ */
+shared_ptr<PropertyIndex::table_t> PropertyIndex::table_of (const string& table) const {
+  guard_t guard {lock};
+  auto found (tables.find(table));
+  return found == tables.end() ? nullptr : found->second;
+}
+
+/*
+  Renumber the live entities of t densely, purging removed ones from
+  the posting lists, and forget the names no entity has left. Ids
+  keep their order, so sorted lists stay sorted. Caller holds t.lock.
+ */
+void PropertyIndex::compact (table_t& t) {
+  constexpr id_t removed {static_cast<id_t>(-1)};
+  vector<id_t> renumbered (t.entities.size(), removed);
+  vector<entity_t> entities {};
+  entities.reserve(t.entity_ids.size());
+  for (id_t id {0}; id < t.entities.size(); ++id) {
+    if (t.entities[id].live) {
+      renumbered[id] = static_cast<id_t>(entities.size());
+      entities.push_back(std::move(t.entities[id]));
+    }
+  }
+  for (auto& e : t.entity_ids)
+    e.second = renumbered[e.second];
+  for (auto& p : t.postings) {
+    vector<id_t> ids {};
+    ids.reserve(p.ids.size());
+    for (id_t id : p.ids) {
+      if (renumbered[id] != removed)
+        ids.push_back(renumbered[id]);
+    }
+    p.ids = std::move(ids);
+  }
+
+  vector<id_t> renamed (t.postings.size(), removed);
+  vector<posting_t> postings {};
+  for (id_t name_id {0}; name_id < t.postings.size(); ++name_id) {
+    if ( ! t.postings[name_id].ids.empty()) {
+      renamed[name_id] = static_cast<id_t>(postings.size());
+      postings.push_back(std::move(t.postings[name_id]));
+    }
+  }
+  for (auto n (t.name_ids.begin()); n != t.name_ids.end(); ) {
+    if (renamed[n->second] == removed)
+      n = t.name_ids.erase(n);
+    else {
+      n->second = renamed[n->second];
+      ++n;
+    }
+  }
+  for (auto& e : entities) {
+    for (auto& name_id : e.names)
+      name_id = renamed[name_id];
+  }
+
+  t.entities = std::move(entities);
+  t.postings = std::move(postings);
+  t.dead = 0;
+  t.unused = 0;
+}
+
+/*
+  Remove entity id from t, leaving its ids in the posting lists for
+  find() to skip until compact() purges them. Caller holds t.lock.
+ */
+void PropertyIndex::erase (table_t& t, id_t id) {
+  entity_t& e (t.entities[id]);
+  e.live = false;
+  e.names.clear();
+  e.names.shrink_to_fit();
+  t.entity_ids.erase(entity_key(e.key.first, e.key.second));
+  if (++t.dead > t.entity_ids.size())
+    compact(t);
+}
+
+/*
+  Start indexing table, returning true if the caller is to scan it
+  into add() and then call finish(), or false if it is indexed or
+  being built already
+ */
+bool PropertyIndex::start (const string& table) {
+  shared_ptr<table_t> t {std::make_shared<table_t>()};
+  t->ready = false;
+  t->dead = 0;
+  t->unused = 0;
+  t->next_stamp = 0;
+  guard_t guard {lock};
+  return tables.emplace(table, t).second;
+}
+
+/*
+  Make the index of table, whose scan is complete, usable by find()
+ */
+void PropertyIndex::finish (const string& table) {
+  shared_ptr<table_t> t {table_of(table)};
+  if ( ! t)
+    return;
+  guard_t guard {t->lock};
+  if (t->ready)
+    return;
+  t->ready = true;
+  ++build_count;
+}
+
+/*
+  Forget the index of table, because the table was deleted or the
+  scan building it failed
+ */
+void PropertyIndex::drop (const string& table) {
+  guard_t guard {lock};
+  tables.erase(table);
+}
+
+/*
+  Record that entity partition/row of table has properties names,
+  and any it had before, returning the stamp of this add, or 0 if
+  table is not indexed
+ */
+uint64_t PropertyIndex::add (const string& table, const string& partition, const string& row, const names_t& names) {
+  shared_ptr<table_t> found {table_of(table)};
+  if ( ! found)
+    return 0;
+  table_t& t (*found);
+  guard_t guard {t.lock};
+
+  const auto entity (t.entity_ids.emplace(entity_key(partition, row), static_cast<id_t>(t.entities.size())));
+  const id_t id {entity.first->second};
+  if (entity.second)
+    t.entities.push_back(entity_t {key_t {partition, row}, {}, true, 0, 0, true});
+  else
+    t.entities[id].created = false;
+  t.entities[id].stamp = ++t.next_stamp;
+  t.entities[id].fresh = 0;
+
+  for (const auto& name : names) {
+    const auto named (t.name_ids.emplace(name, static_cast<id_t>(t.postings.size())));
+    const id_t name_id {named.first->second};
+    if (named.second)
+      t.postings.push_back(posting_t {{}, false});
+
+    vector<id_t>& has (t.entities[id].names);
+    if (std::find(has.begin(), has.end(), name_id) != has.end())
+      continue;
+    has.push_back(name_id);
+    ++t.entities[id].fresh;
+    posting_t& p (t.postings[name_id]);
+    if ( ! p.ids.empty() && p.ids.back() > id)
+      p.dirty = true;
+    p.ids.push_back(id);
+  }
+  return t.entities[id].stamp;
+}
+
+/*
+  Return the stamp of the latest add of entity partition/row of
+  table, or 0 if it or table is not indexed
+ */
+uint64_t PropertyIndex::stamp (const string& table, const string& partition, const string& row) {
+  shared_ptr<table_t> found {table_of(table)};
+  if ( ! found)
+    return 0;
+  table_t& t (*found);
+  guard_t guard {t.lock};
+  auto entity (t.entity_ids.find(entity_key(partition, row)));
+  return entity == t.entity_ids.end() ? 0 : t.entities[entity->second].stamp;
+}
+
+/*
+  Record that entity partition/row of table was deleted, unless it
+  was added since stamp() returned stamp, as the add is then of an
+  entity written after the delete. Ignored if table is not indexed.
+ */
+void PropertyIndex::remove (const string& table, const string& partition, const string& row, uint64_t stamp) {
+  shared_ptr<table_t> found {table_of(table)};
+  if ( ! found)
+    return;
+  table_t& t (*found);
+  guard_t guard {t.lock};
+
+  auto entity (t.entity_ids.find(entity_key(partition, row)));
+  if (entity == t.entity_ids.end() || t.entities[entity->second].stamp != stamp)
+    return;
+  erase(t, entity->second);
+}
+
+/*
+  Take back the add of entity partition/row of table that returned
+  stamp, as storage refused the write: remove the entity if that add
+  created it, and otherwise the names it gave the entity. Nothing is
+  taken back if the entity was added again since.
+ */
+void PropertyIndex::undo (const string& table, const string& partition, const string& row, uint64_t stamp) {
+  shared_ptr<table_t> found {table_of(table)};
+  if ( ! found)
+    return;
+  table_t& t (*found);
+  guard_t guard {t.lock};
+
+  auto entity (t.entity_ids.find(entity_key(partition, row)));
+  if (entity == t.entity_ids.end())
+    return;
+  const id_t id {entity->second};
+  entity_t& e (t.entities[id]);
+  if (e.stamp != stamp)
+    return;
+  if (e.created) {
+    erase(t, id);
+    return;
+  }
+
+  for (auto name_id (e.names.end() - e.fresh); name_id != e.names.end(); ++name_id) {
+    vector<id_t>& ids (t.postings[*name_id].ids);
+    ids.erase(std::find(ids.begin(), ids.end(), id));
+    if (ids.empty())
+      ++t.unused;
+  }
+  e.names.resize(e.names.size() - e.fresh);
+  e.fresh = 0;
+  if (t.unused > t.name_ids.size() / 2)
+    compact(t);
+}
+
+/*
+  Set keys to the entities of table that have every property in
+  names, in no particular order, returning false if table is not
+  indexed yet
+ */
+bool PropertyIndex::find (const string& table, const names_t& names, vector<key_t>& keys) {
+  keys.clear();
+  shared_ptr<table_t> found {table_of(table)};
+  if ( ! found)
+    return false;
+  table_t& t (*found);
+  guard_t guard {t.lock};
+  if ( ! t.ready)
+    return false;
+  ++query_count;
+
+  if (names.empty()) {
+    for (const auto& e : t.entities) {
+      if (e.live)
+        keys.push_back(e.key);
+    }
+    return true;
+  }
+
+  vector<posting_t*> lists {};
+  for (const auto& name : names) {
+    auto named (t.name_ids.find(name));
+    if (named == t.name_ids.end())
+      return true;
+    posting_t& p (t.postings[named->second]);
+    if (p.dirty) {
+      std::sort(p.ids.begin(), p.ids.end());
+      p.dirty = false;
+    }
+    lists.push_back(&p);
+  }
+  std::sort(lists.begin(), lists.end(),
+            [] (const posting_t* a, const posting_t* b) { return a->ids.size() < b->ids.size(); });
+
+  // Each later list is searched from where the last match was found
+  vector<vector<id_t>::const_iterator> from {};
+  for (const auto p : lists)
+    from.push_back(p->ids.begin());
+  for (id_t id : lists[0]->ids) {
+    if ( ! t.entities[id].live)
+      continue;
+    bool in_all {true};
+    for (vector<posting_t*>::size_type i {1}; i < lists.size() && in_all; ++i) {
+      from[i] = std::lower_bound(from[i], lists[i]->ids.cend(), id);
+      in_all = from[i] != lists[i]->ids.cend() && *from[i] == id;
+    }
+    if (in_all)
+      keys.push_back(t.entities[id].key);
+  }
+  return true;
+}
+
+PropertyIndex::metrics_t PropertyIndex::metrics () const {
+  vector<shared_ptr<table_t>> indexed {};
+  {
+    guard_t guard {lock};
+    for (const auto& t : tables)
+      indexed.push_back(t.second);
+  }
+  metrics_t m {indexed.size(), 0, 0, build_count, query_count};
+  for (const auto& t : indexed) {
+    guard_t guard {t->lock};
+    m.entities += t->entity_ids.size();
+    for (const auto& p : t->postings)
+      m.postings += p.ids.size();
+  }
+  return m;
+}
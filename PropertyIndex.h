@@ -0,0 +1,129 @@
+#ifndef PropertyIndex_h
+#define PropertyIndex_h
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+  Index from property name to the entities having it, for
+  BasicServer's GET by properties
+
+  For each indexed table, every entity key (partition, row) gets a
+  dense id, and every property name a posting list of the ids of the
+  entities with that property. find() intersects the posting lists of
+  the requested names, starting from the shortest, so its cost
+  follows the smallest list rather than the size of the table.
+
+  A table is indexed on its first query: start() marks it as being
+  built, the caller scans it into add(), and finish() makes it usable.
+  Writes made meanwhile are recorded too, so none is missed. From
+  then on BasicServer reports each write: add() for the property
+  names an insert or merge is to give an entity, before making it,
+  and remove() for a deleted entity and drop() for a deleted table,
+  after.
+
+  Merges only add properties, and an entity is added before it is
+  written, so the index holds at least every entity that has the
+  names asked for, even while the write is under way. It can hold
+  more, as when a write fails or a delete races the scan that builds
+  it, so callers check each entity they read.
+
+  Every add() gets a stamp, higher than any before it in the table,
+  and the entity keeps the stamp of its latest add(). A delete takes
+  the entity's stamp() before deleting and passes it to remove(),
+  which then leaves alone an entity added again meanwhile, as by a
+  merge that recreated it. A write that storage refused is taken
+  back with undo() and the stamp add() returned, which removes just
+  what that add() put in, unless the entity was added again since.
+
+  Each table has its own lock, so that a find() sorting and
+  intersecting long posting lists holds up only the writes of its
+  own table.
+
+  Posting lists take new ids at the end and are sorted, if need be,
+  by the next find(). Removed ids are skipped by find() and purged
+  when they outnumber the live ones, so an update or delete costs no
+  more than a hash lookup per name.
+ */
+class PropertyIndex {
+public:
+  using key_t = std::pair<std::string,std::string>;    // (partition, row)
+  using names_t = std::vector<std::string>;
+
+  struct metrics_t {
+    std::size_t tables;        // Tables indexed or being built
+    std::size_t entities;      // Live entities in them
+    std::size_t postings;      // Entries in all posting lists
+    std::uint64_t builds;      // Tables built by a scan
+    std::uint64_t queries;     // find() calls answered from the index
+  };
+
+private:
+  using id_t = std::uint32_t;
+
+  struct entity_t {
+    key_t key;
+    std::vector<id_t> names;   // Ids of the entity's property names
+    bool live;
+    std::uint64_t stamp;       // Of the latest add()
+    std::uint32_t fresh;       // Names the latest add() appended to names
+    bool created;              // Whether the latest add() created the entity
+  };
+
+  struct posting_t {
+    std::vector<id_t> ids;     // Entity ids, sorted unless dirty
+    bool dirty;
+  };
+
+  struct table_t {
+    std::mutex lock;
+    bool ready;
+    std::unordered_map<std::string,id_t> entity_ids;   // By entity_key()
+    std::vector<entity_t> entities;                     // By entity id
+    std::unordered_map<std::string,id_t> name_ids;
+    std::vector<posting_t> postings;                    // By name id
+    std::size_t dead;
+    std::size_t unused;        // Names whose posting lists undo() emptied
+    std::uint64_t next_stamp;
+  };
+
+  mutable std::mutex lock;     // Guards tables, not the tables' contents
+  std::unordered_map<std::string,std::shared_ptr<table_t>> tables;
+  std::atomic<std::uint64_t> build_count;
+  std::atomic<std::uint64_t> query_count;
+
+  static std::string entity_key (const std::string& partition, const std::string& row);
+  static void compact (table_t& t);
+  static void erase (table_t& t, id_t id);
+  std::shared_ptr<table_t> table_of (const std::string& table) const;
+
+public:
+  PropertyIndex ();
+
+  PropertyIndex (const PropertyIndex&) = delete;
+  PropertyIndex& operator= (const PropertyIndex&) = delete;
+
+  bool start (const std::string& table);
+  void finish (const std::string& table);
+  void drop (const std::string& table);
+
+  std::uint64_t add (const std::string& table, const std::string& partition, const std::string& row,
+                     const names_t& names);
+  std::uint64_t stamp (const std::string& table, const std::string& partition, const std::string& row);
+  void remove (const std::string& table, const std::string& partition, const std::string& row,
+               std::uint64_t stamp);
+  void undo (const std::string& table, const std::string& partition, const std::string& row,
+             std::uint64_t stamp);
+
+  bool find (const std::string& table, const names_t& names, std::vector<key_t>& keys);
+
+  metrics_t metrics () const;
+};
+
+#endif
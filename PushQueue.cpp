@@ -0,0 +1,468 @@
+/*
+  Durable push queue for PushServer.
+
+  Log record format:
+
+    <enqueued_ms> <payload length>\n<payload>\n
+
+  The checkpoint file holds a single decimal offset into the log
+  file.
+ */
+
+#include "PushQueue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+using guard_t = std::unique_lock<std::mutex>;
+
+static std::int64_t now_ms () {
+  return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+/*
+  Write all of buf to fd, retrying short writes
+ */
+static bool write_all (int fd, const string& buf) {
+  const char* p {buf.data()};
+  string::size_type left {buf.size()};
+  while (left > 0) {
+    ssize_t n {::write(fd, p, left)};
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+PushQueue::PushQueue (const string& path,
+                      handler_t job_handler,
+                      unsigned workers,
+                      unsigned attempts) :
+  log_path {path},
+  checkpoint_path {path + ".ckpt"},
+  handler {job_handler},
+  worker_count {std::max(1u, workers)},
+  max_attempts {std::max(1u, attempts)},
+  base_backoff {250},
+  max_backoff {30000},
+  compact_bytes {1 << 20},
+  checkpoint_every {64},
+  checkpoint_interval {1000},
+  append_lock {},
+  log_fd {-1},
+  tail {0},
+  checkpoint_lock {},
+  lock {},
+  wake {},
+  ready {},
+  delayed {},
+  pending {},
+  pending_bytes {0},
+  completed_end {0},
+  base {0},
+  head {0},
+  relocated {},
+  unsaved {0},
+  saved_at {steady_clock::now()},
+  in_flight {0},
+  enqueued_count {0},
+  completed_count {0},
+  retry_count {0},
+  dropped_count {0},
+  stopping {false},
+  workers {}
+  {}
+
+PushQueue::~PushQueue () {
+  stop();
+}
+
+/*
+  Reload uncompleted jobs from the log, then start the workers
+ */
+void PushQueue::start () {
+  replay();
+  log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (log_fd < 0)
+    throw std::runtime_error("PushQueue: cannot open " + log_path);
+
+  for (unsigned i {0}; i < worker_count; ++i)
+    workers.emplace_back(&PushQueue::work, this);
+}
+
+/*
+  Stop the workers once their current jobs finish
+
+  Jobs still queued remain in the log and are replayed by the next start().
+ */
+void PushQueue::stop () {
+  {
+    guard_t guard {lock};
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& w : workers)
+    w.join();
+  workers.clear();
+
+  if (log_fd >= 0) {
+    write_checkpoint();
+    ::close(log_fd);
+    log_fd = -1;
+  }
+}
+
+/*
+  Append a job to the log and queue it for delivery
+
+  Returns false if the job could not be made durable, in which case
+  it has not been queued.
+ */
+bool PushQueue::enqueue (const string& payload) {
+  guard_t append_guard {append_lock};
+  const std::int64_t enqueued_ms {now_ms()};
+  std::ostringstream record {};
+  record << enqueued_ms << ' ' << payload.size() << '\n' << payload << '\n';
+  const string buf {record.str()};
+
+  if (log_fd < 0 || ! write_all(log_fd, buf) || ::fdatasync(log_fd) != 0) {
+    cout << "PushQueue: append to " << log_path << " failed" << endl;
+    return false;
+  }
+
+  job_t job {tail, tail + buf.size(), enqueued_ms, payload, 0};
+  tail = job.end;
+
+  guard_t guard {lock};
+  pending[job.offset] = record_t {job.end, enqueued_ms};
+  pending_bytes += job.end - job.offset;
+  ready.push_back(std::move(job));
+  ++enqueued_count;
+  guard.unlock();
+  wake.notify_one();
+  return true;
+}
+
+PushQueue::metrics_t PushQueue::metrics () const {
+  guard_t guard {lock};
+  metrics_t m {};
+  m.depth = pending.size();
+  m.in_flight = in_flight;
+  m.enqueued = enqueued_count;
+  m.completed = completed_count;
+  m.retries = retry_count;
+  m.dropped = dropped_count;
+  m.drain_lag_ms = pending.empty() ? 0 : now_ms() - pending.begin()->second.enqueued_ms;
+  return m;
+}
+
+/*
+  Read the checkpoint and queue every complete record after it
+
+  A torn record at the end of the log (from a crash mid-append)
+  is truncated away.
+ */
+void PushQueue::replay () {
+  uint64_t checkpoint {0};
+  {
+    std::ifstream ckpt {checkpoint_path};
+    if ( ! (ckpt >> checkpoint))
+      checkpoint = 0;
+  }
+
+  std::ifstream log {log_path, std::ios::binary};
+  if ( ! log) {
+    tail = 0;
+    completed_end = 0;
+    return;
+  }
+  log.seekg(0, std::ios::end);
+  const uint64_t size {static_cast<uint64_t>(log.tellg())};
+  if (checkpoint > size)
+    checkpoint = 0;
+  log.seekg(checkpoint);
+
+  uint64_t offset {checkpoint};
+  for (;;) {
+    string header {};
+    if ( ! std::getline(log, header))
+      break;
+    std::istringstream fields {header};
+    std::int64_t enqueued_ms {0};
+    string::size_type length {0};
+    if ( ! (fields >> enqueued_ms >> length))
+      break;
+    string payload (length, '\0');
+    if ( ! log.read(&payload[0], length) || log.get() != '\n')
+      break;
+
+    const uint64_t end {offset + header.size() + 1 + length + 1};
+    pending[offset] = record_t {end, enqueued_ms};
+    pending_bytes += end - offset;
+    ready.push_back(job_t {offset, end, enqueued_ms, payload, 0});
+    offset = end;
+  }
+  log.close();
+
+  if (offset < size) {
+    cout << "PushQueue: truncating torn record at offset " << offset << endl;
+    if (::truncate(log_path.c_str(), offset) != 0)
+      cout << "PushQueue: truncate failed" << endl;
+  }
+  tail = offset;
+  completed_end = checkpoint;
+  base = 0;
+  head = 0;
+  relocated.clear();
+  cout << "PushQueue: replayed " << ready.size() << " jobs from " << log_path << endl;
+}
+
+/*
+  Worker thread: deliver ready jobs, rescheduling failures with backoff
+ */
+void PushQueue::work () {
+  guard_t guard {lock};
+  for (;;) {
+    const steady_time_t now {steady_clock::now()};
+    while ( ! delayed.empty() && delayed.begin()->first <= now) {
+      ready.push_back(std::move(delayed.begin()->second));
+      delayed.erase(delayed.begin());
+    }
+    if (stopping)
+      return;
+    if (ready.empty()) {
+      if (delayed.empty())
+        wake.wait(guard);
+      else
+        wake.wait_until(guard, delayed.begin()->first);
+      continue;
+    }
+
+    job_t job {std::move(ready.front())};
+    ready.pop_front();
+    ++in_flight;
+    guard.unlock();
+
+    bool delivered {false};
+    try {
+      delivered = handler(job.payload);
+    }
+    catch (const std::exception& e) {
+      cout << "PushQueue: job at " << job.offset << " failed: " << e.what() << endl;
+    }
+
+    guard.lock();
+    --in_flight;
+    if (delivered) {
+      ++completed_count;
+      complete(job);
+    }
+    else if (++job.attempts >= max_attempts) {
+      cout << "PushQueue: dropping job at " << job.offset
+           << " after " << job.attempts << " attempts" << endl;
+      ++dropped_count;
+      complete(job);
+    }
+    else {
+      ++retry_count;
+      const unsigned shift {std::min(job.attempts - 1, 16u)};
+      const milliseconds backoff {std::min(max_backoff, base_backoff * (1 << shift))};
+      delayed.emplace(steady_clock::now() + backoff, std::move(job));
+      continue;
+    }
+
+    const bool shrink {compaction_due()};
+    if (shrink || unsaved >= checkpoint_every || steady_clock::now() - saved_at >= checkpoint_interval) {
+      guard.unlock();
+      if (shrink)
+        compact();
+      else
+        write_checkpoint();
+      guard.lock();
+    }
+  }
+}
+
+/*
+  Retire a job. Caller holds lock.
+
+  The checkpoint moves past the job when it is next written.
+ */
+void PushQueue::complete (const job_t& job) {
+  if (pending.erase(job.offset))
+    pending_bytes -= job.end - job.offset;
+  relocated.erase(job.offset);
+  completed_end = std::max(completed_end, job.end);
+  ++unsaved;
+}
+
+/*
+  Return the offset of the oldest uncompleted job, or of the end of
+  the completed jobs if there is none. Caller holds lock.
+ */
+uint64_t PushQueue::checkpoint_offset () const {
+  return pending.empty() ? completed_end : pending.begin()->first;
+}
+
+/*
+  Return where in the log file the record at offset is, which must
+  be uncompleted or logged since the last compaction. Caller holds
+  lock.
+ */
+uint64_t PushQueue::file_offset (uint64_t offset) const {
+  auto copied (relocated.find(offset));
+  if (copied != relocated.end())
+    return copied->second;
+  return head + (offset - base);
+}
+
+/*
+  Return whether the log holds compact_bytes of completed jobs, and
+  more of them than of uncompleted ones. Caller holds lock.
+ */
+bool PushQueue::compaction_due () const {
+  const uint64_t logged {pending.empty() ? completed_end : std::max(completed_end, pending.rbegin()->second.end)};
+  const uint64_t size {head + (logged > base ? logged - base : 0)};
+  const uint64_t completed {size > pending_bytes ? size - pending_bytes : 0};
+  return completed >= compact_bytes && completed > pending_bytes;
+}
+
+/*
+  Make offset, into the log file, the checkpoint. Caller holds
+  checkpoint_lock.
+
+  The checkpoint is written to a temporary file and renamed into
+  place, so a crash leaves either the old or the new offset. It is
+  not synced: losing an update only causes redelivery.
+ */
+void PushQueue::store_checkpoint (uint64_t offset) {
+  const string tmp {checkpoint_path + ".tmp"};
+  {
+    std::ofstream out {tmp, std::ios::trunc};
+    out << offset << '\n';
+    if ( ! out)
+      return;
+  }
+  std::rename(tmp.c_str(), checkpoint_path.c_str());
+}
+
+/*
+  Persist the offset of the oldest uncompleted job
+ */
+void PushQueue::write_checkpoint () {
+  guard_t checkpoint_guard {checkpoint_lock};
+  uint64_t offset {0};
+  {
+    guard_t guard {lock};
+    offset = file_offset(checkpoint_offset());
+    unsaved = 0;
+    saved_at = steady_clock::now();
+  }
+  store_checkpoint(offset);
+}
+
+/*
+  Replace the log with one holding only its uncompleted jobs, in
+  order, if compaction_due()
+
+  Enqueues wait while the jobs are copied; workers keep delivering,
+  and a job completed meanwhile is at worst delivered again after a
+  crash. The checkpoint is reset to 0 before the new log is renamed
+  into place: a crash between the two replays the old log from its
+  start, which likewise only redelivers completed jobs.
+ */
+void PushQueue::compact () {
+  guard_t append_guard {append_lock};
+  guard_t checkpoint_guard {checkpoint_lock};
+  vector<std::pair<uint64_t,uint64_t>> live {};    // (offset, file offset)
+  vector<uint64_t> sizes {};
+  {
+    guard_t guard {lock};
+    if (log_fd < 0 || ! compaction_due())
+      return;
+    for (const auto& p : pending) {
+      live.push_back(std::make_pair(p.first, file_offset(p.first)));
+      sizes.push_back(p.second.end - p.first);
+    }
+  }
+
+  const string tmp {log_path + ".tmp"};
+  const int tmp_fd {::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)};
+  if (tmp_fd < 0) {
+    cout << "PushQueue: compaction of " << log_path << " failed" << endl;
+    return;
+  }
+  std::map<uint64_t,uint64_t> copied {};
+  uint64_t copied_bytes {0};
+  bool ok {true};
+  {
+    std::ifstream log {log_path, std::ios::binary};
+    string record {};
+    for (vector<uint64_t>::size_type i {0}; i < live.size() && ok; ++i) {
+      record.resize(sizes[i]);
+      log.seekg(live[i].second);
+      ok = log.read(&record[0], sizes[i]) && write_all(tmp_fd, record);
+      copied[live[i].first] = copied_bytes;
+      copied_bytes += sizes[i];
+    }
+  }
+  if ( ! ok || ::fdatasync(tmp_fd) != 0) {
+    cout << "PushQueue: compaction of " << log_path << " failed" << endl;
+    ::close(tmp_fd);
+    ::unlink(tmp.c_str());
+    return;
+  }
+
+  store_checkpoint(0);
+  if (std::rename(tmp.c_str(), log_path.c_str()) != 0) {
+    cout << "PushQueue: compaction of " << log_path << " failed" << endl;
+    ::close(tmp_fd);
+    ::unlink(tmp.c_str());
+    guard_t guard {lock};
+    store_checkpoint(file_offset(checkpoint_offset()));
+    return;
+  }
+  ::close(log_fd);
+  log_fd = tmp_fd;
+
+  // Enqueues are held off, so every record after the copied ones is logged from tail
+  guard_t guard {lock};
+  relocated.clear();
+  for (const auto& c : copied) {
+    if (pending.count(c.first))
+      relocated.insert(c);
+  }
+  base = tail;
+  head = copied_bytes;
+  unsaved = 0;
+  saved_at = steady_clock::now();
+}
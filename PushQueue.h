@@ -0,0 +1,137 @@
+#ifndef PushQueue_h
+#define PushQueue_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+  Durable queue of push jobs, drained by a pool of worker threads
+
+  Each job is appended to a log file (and synced) before enqueue()
+  returns, so an accepted job survives a crash or restart. A
+  checkpoint file beside the log records the offset of the oldest
+  job not yet completed; start() replays the log from there.
+
+  The checkpoint is written after every checkpoint_every completions
+  or checkpoint_interval, whichever comes first, and outside the
+  queue lock, so workers do not wait on each other's file I/O. Once
+  the log holds compact_bytes of completed jobs, and more of them
+  than of uncompleted ones, the uncompleted jobs are copied to a new
+  log that replaces it. The log thus stays bounded under steady load,
+  even while a job waits out its retries, and not only when the
+  queue drains.
+
+  Delivery is at-least-once: a job is retried with exponential
+  backoff while the handler returns false (or throws), and may be
+  delivered again after a restart, so handlers must be idempotent.
+ */
+class PushQueue {
+public:
+  using handler_t = std::function<bool (const std::string&)>;
+
+  struct metrics_t {
+    std::size_t depth;          // Jobs accepted but not yet completed
+    std::size_t in_flight;      // Jobs being handled right now
+    std::uint64_t enqueued;
+    std::uint64_t completed;
+    std::uint64_t retries;
+    std::uint64_t dropped;      // Jobs abandoned after max_attempts
+    std::int64_t drain_lag_ms;  // Age of the oldest uncompleted job
+  };
+
+private:
+  using steady_time_t = std::chrono::steady_clock::time_point;
+
+  /*
+    Offsets are positions in the stream of all records ever logged.
+    The log file holds the records copied by the last compaction,
+    then those logged since, from base on; see file_offset().
+   */
+  struct record_t {
+    std::uint64_t end;          // Position just past the record
+    std::int64_t enqueued_ms;
+  };
+
+  struct job_t {
+    std::uint64_t offset;       // Position of the record in the log
+    std::uint64_t end;          // Position just past the record
+    std::int64_t enqueued_ms;   // Wall-clock time of enqueue, persisted
+    std::string payload;
+    unsigned attempts;
+  };
+
+  std::string log_path;
+  std::string checkpoint_path;
+  handler_t handler;
+  unsigned worker_count;
+  unsigned max_attempts;
+  std::chrono::milliseconds base_backoff;
+  std::chrono::milliseconds max_backoff;
+  std::uint64_t compact_bytes;
+  unsigned checkpoint_every;
+  std::chrono::milliseconds checkpoint_interval;
+
+  // Held while appending; always acquired before lock
+  std::mutex append_lock;
+  int log_fd;
+  std::uint64_t tail;
+
+  // Held while writing the checkpoint or compacting; acquired after
+  // append_lock and before lock
+  std::mutex checkpoint_lock;
+
+  mutable std::mutex lock;
+  std::condition_variable wake;
+  std::deque<job_t> ready;
+  std::multimap<steady_time_t,job_t> delayed;
+  std::map<std::uint64_t,record_t> pending;      // By offset
+  std::uint64_t pending_bytes;
+  std::uint64_t completed_end;
+  std::uint64_t base;           // Offset of the first record logged since compaction
+  std::uint64_t head;           // Size of the records copied by compaction
+  std::map<std::uint64_t,std::uint64_t> relocated;  // Copied offset -> file offset
+  unsigned unsaved;             // Completions since the checkpoint was written
+  steady_time_t saved_at;
+  std::size_t in_flight;
+  std::uint64_t enqueued_count;
+  std::uint64_t completed_count;
+  std::uint64_t retry_count;
+  std::uint64_t dropped_count;
+  bool stopping;
+  std::vector<std::thread> workers;
+
+  void replay ();
+  void work ();
+  void complete (const job_t& job);
+  std::uint64_t checkpoint_offset () const;
+  std::uint64_t file_offset (std::uint64_t offset) const;
+  bool compaction_due () const;
+  void store_checkpoint (std::uint64_t offset);
+  void write_checkpoint ();
+  void compact ();
+
+public:
+  PushQueue (const std::string& path,
+             handler_t job_handler,
+             unsigned workers = 4,
+             unsigned attempts = 8);
+  ~PushQueue ();
+
+  PushQueue (const PushQueue&) = delete;
+  PushQueue& operator= (const PushQueue&) = delete;
+
+  void start ();
+  void stop ();
+  bool enqueue (const std::string& payload);
+  metrics_t metrics () const;
+};
+
+#endif
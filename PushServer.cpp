@@ -2,9 +2,19 @@
  Push Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <cpprest/http_listener.h>
@@ -15,6 +25,10 @@
 
 #include "make_unique.h"
 #include "ClientUtils.h"
+#include "DeliveryBuffer.h"
+#include "FollowerIndex.h"
+#include "InternTable.h"
+#include "PushQueue.h"
 
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
@@ -54,13 +68,84 @@ constexpr const char* def_url = "http://localhost:34574";
 constexpr const char* addr {"http://localhost:34568/"};
 constexpr const char* auth_addr {"http://localhost:34570/"};
 
-const string read_entity_admin {"ReadEntityAdmin"};
+const string create_table_admin {"CreateTableAdmin"};
 const string update_entity_admin {"UpdateEntityAdmin"};
+const string update_batch_admin {"UpdateBatchAdmin"};
+const string read_entity_admin {"ReadEntityAdmin"};
 
 const string data_table_name {"DataTable"};
 const string data_table_friends_prop {"Friends"};
 const string data_table_status_prop {"Status"};
-const string data_table_update_prop {"Updates"};
+
+const string timeline_table_name {"TimelineTable"};
+const string timeline_author_prop {"Author"};
+const string timeline_status_prop {"Status"};
+
+/*
+  Statuses of users with more than fanout_threshold friends are written
+  once, to the author's partition of the outbox table, and merged into
+  their friends' timelines when read. Such authors are listed in the
+  celebrity table so that readers know which outboxes to merge.
+ */
+const string outbox_table_name {"OutboxTable"};
+const string celebrity_table_name {"CelebrityTable"};
+const string celebrity_partition {"Celebrity"};
+const string celebrity_since_prop {"Since"};
+
+const string push_status_op {"PushStatus"};
+const string push_metrics_op {"PushMetrics"};
+const string set_followers_op {"SetFollowers"};
+const string add_follower_op {"AddFollower"};
+const string remove_follower_op {"RemoveFollower"};
+const string drop_followers_op {"DropFollowers"};
+
+// Properties of a queued push job
+const string job_author_prop {"Author"};
+const string job_row_prop {"Row"};
+const string job_status_prop {"Status"};
+const string job_friends_prop {"Friends"};
+
+const string def_queue_file {"pushqueue.log"};
+
+// Default time a recipient's deliveries are buffered before being written
+constexpr int def_flush_window_ms {50};
+
+// Queue workers mostly wait on the delivery buffer, so run many
+constexpr unsigned push_workers {16};
+
+// Default friend count above which statuses are fanned out on read
+constexpr std::size_t def_fanout_threshold {1000};
+std::size_t fanout_threshold {def_fanout_threshold};
+
+/*
+  Durable queue of accepted PushStatus requests, drained by
+  deliver_status() on the queue's worker threads
+ */
+std::unique_ptr<PushQueue> push_queue {};
+
+/*
+  Write-behind buffers of timeline and outbox deliveries, written by write_rows()
+ */
+std::unique_ptr<DeliveryBuffer> delivery_buffer {};
+std::unique_ptr<DeliveryBuffer> outbox_buffer {};
+
+/*
+  Authors already listed in the celebrity table by this server
+ */
+std::unordered_set<string> registered_celebrities {};
+std::mutex celebrity_lock {};
+
+/*
+  Ids of the authors and recipients this server has seen
+ */
+InternTable user_ids {};
+
+/*
+  Recipients of each author's statuses, kept up to date by
+  UserServer's SetFollowers, AddFollower, RemoveFollower and
+  DropFollowers
+ */
+FollowerIndex follower_index {};
 
 /*
   Given an HTTP message with a JSON body, return the JSON
@@ -100,69 +185,319 @@ unordered_map<string,string> get_json_body(http_request message) {
   return results;
 }
 
+/*
+  Write buffered deliveries to one partition of a table
+
+  table: timeline_table_name (partition is the recipient) or
+    outbox_table_name (partition is the author)
+
+  All rows go to the partition in one UpdateBatchAdmin request,
+  however many deliveries arrived during the flush window.
+ */
+bool write_rows (const string& table, const string& partition, const vector<DeliveryBuffer::delivery_t>& deliveries) {
+  value rows {value::object()};
+  for (const auto& delivery : deliveries) {
+    rows[delivery.row] = build_json_value (timeline_author_prop, delivery.author,
+                                           timeline_status_prop, delivery.status);
+  }
+
+  pair<status_code,value> result {do_request (methods::PUT,
+                                              addr +
+                                              update_batch_admin + "/" +
+                                              table + "/" +
+                                              partition,
+                                              rows)};
+  if (result.first != status_codes::OK) {
+    cout << "Delivery to " << table << "/" << partition << " failed: " << result.first << endl;
+    return false;
+  }
+  return true;
+}
+
+/*
+  Return the ids of the friends in friends_list, throwing
+  std::invalid_argument if it is malformed
+ */
+FollowerIndex::recipients_t recipients_of (const string& friends_list) {
+  friends_view_t friend_list {};
+  parse_friends_list(friends_list, friend_list);
+  FollowerIndex::recipients_t recipients {};
+  recipients.reserve(friend_list.size());
+  for (const auto& f : friend_list)
+    recipients.push_back(user_ids.intern(timeline_partition(f)));
+  return recipients;
+}
+
+/*
+  Set recipients to those of author, a timeline partition key,
+  reading the author's Friends property from DataTable if author is
+  not in follower_index
+
+  An author with no DataTable entity has no recipients. Returns false
+  if the entity could not be read. Changes that arrive during the read
+  are queued by follower_index and applied to what was read.
+ */
+bool author_recipients (const string& author, FollowerIndex::recipients_t& recipients) {
+  const InternTable::id_t author_id {user_ids.intern(author)};
+  if (follower_index.find(author_id, recipients))
+    return true;
+
+  // The country never holds the delimiter; the name might
+  const string::size_type delim {author.find(pair_delimiter)};
+  if (delim == string::npos)
+    return false;
+  follower_index.begin_load(author_id);
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr +
+                                              read_entity_admin + "/" +
+                                              data_table_name + "/" +
+                                              author.substr(0, delim) + "/" +
+                                              author.substr(delim + 1))};
+  if (result.first == status_codes::NotFound) {
+    recipients.clear();
+  }
+  else if (result.first != status_codes::OK) {
+    follower_index.abandon(author_id);
+    return false;
+  }
+  else {
+    try {
+      recipients = recipients_of(get_json_object_prop(result.second, data_table_friends_prop));
+    }
+    catch (const std::invalid_argument& e) {
+      cout << "Error: " << e.what() << endl;
+      follower_index.abandon(author_id);
+      return false;
+    }
+  }
+  follower_index.load(author_id, recipients);
+  // A list set while storage was read wins over the one read. If the
+  // author was dropped meanwhile, nothing was kept: deliver to what
+  // was read, and read again next time.
+  follower_index.find(author_id, recipients);
+  return true;
+}
+
+/*
+  Ensure author is listed in the celebrity table
+
+  since: row key of the author's first fanned-out-on-read status
+ */
+bool register_celebrity (const string& author, const string& since) {
+  {
+    std::lock_guard<std::mutex> guard {celebrity_lock};
+    if (registered_celebrities.count(author) == 1)
+      return true;
+  }
+
+  pair<status_code,value> result {do_request (methods::PUT,
+                                              addr +
+                                              update_entity_admin + "/" +
+                                              celebrity_table_name + "/" +
+                                              celebrity_partition + "/" +
+                                              author,
+                                              build_json_value (celebrity_since_prop, since))};
+  if (result.first != status_codes::OK)
+    return false;
+
+  std::lock_guard<std::mutex> guard {celebrity_lock};
+  registered_celebrities.insert(author);
+  return true;
+}
+
+/*
+  Deliver a queued push job
+
+  job_text: serialized JSON job built by handle_post()
+
+  The recipients are the author's friends: those listed in the job
+  if it was pushed with a friends list, otherwise those in
+  follower_index, read from DataTable if the author is not indexed.
+
+  If the author has no more than fanout_threshold friends, the
+  status is fanned out on write: one delivery per friend, each
+  handed to the timeline write-behind buffer. Otherwise it is
+  written once, to the author's outbox, for readers to merge.
+
+  The job completes once its writes are done. Returns true only
+  if every write succeeded. The job's row key was fixed when it
+  was accepted, so a retry overwrites the rows already written
+  rather than duplicating them.
+ */
+bool deliver_status (const string& job_text) {
+  value job {value::parse(job_text)};
+  const DeliveryBuffer::delivery_t delivery {get_json_object_prop(job, job_row_prop),
+                                             get_json_object_prop(job, job_author_prop),
+                                             get_json_object_prop(job, job_status_prop)};
+  FollowerIndex::recipients_t recipients {};
+  if (job.has_field(job_friends_prop))
+    recipients = recipients_of(get_json_object_prop(job, job_friends_prop));
+  else if ( ! author_recipients(delivery.author, recipients))
+    return false;
+
+  if (recipients.size() > fanout_threshold) {
+    if ( ! register_celebrity(delivery.author, delivery.row))
+      return false;
+    return outbox_buffer->add(delivery.author, delivery).get();
+  }
+
+  vector<std::shared_future<bool>> writes {};
+  for (const auto& recipient : recipients)
+    writes.push_back(delivery_buffer->add(user_ids.key(recipient), delivery));
+
+  bool all_delivered {true};
+  for (auto& write : writes) {
+    if ( ! write.get())
+      all_delivered = false;
+  }
+  return all_delivered;
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
+
+  PushMetrics reports the state of the push queue:
+    Depth: jobs accepted but not yet delivered
+    InFlight: jobs being delivered now
+    DrainLagMs: age of the oldest undelivered job
+    Enqueued, Completed, Retries, Dropped: totals since start
+  and of the delivery buffers:
+    Deliveries: timeline rows delivered since start
+    Writes: storage writes used to deliver them
+    BufferedDeliveries: rows waiting to be written
+    OutboxDeliveries, OutboxWrites: the same for statuses
+      fanned out on read
+  and of the follower index:
+    IndexedAuthors, IndexedRecipients: authors whose recipients
+      are known, and the total of their recipients
+    IndexLoads: authors read from DataTable since start
+    IndexChanges: recipients added or removed since start
  */
 void handle_get(http_request message) { 
   string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
+  cout << endl << "**** PushServer GET " << path << endl;
+  auto paths = uri::split_path(path);
+  if (paths.size() != 1 || paths[0] != push_metrics_op) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  PushQueue::metrics_t metrics {push_queue->metrics()};
+  DeliveryBuffer::metrics_t buffer_metrics {delivery_buffer->metrics()};
+  DeliveryBuffer::metrics_t outbox_metrics {outbox_buffer->metrics()};
+  FollowerIndex::metrics_t index_metrics {follower_index.metrics()};
+  message.reply(status_codes::OK,
+                value::object(vector<pair<string,value>> {
+                    make_pair("Depth", value::number(static_cast<uint64_t>(metrics.depth))),
+                    make_pair("InFlight", value::number(static_cast<uint64_t>(metrics.in_flight))),
+                    make_pair("DrainLagMs", value::number(static_cast<int64_t>(metrics.drain_lag_ms))),
+                    make_pair("Enqueued", value::number(static_cast<uint64_t>(metrics.enqueued))),
+                    make_pair("Completed", value::number(static_cast<uint64_t>(metrics.completed))),
+                    make_pair("Retries", value::number(static_cast<uint64_t>(metrics.retries))),
+                    make_pair("Dropped", value::number(static_cast<uint64_t>(metrics.dropped))),
+                    make_pair("Deliveries", value::number(static_cast<uint64_t>(buffer_metrics.deliveries))),
+                    make_pair("Writes", value::number(static_cast<uint64_t>(buffer_metrics.writes))),
+                    make_pair("BufferedDeliveries", value::number(static_cast<uint64_t>(buffer_metrics.pending))),
+                    make_pair("OutboxDeliveries", value::number(static_cast<uint64_t>(outbox_metrics.deliveries))),
+                    make_pair("OutboxWrites", value::number(static_cast<uint64_t>(outbox_metrics.writes))),
+                    make_pair("IndexedAuthors", value::number(static_cast<uint64_t>(index_metrics.authors))),
+                    make_pair("IndexedRecipients", value::number(static_cast<uint64_t>(index_metrics.recipients))),
+                    make_pair("IndexLoads", value::number(static_cast<uint64_t>(index_metrics.loads))),
+                    make_pair("IndexChanges", value::number(static_cast<uint64_t>(index_metrics.changes)))}));
 }
 
 /*
   Top-level routine for processing all HTTP POST requests.
+
+  PushStatus/country/name/status is written to the push queue and
+  acknowledged with Accepted as soon as it is durable. Delivery to
+  the author's friends happens later, on the queue's workers, which
+  look the friends up in follower_index. A client may instead send
+  the friends list as the JSON body {"Friends": ...}; the status then
+  goes to those friends, and the list replaces the author's in the
+  index.
+
+  SetFollowers/country/name, with the JSON body {"Friends": ...},
+  makes that list the author's recipients. AddFollower and
+  RemoveFollower/country/name/friend_country/friend_name add or
+  remove one. DropFollowers/country/name forgets the author's list,
+  so that it is read from DataTable when next needed. UserServer
+  sends these as it loads and changes friends lists, and all four
+  answer OK.
  */
 void handle_post(http_request message) {
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** PushServer POST " << path << endl;
   auto paths = uri::split_path(path);
-  if (paths.size() != 4 || paths[0] != "PushStatus") {
+  if (paths.size() == 5 && (paths[0] == add_follower_op || paths[0] == remove_follower_op)) {
+    InternTable::id_t author {0};
+    InternTable::id_t recipient {0};
+    // An author never seen is not indexed, and a recipient never seen is in no list
+    if (user_ids.find(timeline_partition(paths[1], paths[2]), author)) {
+      if (paths[0] == add_follower_op)
+        follower_index.add(author, user_ids.intern(paths[3], paths[4]));
+      else if (user_ids.find(timeline_partition(paths[3], paths[4]), recipient))
+        follower_index.remove(author, recipient);
+    }
+    message.reply(status_codes::OK);
+    return;
+  }
+  if (paths.size() == 3 && paths[0] == drop_followers_op) {
+    InternTable::id_t author {0};
+    if (user_ids.find(timeline_partition(paths[1], paths[2]), author))
+      follower_index.drop(author);
+    message.reply(status_codes::OK);
+    return;
+  }
+  if ( ! ((paths.size() == 3 && paths[0] == set_followers_op) ||
+          (paths.size() == 4 && paths[0] == push_status_op))) {
     message.reply(status_codes::BadRequest);
+    return;
   }
-  assert(paths[0] == "PushStatus");
   string user_country {paths[1]};
   string user_name {paths[2]};
-  string status {paths[3]};
-  //Assuming status stored in updates are of the form 'status\n'
-  string new_status {status +"\n"};
+  const string author {timeline_partition(user_country, user_name)};
 
   unordered_map<string, string> friend_map {get_json_body(message)};
-  if (friend_map.size() == 1 
-      && friend_map.begin()->first == data_table_friends_prop) {
-    friends_list_t friend_list {parse_friends_list(friend_map.begin()->second)};
-    
-    for (auto user_friend = friend_list.begin(); user_friend != friend_list.end(); ++user_friend) {
-      pair<status_code,value> get_old_updates {do_request (methods::GET,
-                                                           addr + 
-                                                           read_entity_admin + "/" + 
-                                                           data_table_name + "/" + 
-                                                           user_friend->first + "/" +
-                                                           user_friend->second)};
-      if (get_old_updates.first != status_codes::OK) {
-        continue;
-      }
+  const bool has_friends {friend_map.size() == 1
+                          && friend_map.begin()->first == data_table_friends_prop};
+  if ( ! has_friends && (paths[0] == set_followers_op || ! friend_map.empty())) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
 
-      unordered_map<string,string> user_friend_properties {unpack_json_object(get_old_updates.second)};
-      string updates {user_friend_properties[data_table_update_prop]};
-      cout << "Old Updates: " << updates << endl;
-      updates += new_status;
-      cout << "Updates: " << updates << endl;
-
-      pair<status_code,value> update_friend {do_request (methods::PUT,
-                                                         addr + 
-                                                         update_entity_admin + "/" + 
-                                                         data_table_name + "/" + 
-                                                         user_friend->first + "/" +
-                                                         user_friend->second,
-                                                         value::object(vector<pair<string,value>>
-                                                                       {make_pair(data_table_update_prop,
-                                                                                  value::string(updates))}))};
+  // Reject a malformed list now rather than retrying it later
+  if (has_friends) {
+    try {
+      follower_index.set(user_ids.intern(author), recipients_of(friend_map.begin()->second));
+    }
+    catch (const std::invalid_argument& e) {
+      message.reply(status_codes::BadRequest);
+      return;
     }
+  }
+  if (paths[0] == set_followers_op) {
     message.reply(status_codes::OK);
+    return;
   }
+  string status {paths[3]};
 
-  else {
-    message.reply(status_codes::BadRequest);
-  }
+  /*
+    Every recipient gets its own timeline row, all sharing one row key,
+    so each delivery is a single write that never reads or rewrites
+    the recipient's earlier updates.
+   */
+  prop_str_vals_t job_props {make_pair(job_author_prop, author),
+                             make_pair(job_row_prop, make_timeline_row_key()),
+                             make_pair(job_status_prop, status)};
+  if (has_friends)
+    job_props.push_back(make_pair(job_friends_prop, friend_map.begin()->second));
+  value job {build_json_value (job_props)};
+
+  if (push_queue->enqueue(job.serialize()))
+    message.reply(status_codes::Accepted);
+  else
+    message.reply(status_codes::ServiceUnavailable);
 }
 
 /*
@@ -187,9 +522,21 @@ void handle_delete(http_request message) {
   Install handlers for the HTTP requests and open the listener,
   which processes each request asynchronously.
 
-  Note that, PushServer only installs the listeners for POST. 
+  Note that, PushServer only installs the listeners for GET and POST. 
   Any other HTTP method will produce a Method Not Allowed (405) response.
 
+  Usage: pushserver [queue_file [flush_window_ms [fanout_threshold]]]
+
+  queue_file names the push queue's log (default pushqueue.log,
+  in the working directory). Jobs left in it by a previous run
+  are delivered after startup.
+
+  flush_window_ms is how long deliveries to one recipient are
+  buffered to be written together (default 50).
+
+  fanout_threshold is the friend count above which an author's
+  statuses are fanned out on read (default 1000).
+
   If you want to support other methods, uncomment
   the call below that hooks in a the appropriate 
   listener.
@@ -197,9 +544,50 @@ void handle_delete(http_request message) {
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
+  for (const string& table : vector<string> {timeline_table_name, outbox_table_name, celebrity_table_name}) {
+    cout << "PushServer: Creating " << table << endl;
+    try {
+      pair<status_code,value> created {do_request (methods::POST,
+                                                   addr +
+                                                   create_table_admin + "/" +
+                                                   table)};
+      if (created.first != status_codes::Created && created.first != status_codes::Accepted)
+        cout << "Could not create " << table << ": " << created.first << endl;
+    }
+    catch (const std::exception& e) {
+      cout << "BasicServer unavailable: " << e.what() << endl;
+    }
+  }
+
+  string queue_file {argc > 1 ? argv[1] : def_queue_file};
+  int flush_window_ms {argc > 2 ? std::atoi(argv[2]) : def_flush_window_ms};
+  if (argc > 3)
+    fanout_threshold = std::strtoul(argv[3], nullptr, 10);
+
+  cout << "PushServer: Buffering deliveries for " << flush_window_ms << " ms" << endl;
+  const std::chrono::milliseconds flush_window {std::max(0, flush_window_ms)};
+  delivery_buffer = std::make_unique<DeliveryBuffer>(
+      [] (const string& recipient, const vector<DeliveryBuffer::delivery_t>& deliveries) {
+        return write_rows (timeline_table_name, recipient, deliveries);
+      },
+      flush_window);
+  delivery_buffer->start();
+  outbox_buffer = std::make_unique<DeliveryBuffer>(
+      [] (const string& author, const vector<DeliveryBuffer::delivery_t>& deliveries) {
+        return write_rows (outbox_table_name, author, deliveries);
+      },
+      flush_window);
+  outbox_buffer->start();
+
+  cout << "PushServer: Fanning out on read above " << fanout_threshold << " friends" << endl;
+
+  cout << "PushServer: Opening push queue " << queue_file << endl;
+  push_queue = std::make_unique<PushQueue>(queue_file, &deliver_status, push_workers);
+  push_queue->start();
+
   cout << "PushServer: Opening listener" << endl;
   http_listener listener {def_url};
-  //listener.support(methods::GET, &handle_get);
+  listener.support(methods::GET, &handle_get);
   listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
@@ -211,5 +599,8 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+  push_queue->stop();
+  delivery_buffer->stop();  // Writes whatever is still buffered
+  outbox_buffer->stop();
   cout << "PushServer closed" << endl;
 }
@@ -0,0 +1,285 @@
+/*
+  Table SAS tokens, as described in "Constructing a Service SAS"
+  (storage service version 2015-04-05). The string to sign is
+
+    permissions \n start \n expiry \n /table/account/table \n
+    identifier \n ip \n protocol \n version \n
+    start partition \n start row \n end partition \n end row
+
+  with the table name in lower case and empty fields for what is not
+  used, and the token is the query string
+
+    sv tn spk srk epk erk se sp sig
+
+  with each value percent-encoded except for unreserved characters.
+ */
+
+#include "SasSigner.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/evp.h>
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+const string SasSigner::sas_version {"2015-04-05"};
+
+// Most bytes of a string to sign built on the stack
+constexpr size_t stack_string_bytes {1024};
+
+/*
+  HMAC-SHA256 contexts: mac_keyed() makes one keyed with key,
+  mac_copy() copies a keyed one, and mac_sign() restarts a keyed one
+  from its key and signs data with it. Each returns null or false on
+  failure.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+
+static void mac_free (EVP_MAC_CTX* ctx) {
+  EVP_MAC_CTX_free(ctx);
+}
+
+static EVP_MAC_CTX* mac_keyed (const vector<std::uint8_t>& key) {
+  EVP_MAC* hmac {EVP_MAC_fetch(nullptr, "HMAC", nullptr)};
+  if ( ! hmac)
+    return nullptr;
+  EVP_MAC_CTX* ctx {EVP_MAC_CTX_new(hmac)};
+  EVP_MAC_free(hmac);    // The context holds its own reference
+  char digest[] {"SHA256"};
+  const OSSL_PARAM params[] {OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                             OSSL_PARAM_construct_end()};
+  if ( ! ctx || ! EVP_MAC_init(ctx, key.data(), key.size(), params)) {
+    mac_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+static EVP_MAC_CTX* mac_copy (EVP_MAC_CTX* keyed) {
+  return EVP_MAC_CTX_dup(keyed);
+}
+
+static bool mac_sign (EVP_MAC_CTX* ctx, const unsigned char* data, size_t size,
+                      unsigned char* mac, unsigned int& mac_size) {
+  size_t out_size {0};
+  // A null key restarts the context from its keyed state
+  const bool ok {EVP_MAC_init(ctx, nullptr, 0, nullptr) &&
+                 EVP_MAC_update(ctx, data, size) &&
+                 EVP_MAC_final(ctx, mac, &out_size, EVP_MAX_MD_SIZE)};
+  mac_size = static_cast<unsigned int>(out_size);
+  return ok;
+}
+#else
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static HMAC_CTX* hmac_ctx_new () {
+  HMAC_CTX* ctx {new HMAC_CTX};
+  HMAC_CTX_init(ctx);
+  return ctx;
+}
+
+static void mac_free (HMAC_CTX* ctx) {
+  if ( ! ctx)
+    return;
+  HMAC_CTX_cleanup(ctx);
+  delete ctx;
+}
+#else
+static HMAC_CTX* hmac_ctx_new () {
+  return HMAC_CTX_new();
+}
+
+static void mac_free (HMAC_CTX* ctx) {
+  HMAC_CTX_free(ctx);
+}
+#endif
+
+static HMAC_CTX* mac_keyed (const vector<std::uint8_t>& key) {
+  HMAC_CTX* ctx {hmac_ctx_new()};
+  if ( ! ctx || ! HMAC_Init_ex(ctx, key.data(), static_cast<int>(key.size()), EVP_sha256(), nullptr)) {
+    mac_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+static HMAC_CTX* mac_copy (HMAC_CTX* keyed) {
+  HMAC_CTX* ctx {hmac_ctx_new()};
+  if ( ! ctx || ! HMAC_CTX_copy(ctx, keyed)) {
+    mac_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+static bool mac_sign (HMAC_CTX* ctx, const unsigned char* data, size_t size,
+                      unsigned char* mac, unsigned int& mac_size) {
+  // A null key restarts the context from its keyed state
+  return HMAC_Init_ex(ctx, nullptr, 0, nullptr, nullptr) &&
+         HMAC_Update(ctx, data, size) &&
+         HMAC_Final(ctx, mac, &mac_size);
+}
+#endif
+
+/*
+  Append s to out, percent-encoding all but unreserved characters
+ */
+static void append_encoded (string& out, const string& s) {
+  static const char hex[] {"0123456789ABCDEF"};
+  for (char c : s) {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '.' || c == '_' || c == '~') {
+      out.push_back(c);
+    }
+    else {
+      const unsigned char u {static_cast<unsigned char>(c)};
+      out.push_back('%');
+      out.push_back(hex[u >> 4]);
+      out.push_back(hex[u & 15]);
+    }
+  }
+}
+
+/*
+  Appends to a buffer on the stack, moving to the heap only if the
+  buffer would overflow
+ */
+class sign_buffer {
+  char local[stack_string_bytes];
+  string spill;
+  size_t used;
+
+public:
+  sign_buffer () : spill {}, used {0} {}
+
+  void append (const char* s, size_t n) {
+    if (spill.empty() && used + n <= sizeof(local)) {
+      std::memcpy(local + used, s, n);
+      used += n;
+      return;
+    }
+    if (spill.empty())
+      spill.assign(local, used);
+    spill.append(s, n);
+  }
+
+  void append (const string& s) { append(s.data(), s.size()); }
+  void line (const string& s) { append(s); append("\n", 1); }
+
+  const unsigned char* data () const {
+    return reinterpret_cast<const unsigned char*>(spill.empty() ? local : spill.data());
+  }
+  size_t size () const { return spill.empty() ? used : spill.size(); }
+};
+
+SasSigner::SasSigner (const string& account, const vector<std::uint8_t>& key) :
+  account_name {account},
+  keyed {mac_keyed(key)},
+  pool_lock {},
+  pool {}
+  {
+    if ( ! keyed)
+      throw std::runtime_error("SasSigner: cannot key HMAC context");
+  }
+
+SasSigner::~SasSigner () {
+  for (mac_ctx_t* ctx : pool)
+    mac_free(ctx);
+  mac_free(keyed);
+}
+
+/*
+  Return an idle keyed context, making one if there is none
+ */
+SasSigner::mac_ctx_t* SasSigner::acquire () {
+  {
+    std::lock_guard<std::mutex> guard {pool_lock};
+    if ( ! pool.empty()) {
+      mac_ctx_t* ctx {pool.back()};
+      pool.pop_back();
+      return ctx;
+    }
+  }
+  mac_ctx_t* ctx {mac_copy(keyed)};
+  if ( ! ctx)
+    throw std::runtime_error("SasSigner: cannot copy HMAC context");
+  return ctx;
+}
+
+void SasSigner::release (mac_ctx_t* ctx) {
+  std::lock_guard<std::mutex> guard {pool_lock};
+  pool.push_back(ctx);
+}
+
+/*
+  Return a token granting permissions ("r", "ru", ...) to the single
+  entity partition/row of table until expiry
+ */
+string SasSigner::table_token (const string& table,
+                               const string& partition,
+                               const string& row,
+                               const string& permissions,
+                               std::time_t expiry) {
+  std::tm tm {};
+  char expiry_text[32];
+  gmtime_r(&expiry, &tm);
+  const size_t expiry_size {std::strftime(expiry_text, sizeof(expiry_text), "%Y-%m-%dT%H:%M:%SZ", &tm)};
+
+  string lower_table {table};
+  std::transform(lower_table.begin(), lower_table.end(), lower_table.begin(),
+                 [] (char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+  sign_buffer to_sign {};
+  to_sign.line(permissions);
+  to_sign.append("\n", 1);                  // Start
+  to_sign.append(expiry_text, expiry_size);
+  to_sign.append("\n/table/", 8);
+  to_sign.append(account_name);
+  to_sign.append("/", 1);
+  to_sign.line(lower_table);
+  to_sign.append("\n\n\n", 3);              // Identifier, IP, protocol
+  to_sign.line(sas_version);
+  to_sign.line(partition);
+  to_sign.line(row);
+  to_sign.line(partition);
+  to_sign.append(row);
+
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_size {0};
+  mac_ctx_t* ctx {acquire()};
+  const bool signed_ok {mac_sign(ctx, to_sign.data(), to_sign.size(), mac, mac_size)};
+  release(ctx);
+  if ( ! signed_ok)
+    throw std::runtime_error("SasSigner: HMAC failed");
+
+  unsigned char signature[4 * ((EVP_MAX_MD_SIZE + 2) / 3) + 1];
+  const int signature_size {EVP_EncodeBlock(signature, mac, static_cast<int>(mac_size))};
+
+  string token {};
+  token.reserve(128 + 2 * (table.size() + 2 * (partition.size() + row.size())));
+  token.append("sv=").append(sas_version);
+  token.append("&tn=");
+  append_encoded(token, table);
+  token.append("&spk=");
+  append_encoded(token, partition);
+  token.append("&srk=");
+  append_encoded(token, row);
+  token.append("&epk=");
+  append_encoded(token, partition);
+  token.append("&erk=");
+  append_encoded(token, row);
+  token.append("&se=");
+  append_encoded(token, string {expiry_text, expiry_size});
+  token.append("&sp=");
+  append_encoded(token, permissions);
+  token.append("&sig=");
+  append_encoded(token, string {reinterpret_cast<const char*>(signature), static_cast<size_t>(signature_size)});
+  return token;
+}
@@ -0,0 +1,73 @@
+#ifndef SasSigner_h
+#define SasSigner_h
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/evp.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/*
+  Signer of table shared access signatures (SAS tokens)
+
+  Produces the same token as the storage library's
+  cloud_table::get_shared_access_signature() for a single-entity
+  range with no start time and no stored policy, at service version
+  sas_version, but faster:
+
+    The HMAC-SHA256 context is keyed with the account key once, in
+    the constructor. Signing takes a context from a pool, which
+    already holds the keyed state, so the key is never hashed again.
+    The string to sign is assembled in a stack buffer.
+
+  Because the library's exact output cannot be checked at compile
+  time, users should compare a few tokens against the library at
+  startup and fall back to it if they differ.
+
+  OpenSSL 3 contexts are EVP_MAC ones; earlier versions use HMAC_CTX,
+  which OpenSSL 3 deprecates.
+
+  table_token() may be called from any number of threads at once.
+ */
+class SasSigner {
+public:
+  static const std::string sas_version;
+
+private:
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  using mac_ctx_t = EVP_MAC_CTX;
+#else
+  using mac_ctx_t = HMAC_CTX;
+#endif
+
+  std::string account_name;
+  mac_ctx_t* keyed;                // Keyed context that pooled contexts copy
+
+  std::mutex pool_lock;
+  std::vector<mac_ctx_t*> pool;    // Idle contexts
+
+  mac_ctx_t* acquire ();
+  void release (mac_ctx_t* ctx);
+
+public:
+  SasSigner (const std::string& account, const std::vector<std::uint8_t>& key);
+  ~SasSigner ();
+
+  SasSigner (const SasSigner&) = delete;
+  SasSigner& operator= (const SasSigner&) = delete;
+
+  std::string table_token (const std::string& table,
+                           const std::string& partition,
+                           const std::string& row,
+                           const std::string& permissions,
+                           std::time_t expiry);
+};
+
+#endif
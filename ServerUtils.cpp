@@ -4,6 +4,7 @@
 
 #include "ServerUtils.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <unordered_map>
@@ -14,6 +15,7 @@
 
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
+using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
@@ -168,3 +170,150 @@ status_code update_with_token (const http_request& message,
       return status_codes::InternalError;
   }
 }
+
+// Separator of the items of a list property, as in Friends
+constexpr char list_separator {'|'};
+
+// Attempts of a list operation that lose to a concurrent write
+constexpr int max_list_attempts {8};
+
+/*
+  Return list, a list property value, with item added at the end or,
+  if adding is false, removed, setting changed to whether that made
+  a difference
+
+  Items are compared whole, so a list holds each item once: adding
+  an item already listed, or removing one not listed, leaves the list
+  unchanged.
+ */
+string edit_list (const string& list, const string& item, bool adding, bool& changed) {
+  vector<string> items {};
+  string::size_type start {0};
+  while (start < list.size()) {
+    string::size_type end {list.find(list_separator, start)};
+    if (end == string::npos)
+      end = list.size();
+    if (end > start)
+      items.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+
+  const bool listed {std::find(items.begin(), items.end(), item) != items.end()};
+  changed = adding != listed;
+  if ( ! changed)
+    return list;
+  if (adding)
+    items.push_back(item);
+  else
+    items.erase(std::remove(items.begin(), items.end(), item), items.end());
+
+  string result {};
+  for (const auto& i : items) {
+    if ( ! result.empty())
+      result += list_separator;
+    result += i;
+  }
+  return result;
+}
+
+/*
+  Add an item to list properties of an entity, or remove one, using
+  a security token
+
+  message and endpoint are as for update_with_token().
+  items maps each list property to the item to add to it or, if
+    adding is false, remove from it. A list property is a string of
+    items separated by '|', as in the Friends property; one that the
+    entity lacks is taken as empty.
+
+  The entity is read, the lists edited, and the entity merged back
+  only if a list changed, conditional on its ETag. A merge that loses
+  to a concurrent write of the entity fails with PreconditionFailed
+  and is retried on the entity as it now is, so concurrent edits of a
+  list are never lost.
+
+  Returns:  HTTP status code of the operation; OK also if no list
+    needed changing, and Conflict if max_list_attempts writes all
+    lost to concurrent writers.
+ */
+status_code list_update_with_token (const http_request& message,
+                                    const string& endpoint,
+                                    const unordered_map<string,string>& items,
+                                    bool adding) {
+  const string undecoded_path {message.relative_uri().path()};
+  const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
+  if (undecoded_paths.size () != 5 || items.empty()) {
+    return status_codes::BadRequest;
+  }
+  for (const auto& v : items) {
+    if (v.second.empty() || v.second.find(list_separator) != string::npos)
+      return status_codes::BadRequest;
+  }
+
+  const string tname {undecoded_paths[1]};
+  const string token {undecoded_paths[2]};
+  const string partition {undecoded_paths[3]};
+  const string row {undecoded_paths[4]};
+  try {
+    uri endpoint_uri {endpoint};
+    storage_credentials creds {token};
+    cloud_table_client client {endpoint_uri, creds};
+    cloud_table table_cred {client.get_table_reference(tname)};
+
+    for (int attempt {0}; attempt < max_list_attempts; ++attempt) {
+      table_operation retrieve_op {table_operation::retrieve_entity(partition, row)};
+      table_result retrieve_result {table_cred.execute(retrieve_op)};
+      if (retrieve_result.http_status_code() == status_codes::NotFound) {
+        cout << "Not found" << endl;
+        return status_codes::NotFound;
+      }
+
+      table_entity entity {retrieve_result.entity()};
+      table_entity::properties_type& properties = entity.properties();
+      bool any_changed {false};
+      for (const auto& v : items) {
+        string list {};
+        auto found (properties.find(v.first));
+        if (found != properties.end()) {
+          if (found->second.property_type() != edm_type::string)
+            return status_codes::BadRequest;
+          list = found->second.string_value();
+        }
+        bool changed {false};
+        const string edited {edit_list(list, v.second, adding, changed)};
+        if (changed) {
+          properties[v.first] = entity_property {edited};
+          any_changed = true;
+        }
+      }
+      if ( ! any_changed)
+        return status_codes::OK;
+
+      try {
+        // The entity's ETag, as read, makes the merge conditional
+        table_operation update_op {table_operation::merge_entity(entity)};
+        table_result update_result {table_cred.execute(update_op)};
+        status_code status {static_cast<status_code> (update_result.http_status_code())};
+        if (status == status_codes::NoContent || status == status_codes::OK)
+          return status_codes::OK;
+        else if (status != status_codes::PreconditionFailed)
+          return status;
+      }
+      catch (const storage_exception& e) {
+        if (e.result().http_status_code() != status_codes::PreconditionFailed)
+          throw;
+      }
+      cout << "List update of " << partition << "/" << row << " lost to a concurrent write" << endl;
+    }
+    return status_codes::Conflict;
+  }
+  catch (const storage_exception& e)
+  {
+    cout << "Azure Table Storage error: " << e.what() << endl;
+    cout << e.result().extended_error().message() << endl;
+    if (e.result().http_status_code() == status_codes::Forbidden)
+      return status_codes::Forbidden;
+    else
+      return status_codes::InternalError;
+  }
+}
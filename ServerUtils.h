@@ -17,4 +17,10 @@ web::http::status_code
 update_with_token (const web::http::http_request& message,
                    const std::string& endpoint,
                    const std::unordered_map<std::string,std::string>& props);
+
+web::http::status_code
+list_update_with_token (const web::http::http_request& message,
+                        const std::string& endpoint,
+                        const std::unordered_map<std::string,std::string>& items,
+                        bool adding);
 #endif
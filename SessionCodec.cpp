@@ -0,0 +1,422 @@
+/*
+  Compact session encoding for SessionStore.
+
+  Block layout, after the u32 block size written by the arena:
+
+    u8 flags, varint length and bytes of the row, then one value for
+    each value or signature marker in the shape, in order: a varint
+    length and bytes, or 32 raw signature bytes.
+ */
+
+#include "SessionCodec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+using std::get;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+
+// Markers in a shape; SAS tokens are printable ASCII, so never contain them
+constexpr char partition_marker {'\x01'};
+constexpr char row_marker {'\x02'};
+constexpr char value_marker {'\x03'};
+constexpr char signature_marker {'\x04'};
+constexpr char whole_token_marker {'\x05'};
+
+// Block flags: the partition and row are stored in their token form
+constexpr unsigned char partition_in_token {1};
+constexpr unsigned char row_in_token {2};
+
+// HMAC-SHA256 signature
+constexpr size_t signature_bytes {32};
+
+constexpr size_t size_class {16};
+constexpr size_t size_classes {32};        // Blocks up to 512 bytes come from chunks
+constexpr size_t chunk_bytes {64 * 1024};
+
+const string base64_chars {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+
+static int hex_digit (char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+  Decode %XX escapes; other characters are kept as they are
+ */
+static string percent_decode (const string& s) {
+  string out {};
+  out.reserve(s.size());
+  for (size_t i {0}; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && hex_digit(s[i + 1]) >= 0 && hex_digit(s[i + 2]) >= 0) {
+      out.push_back(static_cast<char>(hex_digit(s[i + 1]) * 16 + hex_digit(s[i + 2])));
+      i += 2;
+    }
+    else {
+      out.push_back(s[i]);
+    }
+  }
+  return out;
+}
+
+/*
+  Return whether percent_decode of the n characters at p is target,
+  without building the decoded string
+ */
+static bool decodes_to (const char* p, size_t n, const string& target) {
+  size_t t {0};
+  for (size_t i {0}; i < n; ++i, ++t) {
+    char c {p[i]};
+    if (c == '%' && i + 2 < n && hex_digit(p[i + 1]) >= 0 && hex_digit(p[i + 2]) >= 0) {
+      c = static_cast<char>(hex_digit(p[i + 1]) * 16 + hex_digit(p[i + 2]));
+      i += 2;
+    }
+    if (t == target.size() || target[t] != c)
+      return false;
+  }
+  return t == target.size();
+}
+
+/*
+  Append the signature encoding used in SAS tokens of raw: base64
+  with '+', '/' and '=' percent-encoded
+ */
+static void append_signature (string& out, const unsigned char* raw) {
+  auto put = [&out] (char c) {
+    if (c == '+')
+      out.append("%2B");
+    else if (c == '/')
+      out.append("%2F");
+    else if (c == '=')
+      out.append("%3D");
+    else
+      out.push_back(c);
+  };
+  for (size_t i {0}; i < signature_bytes; i += 3) {
+    const size_t n {std::min<size_t>(3, signature_bytes - i)};
+    const uint32_t v {(uint32_t {raw[i]} << 16)
+                      | (n > 1 ? uint32_t {raw[i + 1]} << 8 : 0)
+                      | (n > 2 ? uint32_t {raw[i + 2]} : 0)};
+    put(base64_chars[(v >> 18) & 63]);
+    put(base64_chars[(v >> 12) & 63]);
+    put(n > 1 ? base64_chars[(v >> 6) & 63] : '=');
+    put(n > 2 ? base64_chars[v & 63] : '=');
+  }
+}
+
+/*
+  Set raw to the signature bytes of the n characters at p, returning
+  false unless they are exactly what append_signature would write
+  for a 32-byte signature
+ */
+static bool parse_signature (const char* p, size_t n, unsigned char* raw) {
+  // 32 bytes are 43 base64 digits and one '=', escaped as "%3D"
+  constexpr size_t digits {(signature_bytes * 8 + 5) / 6};
+  if (n < 3 || p[n - 3] != '%' || p[n - 2] != '3' || p[n - 1] != 'D')
+    return false;
+  n -= 3;
+
+  size_t count {0};
+  size_t bytes {0};
+  uint32_t v {0};
+  int bits {0};
+  for (size_t i {0}; i < n; ++i) {
+    int d {-1};
+    const char c {p[i]};
+    if (c == '%' && i + 2 < n && p[i + 1] == '2' && (p[i + 2] == 'B' || p[i + 2] == 'F')) {
+      d = p[i + 2] == 'B' ? 62 : 63;
+      i += 2;
+    }
+    else if (c >= 'A' && c <= 'Z') {
+      d = c - 'A';
+    }
+    else if (c >= 'a' && c <= 'z') {
+      d = c - 'a' + 26;
+    }
+    else if (c >= '0' && c <= '9') {
+      d = c - '0' + 52;
+    }
+    if (d < 0 || ++count > digits)
+      return false;
+    v = (v << 6) | static_cast<uint32_t>(d);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      raw[bytes++] = static_cast<unsigned char>(v >> bits);
+    }
+  }
+  // The bits left over must be zero, or append_signature would not reproduce them
+  return count == digits && (v & ((uint32_t {1} << bits) - 1)) == 0;
+}
+
+static void put_varint (string& out, size_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+static size_t get_varint (const char*& p) {
+  size_t v {0};
+  int shift {0};
+  for (;;) {
+    const unsigned char b {static_cast<unsigned char>(*p++)};
+    v |= static_cast<size_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0)
+      return v;
+    shift += 7;
+  }
+}
+
+static void put_bytes (string& out, const string& s) {
+  put_varint(out, s.size());
+  out.append(s);
+}
+
+static void get_bytes (const char*& p, string& out) {
+  const size_t n {get_varint(p)};
+  out.append(p, n);
+  p += n;
+}
+
+uint32_t SessionCodec::intern_table::acquire (const string& text) {
+  auto found (ids.find(text));
+  if (found != ids.end()) {
+    ++entries[found->second].refs;
+    return found->second;
+  }
+  uint32_t id {0};
+  if (free_ids.empty()) {
+    id = static_cast<uint32_t>(entries.size());
+    entries.push_back(interned_t {text, 1});
+  }
+  else {
+    id = free_ids.back();
+    free_ids.pop_back();
+    entries[id] = interned_t {text, 1};
+  }
+  ids.emplace(text, id);
+  return id;
+}
+
+void SessionCodec::intern_table::release (uint32_t id) {
+  if (--entries[id].refs > 0)
+    return;
+  ids.erase(entries[id].text);
+  entries[id].text = string {};
+  free_ids.push_back(id);
+}
+
+SessionCodec::block_arena::~block_arena () {
+  for (char* block : large)
+    delete[] block;
+}
+
+/*
+  Return a block of at least size bytes, after its u32 size header
+ */
+char* SessionCodec::block_arena::allocate (size_t size) {
+  const size_t total {(size + sizeof(uint32_t) + size_class - 1) / size_class * size_class};
+  char* block {nullptr};
+  const size_t c {total / size_class - 1};
+  if (c >= size_classes) {
+    block = new char[total];
+    large.insert(block);
+  }
+  else if (c < free_lists.size() && free_lists[c]) {
+    block = free_lists[c];
+    std::memcpy(&free_lists[c], block, sizeof(char*));
+  }
+  else {
+    if (left < total) {
+      chunks.emplace_back(new char[chunk_bytes]);
+      next = chunks.back().get();
+      left = chunk_bytes;
+    }
+    block = next;
+    next += total;
+    left -= total;
+  }
+  const uint32_t header {static_cast<uint32_t>(total)};
+  std::memcpy(block, &header, sizeof(header));
+  return block + sizeof(header);
+}
+
+void SessionCodec::block_arena::deallocate (char* data) {
+  char* block {data - sizeof(uint32_t)};
+  uint32_t total {0};
+  std::memcpy(&total, block, sizeof(total));
+  const size_t c {total / size_class - 1};
+  if (c >= size_classes) {
+    large.erase(block);
+    delete[] block;
+    return;
+  }
+  if (free_lists.size() <= c)
+    free_lists.resize(size_classes, nullptr);
+  std::memcpy(block, &free_lists[c], sizeof(char*));
+  free_lists[c] = block;
+}
+
+size_t SessionCodec::block_arena::reserved () const {
+  return chunks.size() * chunk_bytes;
+}
+
+SessionCodec::encoded_t SessionCodec::encode (const session_t& session) {
+  const string& token (get<0>(session));
+  const string& partition (get<1>(session));
+  const string& row (get<2>(session));
+
+  // Parts of the token standing for the partition and row, if any
+  const char* partition_text {nullptr};
+  size_t partition_size {0};
+  const char* row_text {nullptr};
+  size_t row_size {0};
+
+  string& shape (shape_scratch);
+  string& values (values_scratch);
+  shape.clear();
+  values.clear();
+
+  if (std::any_of(token.begin(), token.end(), [] (char c) { return c >= 0 && c <= whole_token_marker; })) {
+    shape.push_back(whole_token_marker);
+    put_bytes(values, token);
+  }
+  else {
+    size_t start {0};
+    for (;;) {
+      const size_t amp {std::min(token.find('&', start), token.size())};
+      const size_t eq {std::min(token.find('=', start), amp)};
+      const char* key {token.data() + start};
+      const size_t key_size {eq - start};
+      const char* value {token.data() + eq + 1};
+      const size_t value_size {eq == amp ? 0 : amp - eq - 1};
+      auto key_is = [key, key_size] (const char* name) {
+        return std::strlen(name) == key_size && std::memcmp(key, name, key_size) == 0;
+      };
+      unsigned char raw[signature_bytes];
+
+      if (start > 0)
+        shape.push_back('&');
+      if (eq == amp) {
+        shape.append(key, key_size);
+      }
+      else if ((key_is("spk") || key_is("epk")) &&
+               (partition_text ? value_size == partition_size &&
+                                 std::memcmp(value, partition_text, value_size) == 0
+                               : decodes_to(value, value_size, partition))) {
+        partition_text = value;
+        partition_size = value_size;
+        shape.append(key, key_size + 1).push_back(partition_marker);
+      }
+      else if ((key_is("srk") || key_is("erk")) &&
+               (row_text ? value_size == row_size && std::memcmp(value, row_text, value_size) == 0
+                         : decodes_to(value, value_size, row))) {
+        row_text = value;
+        row_size = value_size;
+        shape.append(key, key_size + 1).push_back(row_marker);
+      }
+      else if (key_is("sig") && parse_signature(value, value_size, raw)) {
+        shape.append(key, key_size + 1).push_back(signature_marker);
+        values.append(reinterpret_cast<const char*>(raw), signature_bytes);
+      }
+      else if (key_is("se") || key_is("st") || key_is("sig")) {
+        shape.append(key, key_size + 1).push_back(value_marker);
+        put_varint(values, value_size);
+        values.append(value, value_size);
+      }
+      else {
+        shape.append(key, amp - start);
+      }
+
+      if (amp == token.size())
+        break;
+      start = amp + 1;
+    }
+  }
+
+  const unsigned char flags {static_cast<unsigned char>((partition_text ? partition_in_token : 0) |
+                                                        (row_text ? row_in_token : 0))};
+  if ( ! row_text) {
+    row_text = row.data();
+    row_size = row.size();
+  }
+  string& contents (block_scratch);
+  contents.clear();
+  contents.push_back(static_cast<char>(flags));
+  put_varint(contents, row_size);
+  contents.append(row_text, row_size);
+  contents.append(values);
+
+  encoded_t encoded {shapes.acquire(shape), 0, nullptr};
+  encoded.partition = partition_text ? partitions.acquire(string {partition_text, partition_size})
+                                     : partitions.acquire(partition);
+  encoded.block = arena.allocate(contents.size());
+  std::memcpy(encoded.block, contents.data(), contents.size());
+  return encoded;
+}
+
+/*
+  Return the token of an encoded session
+ */
+string SessionCodec::token (const encoded_t& encoded) const {
+  const char* p {encoded.block + 1};
+  const size_t row_size {get_varint(p)};
+  const char* row {p};
+  p += row_size;
+
+  const string& shape (shapes.text(encoded.shape));
+  string out {};
+  out.reserve(shape.size() + 96);
+  for (char c : shape) {
+    switch (c) {
+    case partition_marker:
+      out.append(partitions.text(encoded.partition));
+      break;
+    case row_marker:
+      out.append(row, row_size);
+      break;
+    case value_marker:
+    case whole_token_marker:
+      get_bytes(p, out);
+      break;
+    case signature_marker:
+      append_signature(out, reinterpret_cast<const unsigned char*>(p));
+      p += signature_bytes;
+      break;
+    default:
+      out.push_back(c);
+    }
+  }
+  return out;
+}
+
+void SessionCodec::decode (const encoded_t& encoded, session_t& session) const {
+  const unsigned char flags {static_cast<unsigned char>(encoded.block[0])};
+  const char* p {encoded.block + 1};
+  string row {};
+  get_bytes(p, row);
+
+  get<0>(session) = token(encoded);
+  const string& partition (partitions.text(encoded.partition));
+  get<1>(session) = flags & partition_in_token ? percent_decode(partition) : partition;
+  get<2>(session) = flags & row_in_token ? percent_decode(row) : row;
+}
+
+/*
+  Free an encoded session
+ */
+void SessionCodec::release (const encoded_t& encoded) {
+  shapes.release(encoded.shape);
+  partitions.release(encoded.partition);
+  arena.deallocate(encoded.block);
+}
@@ -0,0 +1,116 @@
+#ifndef SessionCodec_h
+#define SessionCodec_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+  Compact encoding of sessions for SessionStore
+
+  A SAS token is mostly query parameters that every session shares
+  (sv, tn, sp...), plus the entity's partition and row repeated in
+  spk/epk and srk/erk, an expiry time and a signature. A session is
+  encoded as:
+
+    shape: the token with its per-session values replaced by
+      markers, interned and shared by every session with the same
+      parameters
+    partition: interned, taken from the token's spk when that
+      decodes to the partition, so it is stored once
+    block: a small arena block holding the row (likewise taken
+      from srk), the expiry and other per-session values, and the
+      signature as its 32 raw bytes rather than URL-encoded base64
+
+  Decoding reproduces the original strings exactly; a token that
+  does not fit these patterns is simply kept whole in its block.
+
+  A SessionCodec is not thread-safe; SessionStore keeps one per
+  shard, under the shard's lock.
+ */
+class SessionCodec {
+public:
+  // token, DataPartition, DataRow
+  using session_t = std::tuple<std::string,std::string,std::string>;
+
+  struct encoded_t {
+    std::uint32_t shape;      // Interned token shape
+    std::uint32_t partition;  // Interned partition, or its token form
+    char* block;              // Arena block: flags, row, per-session values
+  };
+
+private:
+  /*
+    Reference-counted strings, each named by a small id
+   */
+  class intern_table {
+    struct interned_t {
+      std::string text;
+      std::uint32_t refs;
+    };
+    std::vector<interned_t> entries;
+    std::unordered_map<std::string,std::uint32_t> ids;
+    std::vector<std::uint32_t> free_ids;
+
+  public:
+    intern_table () : entries {}, ids {}, free_ids {} {}
+    std::uint32_t acquire (const std::string& text);
+    void release (std::uint32_t id);
+    const std::string& text (std::uint32_t id) const { return entries[id].text; }
+    std::size_t size () const { return ids.size(); }
+  };
+
+  /*
+    Allocator of small blocks carved from large chunks, with a free
+    list per 16-byte size class. Each block starts with its size.
+   */
+  class block_arena {
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* next;
+    std::size_t left;
+    std::vector<char*> free_lists;
+    std::unordered_set<char*> large;  // Blocks too big for a size class
+
+  public:
+    block_arena () : chunks {}, next {nullptr}, left {0}, free_lists {}, large {} {}
+    ~block_arena ();
+    block_arena (const block_arena&) = delete;
+    block_arena& operator= (const block_arena&) = delete;
+    char* allocate (std::size_t size);
+    void deallocate (char* block);
+    std::size_t reserved () const;
+  };
+
+  intern_table shapes;
+  intern_table partitions;
+  block_arena arena;
+
+  // Reused by encode() to avoid allocating for every session
+  std::string shape_scratch;
+  std::string values_scratch;
+  std::string block_scratch;
+
+public:
+  SessionCodec () :
+    shapes {}, partitions {}, arena {},
+    shape_scratch {}, values_scratch {}, block_scratch {}
+    {}
+
+  SessionCodec (const SessionCodec&) = delete;
+  SessionCodec& operator= (const SessionCodec&) = delete;
+
+  encoded_t encode (const session_t& session);
+  void decode (const encoded_t& encoded, session_t& session) const;
+  std::string token (const encoded_t& encoded) const;
+  void release (const encoded_t& encoded);
+
+  std::size_t shape_count () const { return shapes.size(); }
+  std::size_t arena_bytes () const { return arena.reserved(); }
+};
+
+#endif
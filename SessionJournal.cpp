@@ -0,0 +1,360 @@
+/*
+  Session snapshot and journal for UserServer.
+
+  Both files are sequences of little-endian records:
+
+    'P' userid token partition row issued_ms   set a session
+    'E' userid                                 remove a session
+
+  where each string is a u32 length followed by its bytes and
+  issued_ms is an i64 count of milliseconds since the epoch.
+  The snapshot starts with the magic "USS2", a u64 count of its
+  records and a u64 length of the records that follow, and holds
+  only 'P' records.
+ */
+
+#include "SessionJournal.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+using std::get;
+using std::string;
+using std::uint64_t;
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+const string snapshot_magic {"USS2"};
+constexpr string::size_type snapshot_header_size {4 + 8 + 8};
+constexpr char put_op {'P'};
+constexpr char erase_op {'E'};
+
+// Snapshot records are written out whenever this much is buffered
+constexpr string::size_type snapshot_chunk_size {64 * 1024};
+
+static void put_u64 (string& out, uint64_t v) {
+  for (int i {0}; i < 8; ++i)
+    out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+static void put_str (string& out, const string& s) {
+  const std::uint32_t n {static_cast<std::uint32_t>(s.size())};
+  for (int i {0}; i < 4; ++i)
+    out.push_back(static_cast<char>(n >> (8 * i)));
+  out.append(s);
+}
+
+static void put_record (string& out, const string& userid,
+                        const SessionJournal::session_t& session,
+                        SessionJournal::wall_time_t issued) {
+  out.push_back(put_op);
+  put_str(out, userid);
+  put_str(out, get<0>(session));
+  put_str(out, get<1>(session));
+  put_str(out, get<2>(session));
+  put_u64(out, static_cast<uint64_t>(duration_cast<milliseconds>(issued.time_since_epoch()).count()));
+}
+
+/*
+  Sequential reader of a buffer of records; every get fails once
+  the buffer runs out
+ */
+class record_reader {
+  const string& buf;
+  string::size_type pos;
+
+public:
+  record_reader (const string& b, string::size_type start) : buf {b}, pos {start} {}
+
+  string::size_type position () const { return pos; }
+
+  bool get_u64 (uint64_t& v) {
+    if (buf.size() - pos < 8)
+      return false;
+    v = 0;
+    for (int i {0}; i < 8; ++i)
+      v |= static_cast<uint64_t>(static_cast<unsigned char>(buf[pos + i])) << (8 * i);
+    pos += 8;
+    return true;
+  }
+
+  bool get_str (string& s) {
+    if (buf.size() - pos < 4)
+      return false;
+    std::uint32_t n {0};
+    for (int i {0}; i < 4; ++i)
+      n |= static_cast<std::uint32_t>(static_cast<unsigned char>(buf[pos + i])) << (8 * i);
+    if (buf.size() - pos - 4 < n)
+      return false;
+    s.assign(buf, pos + 4, n);
+    pos += 4 + n;
+    return true;
+  }
+
+  bool get_op (char& op) {
+    if (pos == buf.size())
+      return false;
+    op = buf[pos++];
+    return true;
+  }
+};
+
+/*
+  Apply the complete records of buf from position start, stopping
+  at the end of the buffer, a torn record or an unknown op
+
+  Returns the position just past the last record applied.
+ */
+static string::size_type parse (const string& buf, string::size_type start,
+                                const SessionJournal::put_t& put,
+                                const SessionJournal::erase_t& erase,
+                                uint64_t& count) {
+  record_reader in {buf, start};
+  string::size_type end {start};
+  string userid {};
+  SessionJournal::session_t session {};
+  uint64_t issued_ms {0};
+  for (;;) {
+    char op {0};
+    if ( ! in.get_op(op) || ! in.get_str(userid))
+      return end;
+    if (op == put_op) {
+      if ( ! in.get_str(get<0>(session)) || ! in.get_str(get<1>(session)) ||
+           ! in.get_str(get<2>(session)) || ! in.get_u64(issued_ms))
+        return end;
+      put(userid, session, SessionJournal::wall_time_t {milliseconds {static_cast<std::int64_t>(issued_ms)}});
+    }
+    else if (op == erase_op) {
+      erase(userid);
+    }
+    else {
+      return end;
+    }
+    ++count;
+    end = in.position();
+  }
+}
+
+static bool read_file (const string& path, string& buf) {
+  std::ifstream in {path, std::ios::binary | std::ios::ate};
+  if ( ! in)
+    return false;
+  buf.resize(static_cast<string::size_type>(in.tellg()));
+  in.seekg(0);
+  return buf.empty() || static_cast<bool>(in.read(&buf[0], buf.size()));
+}
+
+/*
+  Write all of buf to fd, retrying short writes
+ */
+static bool write_all (int fd, const string& buf) {
+  const char* p {buf.data()};
+  string::size_type left {buf.size()};
+  while (left > 0) {
+    ssize_t n {::write(fd, p, left)};
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+SessionJournal::SessionJournal (const string& path) :
+  snapshot_path {path},
+  journal_path {path + ".journal"},
+  old_journal_path {path + ".journal.old"},
+  lock {},
+  journal_fd {-1}
+  {}
+
+SessionJournal::~SessionJournal () {
+  close();
+}
+
+/*
+  Apply the records of the journal at path
+
+  Returns false if there is no such file. count is increased by the
+  number of records applied and valid_bytes set to the length of
+  the intact prefix of the file.
+ */
+bool SessionJournal::replay (const string& path, const put_t& put, const erase_t& erase,
+                             uint64_t& count, uint64_t& valid_bytes) {
+  string buf {};
+  if ( ! read_file(path, buf))
+    return false;
+  valid_bytes = parse(buf, 0, put, erase, count);
+  if (valid_bytes < buf.size())
+    cout << "SessionJournal: ignoring torn record at offset " << valid_bytes
+         << " of " << path << endl;
+  return true;
+}
+
+/*
+  Load the snapshot, then replay the journals over it
+
+  A snapshot whose length does not match its header is ignored. A torn record
+  at the end of the journal is truncated away, so that open() can
+  append after it. Returns the number of records applied.
+ */
+uint64_t SessionJournal::restore (const put_t& put, const erase_t& erase) {
+  uint64_t count {0};
+  string buf {};
+  if (read_file(snapshot_path, buf)) {
+    uint64_t records {0};
+    uint64_t length {0};
+    record_reader header {buf, snapshot_magic.size()};
+    if (buf.compare(0, snapshot_magic.size(), snapshot_magic) == 0 &&
+        header.get_u64(records) && header.get_u64(length) &&
+        buf.size() - snapshot_header_size == length) {
+      parse(buf, snapshot_header_size, put, erase, count);
+      if (count != records)
+        cout << "SessionJournal: snapshot " << snapshot_path << " holds "
+             << count << " of " << records << " sessions" << endl;
+    }
+    else {
+      cout << "SessionJournal: ignoring damaged snapshot " << snapshot_path << endl;
+    }
+  }
+
+  uint64_t valid_bytes {0};
+  replay(old_journal_path, put, erase, count, valid_bytes);
+  if (replay(journal_path, put, erase, count, valid_bytes) &&
+      ::truncate(journal_path.c_str(), valid_bytes) != 0)
+    cout << "SessionJournal: truncate of " << journal_path << " failed" << endl;
+  return count;
+}
+
+/*
+  Open the journal for appending
+ */
+void SessionJournal::open () {
+  guard_t guard {lock};
+  journal_fd = ::open(journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (journal_fd < 0)
+    throw std::runtime_error("SessionJournal: cannot open " + journal_path);
+}
+
+void SessionJournal::close () {
+  guard_t guard {lock};
+  if (journal_fd >= 0) {
+    ::close(journal_fd);
+    journal_fd = -1;
+  }
+}
+
+void SessionJournal::append (const string& record) {
+  guard_t guard {lock};
+  if (journal_fd >= 0 && ! write_all(journal_fd, record))
+    cout << "SessionJournal: append to " << journal_path << " failed" << endl;
+}
+
+/*
+  Record that userid has session, with a token issued at issued
+ */
+void SessionJournal::put (const string& userid, const session_t& session, wall_time_t issued) {
+  string record {};
+  put_record(record, userid, session, issued);
+  append(record);
+}
+
+/*
+  Record that userid no longer has a session
+ */
+void SessionJournal::erase (const string& userid) {
+  string record {};
+  record.push_back(erase_op);
+  put_str(record, userid);
+  append(record);
+}
+
+/*
+  Write every session given by each to a new snapshot and drop the
+  journal it supersedes
+
+  Changes made while each runs go to a fresh journal. Records are
+  written in chunks as each gives them, and the header once they are
+  counted. Returns false if the snapshot could not be written; the
+  journals are then kept.
+ */
+bool SessionJournal::snapshot (const each_t& each) {
+  {
+    guard_t guard {lock};
+    if (journal_fd < 0)
+      return false;
+
+    if (::access(old_journal_path.c_str(), F_OK) == 0) {
+      // A previous snapshot failed, so its journal is still needed; add this one to it
+      string pending {};
+      const int old_fd {::open(old_journal_path.c_str(), O_WRONLY | O_APPEND)};
+      const bool moved {old_fd >= 0 && read_file(journal_path, pending) && write_all(old_fd, pending)};
+      if (old_fd >= 0)
+        ::close(old_fd);
+      if ( ! moved || ::ftruncate(journal_fd, 0) != 0) {
+        cout << "SessionJournal: cannot rotate " << journal_path << endl;
+        return false;
+      }
+    }
+    else {
+      if (::rename(journal_path.c_str(), old_journal_path.c_str()) != 0) {
+        cout << "SessionJournal: cannot rotate " << journal_path << endl;
+        return false;
+      }
+      ::close(journal_fd);
+      journal_fd = ::open(journal_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+      if (journal_fd < 0)
+        cout << "SessionJournal: cannot reopen " << journal_path << endl;
+    }
+  }
+
+  const string tmp {snapshot_path + ".tmp"};
+  const int fd {::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+  bool written {fd >= 0};
+
+  // Zeros stand in for the header until the records are counted
+  string buf (snapshot_header_size, '\0');
+  buf.reserve(snapshot_chunk_size + 1024);
+  uint64_t records {0};
+  uint64_t length {0};
+  auto flush = [fd, &buf, &length, &written] () {
+    written = written && write_all(fd, buf);
+    length += buf.size();
+    buf.clear();
+  };
+  each([&buf, &records, &flush] (const string& userid, const session_t& session, wall_time_t issued) {
+      put_record(buf, userid, session, issued);
+      ++records;
+      if (buf.size() >= snapshot_chunk_size)
+        flush();
+    });
+  flush();
+
+  string header {snapshot_magic};
+  put_u64(header, records);
+  put_u64(header, length - snapshot_header_size);
+  written = written && ::lseek(fd, 0, SEEK_SET) == 0 && write_all(fd, header) && ::fsync(fd) == 0;
+  if (fd >= 0)
+    ::close(fd);
+  if ( ! written || std::rename(tmp.c_str(), snapshot_path.c_str()) != 0) {
+    cout << "SessionJournal: cannot write " << snapshot_path << endl;
+    return false;
+  }
+  ::unlink(old_journal_path.c_str());
+  return true;
+}
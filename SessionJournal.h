@@ -0,0 +1,71 @@
+#ifndef SessionJournal_h
+#define SessionJournal_h
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+/*
+  Snapshot and journal of UserServer's sessions
+
+  Every change to a session is appended to the journal. snapshot()
+  writes all sessions to a compact binary snapshot file and starts
+  a new journal, and restore() loads the snapshot and replays the
+  journal over it.
+
+  The journal is not synced, so it survives a restart or a crash of
+  the process but not of the machine. The snapshot is synced and
+  renamed into place.
+
+  While a snapshot is written, the previous journal is kept beside
+  the new one (with suffix ".old") until the snapshot is in place;
+  restore() replays both. Replaying a change already in the
+  snapshot is harmless, because each record sets or removes a whole
+  session.
+ */
+class SessionJournal {
+public:
+  // token, DataPartition, DataRow
+  using session_t = std::tuple<std::string,std::string,std::string>;
+  using wall_time_t = std::chrono::system_clock::time_point;
+
+  using put_t = std::function<void (const std::string& userid,
+                                    const session_t& session,
+                                    wall_time_t issued)>;
+  using erase_t = std::function<void (const std::string& userid)>;
+
+  // Calls its argument once for every current session
+  using each_t = std::function<void (const put_t&)>;
+
+private:
+  std::string snapshot_path;
+  std::string journal_path;
+  std::string old_journal_path;
+
+  std::mutex lock;
+  int journal_fd;
+
+  void append (const std::string& record);
+  bool replay (const std::string& path, const put_t& put, const erase_t& erase,
+               std::uint64_t& count, std::uint64_t& valid_bytes);
+
+public:
+  explicit SessionJournal (const std::string& path);
+  ~SessionJournal ();
+
+  SessionJournal (const SessionJournal&) = delete;
+  SessionJournal& operator= (const SessionJournal&) = delete;
+
+  std::uint64_t restore (const put_t& put, const erase_t& erase);
+  void open ();
+  void close ();
+
+  void put (const std::string& userid, const session_t& session, wall_time_t issued);
+  void erase (const std::string& userid);
+  bool snapshot (const each_t& each);
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include "SessionStore.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <tuple>
+
+#include <boost/thread/locks.hpp>
+
+using std::string;
+
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+using read_lock_t = boost::shared_lock<boost::shared_mutex>;
+using write_lock_t = boost::unique_lock<boost::shared_mutex>;
+
+/*
+  Convert between steady times, kept in memory, and wall-clock
+  times, which are meaningful across restarts
+
+  offset is the wall-clock time less the steady time, from clock_offset().
+ */
+static system_clock::duration clock_offset () {
+  return system_clock::now().time_since_epoch()
+    - duration_cast<system_clock::duration>(steady_clock::now().time_since_epoch());
+}
+
+static SessionJournal::wall_time_t to_wall (SessionStore::steady_time_t t, system_clock::duration offset) {
+  return SessionJournal::wall_time_t {duration_cast<system_clock::duration>(t.time_since_epoch()) + offset};
+}
+
+static SessionStore::steady_time_t to_steady (SessionJournal::wall_time_t t, system_clock::duration offset) {
+  return SessionStore::steady_time_t {duration_cast<steady_clock::duration>(t.time_since_epoch() - offset)};
+}
+
+SessionStore::SessionStore (std::size_t shard_count) :
+  shards {},
+  journal {nullptr}
+  {
+    shards.resize(std::max<std::size_t>(1, shard_count));
+    for (auto& shard : shards)
+      shard.reset(new shard_t {});
+  }
+
+SessionStore::shard_t& SessionStore::shard_for (const string& userid) const {
+  return *shards[std::hash<string> {} (userid) % shards.size()];
+}
+
+/*
+  Copy the session of userid into session and mark it active
+
+  Returns false, leaving session unchanged, if userid has no session.
+ */
+bool SessionStore::find (const string& userid, session_t& session) const {
+  bool verified {false};
+  return find(userid, session, verified);
+}
+
+/*
+  As find(), also setting verified to false if the session was
+  restored and its token has not been checked since
+ */
+bool SessionStore::find (const string& userid, session_t& session, bool& verified) const {
+  shard_t& shard (shard_for(userid));
+  read_lock_t guard {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+  shard.codec.decode(entry->second.session, session);
+  verified = entry->second.verified;
+  entry->second.last_active.store(steady_clock::now().time_since_epoch().count(),
+                                  std::memory_order_relaxed);
+  return true;
+}
+
+/*
+  Copy the session of userid and its activity times, without
+  marking it active
+
+  Returns false, leaving the arguments unchanged, if userid has no session.
+ */
+bool SessionStore::inspect (const string& userid, session_t& session,
+                            steady_time_t& issued, steady_time_t& last_active) const {
+  shard_t& shard (shard_for(userid));
+  read_lock_t guard {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+  shard.codec.decode(entry->second.session, session);
+  issued = entry->second.issued;
+  last_active = steady_time_t {steady_time_t::duration {entry->second.last_active.load()}};
+  return true;
+}
+
+/*
+  Add a session for userid, with a token issued now, unless it
+  already has one
+
+  Returns false if userid already had a session, which is kept.
+ */
+bool SessionStore::insert (const string& userid, const session_t& session) {
+  return insert(userid, session, steady_clock::now());
+}
+
+/*
+  Add a session for userid, with a token issued at issued, unless it
+  already has one
+ */
+bool SessionStore::insert (const string& userid, const session_t& session, steady_time_t issued) {
+  shard_t& shard (shard_for(userid));
+  write_lock_t guard {shard.lock};
+  if (shard.sessions.count(userid) == 1)
+    return false;
+  const steady_time_t now {steady_clock::now()};
+  shard.sessions.emplace(std::piecewise_construct,
+                         std::forward_as_tuple(userid),
+                         std::forward_as_tuple(shard.codec.encode(session), issued, now, true));
+  if (journal)
+    journal->put(userid, session, to_wall(issued, clock_offset()));
+  return true;
+}
+
+/*
+  Replace the token of userid's session with new_token, issued now
+
+  Returns false, changing nothing, if userid has no session or its
+  token is no longer old_token (the user signed off and on again).
+ */
+bool SessionStore::refresh (const string& userid, const string& old_token,
+                            const string& new_token) {
+  shard_t& shard (shard_for(userid));
+  write_lock_t guard {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end() || shard.codec.token(entry->second.session) != old_token)
+    return false;
+  session_t session {};
+  shard.codec.decode(entry->second.session, session);
+  std::get<0>(session) = new_token;
+  shard.codec.release(entry->second.session);
+  entry->second.session = shard.codec.encode(session);
+  entry->second.issued = steady_clock::now();
+  entry->second.verified = true;
+  if (journal)
+    journal->put(userid, session, to_wall(entry->second.issued, clock_offset()));
+  return true;
+}
+
+/*
+  Remove the session of userid
+
+  Returns false if userid had no session.
+ */
+bool SessionStore::erase (const string& userid) {
+  shard_t& shard (shard_for(userid));
+  write_lock_t guard {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+  shard.codec.release(entry->second.session);
+  shard.sessions.erase(entry);
+  if (journal)
+    journal->erase(userid);
+  return true;
+}
+
+/*
+  Remove the session of userid if its deadline is at or before now
+
+  The deadline is computed by deadline from the times the session's
+  token was issued and the session was last active. Returns true if the session was removed.
+  Otherwise next is set to the deadline of the session, or to
+  steady_time_t::max() if userid has no session.
+ */
+bool SessionStore::expire (const string& userid, steady_time_t now,
+                           const deadline_t& deadline, steady_time_t& next) {
+  next = steady_time_t::max();
+  shard_t& shard (shard_for(userid));
+  write_lock_t guard {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+
+  const steady_time_t last_active {steady_time_t::duration {entry->second.last_active.load()}};
+  const steady_time_t due {deadline(entry->second.issued, last_active)};
+  if (due <= now) {
+    shard.codec.release(entry->second.session);
+    shard.sessions.erase(entry);
+    if (journal)
+      journal->erase(userid);
+    return true;
+  }
+  next = due;
+  return false;
+}
+
+/*
+  Return the number of sessions
+
+  Shards are counted one at a time, so under concurrent updates
+  the result is approximate.
+ */
+std::size_t SessionStore::size () const {
+  std::size_t total {0};
+  for (const auto& shard : shards) {
+    read_lock_t guard {shard->lock};
+    total += shard->sessions.size();
+  }
+  return total;
+}
+
+/*
+  Call visit for every session, holding each shard's lock in turn
+
+  visit must not call back into the store.
+ */
+void SessionStore::for_each (const visit_t& visit) const {
+  session_t session {};
+  for (const auto& shard : shards) {
+    read_lock_t guard {shard->lock};
+    for (const auto& entry : shard->sessions) {
+      shard->codec.decode(entry.second.session, session);
+      visit(entry.first, session, entry.second.issued);
+    }
+  }
+}
+
+/*
+  Load the sessions recorded in from, replacing any already present
+
+  Restored sessions count as active now and are unverified. Call
+  before attaching a journal. Returns the number of records applied.
+ */
+std::uint64_t SessionStore::restore (SessionJournal& from) {
+  const system_clock::duration offset {clock_offset()};
+  const steady_time_t now {steady_clock::now()};
+  auto put = [this, offset, now] (const string& userid, const session_t& session,
+                                  SessionJournal::wall_time_t issued) {
+    shard_t& shard (shard_for(userid));
+    write_lock_t guard {shard.lock};
+    auto entry (shard.sessions.find(userid));
+    if (entry == shard.sessions.end()) {
+      shard.sessions.emplace(std::piecewise_construct,
+                             std::forward_as_tuple(userid),
+                             std::forward_as_tuple(shard.codec.encode(session),
+                                                   to_steady(issued, offset), now, false));
+    }
+    else {
+      shard.codec.release(entry->second.session);
+      entry->second.session = shard.codec.encode(session);
+      entry->second.issued = to_steady(issued, offset);
+      entry->second.last_active = now.time_since_epoch().count();
+      entry->second.verified = false;
+    }
+  };
+  auto erase = [this] (const string& userid) {
+    shard_t& shard (shard_for(userid));
+    write_lock_t guard {shard.lock};
+    auto entry (shard.sessions.find(userid));
+    if (entry != shard.sessions.end()) {
+      shard.codec.release(entry->second.session);
+      shard.sessions.erase(entry);
+    }
+  };
+  return from.restore(put, erase);
+}
+
+/*
+  Record every later change in to; nullptr stops recording
+ */
+void SessionStore::attach (SessionJournal* to) {
+  for (auto& shard : shards)
+    shard->lock.lock();
+  journal = to;
+  for (auto& shard : shards)
+    shard->lock.unlock();
+}
+
+/*
+  Write every session to the attached journal's snapshot
+
+  Returns false if no journal is attached or the snapshot failed.
+ */
+bool SessionStore::snapshot () {
+  if ( ! journal)
+    return false;
+  const system_clock::duration offset {clock_offset()};
+  return journal->snapshot([this, offset] (const SessionJournal::put_t& put) {
+      for_each([&put, offset] (const string& userid, const session_t& session, steady_time_t issued) {
+          put(userid, session, to_wall(issued, offset));
+        });
+    });
+}
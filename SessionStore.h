@@ -0,0 +1,108 @@
+#ifndef SessionStore_h
+#define SessionStore_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include "SessionCodec.h"
+#include "SessionJournal.h"
+
+/*
+  Concurrent map from userid to session, for UserServer
+
+  Sessions are spread over a fixed number of shards by a hash of the
+  userid. Each shard has its own reader-writer lock, so lookups run
+  in parallel and a SignOn or SignOff blocks only the users hashed to
+  the same shard.
+
+  Sessions are kept encoded by a SessionCodec per shard, which
+  shares the parts of tokens and partitions common to many
+  sessions; find() and the other readers decode a copy.
+
+  Each session records when its token was issued and when it was
+  last found, so an expiry policy can be applied to it with expire().
+  refresh() swaps in a renewed token.
+
+  With a journal attached, every change is recorded in it, and
+  snapshot() writes the whole store to it. Sessions brought back by
+  restore() are unverified until their token is refreshed: find()
+  reports this so the caller can check the token before trusting it.
+ */
+class SessionStore {
+public:
+  /*
+    A session: token, DataPartition, DataRow
+    get<0>(session) = token
+    get<1>(session) = DataPartition
+    get<2>(session) = DataRow
+   */
+  using session_t = std::tuple<std::string,std::string,std::string>;
+
+  using steady_time_t = std::chrono::steady_clock::time_point;
+
+  // Deadline of a session, given its token issue and last activity times
+  using deadline_t = std::function<steady_time_t (steady_time_t issued,
+                                                  steady_time_t last_active)>;
+
+  using visit_t = std::function<void (const std::string& userid,
+                                      const session_t& session,
+                                      steady_time_t issued)>;
+
+private:
+  struct entry_t {
+    SessionCodec::encoded_t session;
+    steady_time_t issued;
+    // Updated under the shared lock, so atomic; steady_clock ticks
+    mutable std::atomic<steady_time_t::rep> last_active;
+    // False for a restored session whose token has not been checked
+    std::atomic<bool> verified;
+
+    entry_t (const SessionCodec::encoded_t& s, steady_time_t issued_at, steady_time_t now, bool checked) :
+      session {s}, issued {issued_at}, last_active {now.time_since_epoch().count()},
+      verified {checked} {}
+  };
+
+  struct shard_t {
+    mutable boost::shared_mutex lock;
+    std::unordered_map<std::string,entry_t> sessions;
+    SessionCodec codec;
+  };
+
+  std::vector<std::unique_ptr<shard_t>> shards;
+  SessionJournal* journal;
+
+  shard_t& shard_for (const std::string& userid) const;
+
+public:
+  explicit SessionStore (std::size_t shard_count = 64);
+
+  bool find (const std::string& userid, session_t& session) const;
+  bool find (const std::string& userid, session_t& session, bool& verified) const;
+  bool inspect (const std::string& userid, session_t& session,
+                steady_time_t& issued, steady_time_t& last_active) const;
+  bool insert (const std::string& userid, const session_t& session);
+  bool insert (const std::string& userid, const session_t& session, steady_time_t issued);
+  bool refresh (const std::string& userid, const std::string& old_token,
+                const std::string& new_token);
+  bool erase (const std::string& userid);
+  bool expire (const std::string& userid, steady_time_t now,
+               const deadline_t& deadline, steady_time_t& next);
+  std::size_t size () const;
+  void for_each (const visit_t& visit) const;
+
+  std::uint64_t restore (SessionJournal& from);
+  void attach (SessionJournal* to);
+  bool snapshot ();
+};
+
+#endif
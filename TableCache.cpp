@@ -3,6 +3,11 @@
 #include <cassert>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include <cpprest/asyncrt_utils.h>
 
 #include <was/storage_account.h>
 #include <was/table.h>
@@ -40,3 +45,16 @@ bool TableCache::delete_entry(const string& table_name) {
   cache_t::size_type count {table_cache.erase(table_name)};
   return count == 1;
 }
+
+/*
+  Return a secret for purpose, derived from the account key, so that
+  servers sharing the storage account can show each other they do.
+  Clients never see the account key, so they cannot make one.
+ */
+string TableCache::service_key(const string& purpose) const {
+  std::vector<unsigned char> input {account.credentials().account_key()};
+  input.insert(input.end(), purpose.begin(), purpose.end());
+  std::vector<unsigned char> digest (SHA256_DIGEST_LENGTH, 0);
+  SHA256(input.data(), input.size(), digest.data());
+  return utility::conversions::to_base64(digest);
+}
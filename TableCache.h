@@ -30,6 +30,8 @@ public:
 
   azure::storage::cloud_table lookup_table(const std::string& table_name);
   bool delete_entry(const std::string& table_name);
+
+  std::string service_key(const std::string& purpose) const;
 };
 
 #endif
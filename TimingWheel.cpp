@@ -0,0 +1,196 @@
+#include "TimingWheel.h"
+
+#include <algorithm>
+#include <string>
+
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+/*
+  Operations on circular doubly-linked lists with a head link
+ */
+template <typename Link>
+static void list_init (Link& head) {
+  head.prev = head.next = &head;
+}
+
+template <typename Link>
+static bool list_empty (const Link& head) {
+  return head.next == &head;
+}
+
+template <typename Link>
+static void list_unlink (Link& link) {
+  link.prev->next = link.next;
+  link.next->prev = link.prev;
+  list_init(link);
+}
+
+template <typename Link>
+static void list_push_back (Link& head, Link& link) {
+  link.prev = head.prev;
+  link.next = &head;
+  head.prev->next = &link;
+  head.prev = &link;
+}
+
+// Move every link of from to the end of to
+template <typename Link>
+static void list_splice_back (Link& to, Link& from) {
+  if (list_empty(from))
+    return;
+  from.next->prev = to.prev;
+  to.prev->next = from.next;
+  from.prev->next = &to;
+  to.prev = from.prev;
+  list_init(from);
+}
+
+TimingWheel::TimingWheel (milliseconds tick,
+                          std::size_t expiry_limit,
+                          std::size_t move_limit,
+                          unsigned slot_bits,
+                          unsigned levels) :
+  tick_length {std::max(tick, milliseconds {1})},
+  max_expiries {std::max<std::size_t>(1, expiry_limit)},
+  max_moves {std::max<std::size_t>(1, move_limit)},
+  bits {std::min(std::max(slot_bits, 1u), 16u)},
+  mask {(uint64_t {1} << bits) - 1},
+  level_count {std::min(std::max(levels, 1u), 63u / bits)},
+  origin {steady_clock::now()},
+  lock {},
+  current {0},
+  slots (std::size_t {level_count} << bits),
+  backlog {},
+  due {},
+  timers {}
+  {
+    for (auto& head : slots)
+      list_init(head);
+    list_init(backlog);
+    list_init(due);
+  }
+
+TimingWheel::link_t& TimingWheel::slot (unsigned level, uint64_t tick) {
+  return slots[(std::size_t {level} << bits) + ((tick >> (bits * level)) & mask)];
+}
+
+/*
+  Return the first tick at or after t
+ */
+uint64_t TimingWheel::tick_of (time_point_t t) const {
+  if (t <= origin)
+    return 0;
+  const auto ms (std::chrono::duration_cast<milliseconds>(t - origin).count());
+  return (ms + tick_length.count() - 1) / tick_length.count();
+}
+
+/*
+  Put an unlinked entry into the slot for its deadline, or onto the
+  due list if the deadline has passed. Caller holds lock.
+ */
+void TimingWheel::place (entry_t& entry) {
+  if (entry.due_tick <= current) {
+    list_push_back<link_t>(due, entry);
+    return;
+  }
+  // Level of the highest bit group where the deadline differs from now
+  const uint64_t differ {entry.due_tick ^ current};
+  unsigned level {0};
+  while (level + 1 < level_count && (differ >> (bits * (level + 1))) != 0)
+    ++level;
+  list_push_back<link_t>(slot(level, entry.due_tick), entry);
+}
+
+/*
+  Advance one tick. Caller holds lock.
+
+  Every level whose slot the wheel turns into hands its timers to
+  the backlog, and up to max_moves of the backlog are placed again.
+  With more than one level, the level 0 slot holds only timers due
+  at this tick.
+ */
+void TimingWheel::turn () {
+  ++current;
+  for (unsigned level {1};
+       level < level_count && (current & ((uint64_t {1} << (bits * level)) - 1)) == 0;
+       ++level)
+    list_splice_back(backlog, slot(level, current));
+
+  if (level_count > 1)
+    list_splice_back(due, slot(0, current));
+  else
+    list_splice_back(backlog, slot(0, current));
+
+  for (std::size_t moved {0}; moved < max_moves && ! list_empty(backlog); ++moved) {
+    entry_t& entry (static_cast<entry_t&>(*backlog.next));
+    list_unlink<link_t>(entry);
+    place(entry);
+  }
+}
+
+/*
+  Set the deadline of key, replacing any deadline it already had
+ */
+void TimingWheel::arm (const string& key, time_point_t deadline) {
+  guard_t guard {lock};
+  auto entry (timers.find(key));
+  if (entry == timers.end()) {
+    entry = timers.emplace(key, entry_t {}).first;
+    entry->second.key = &entry->first;
+  }
+  else {
+    list_unlink<link_t>(entry->second);
+  }
+  entry->second.due_tick = tick_of(deadline);
+  place(entry->second);
+}
+
+/*
+  Remove the deadline of key
+
+  Returns false if key had no deadline.
+ */
+bool TimingWheel::cancel (const string& key) {
+  guard_t guard {lock};
+  auto entry (timers.find(key));
+  if (entry == timers.end())
+    return false;
+  list_unlink<link_t>(entry->second);
+  timers.erase(entry);
+  return true;
+}
+
+/*
+  Turn the wheel up to now and return keys whose deadlines have passed
+
+  At most expiry_limit keys are returned; the timers of returned keys
+  are removed.
+ */
+vector<string> TimingWheel::advance (time_point_t now) {
+  guard_t guard {lock};
+  const uint64_t target {now <= origin ? 0 :
+      static_cast<uint64_t>((now - origin) / tick_length)};
+  while (current < target)
+    turn();
+
+  vector<string> expired {};
+  while ( ! list_empty(due) && expired.size() < max_expiries) {
+    entry_t& entry (static_cast<entry_t&>(*due.next));
+    list_unlink<link_t>(entry);
+    expired.push_back(*entry.key);
+    timers.erase(expired.back());
+  }
+  return expired;
+}
+
+std::size_t TimingWheel::size () const {
+  guard_t guard {lock};
+  return timers.size();
+}
@@ -0,0 +1,84 @@
+#ifndef TimingWheel_h
+#define TimingWheel_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+  Hierarchical timing wheel of named deadlines
+
+  Time is divided into ticks of tick_length. Level 0 has one slot
+  per tick; each higher level has slots spanning a whole turn of the
+  level below, so level_count levels of 2^slot_bits slots cover
+  2^(slot_bits * level_count) ticks. A timer sits in the level of the
+  highest slot_bits group in which its deadline differs from the
+  current tick, and is moved down when the wheel turns into its slot.
+  Deadlines beyond the top level are held there and placed again
+  when their slot comes round.
+
+  Slots are intrusive lists, so arm(), cancel() and turning into a
+  slot take constant time. Timers turned out of a higher level are
+  moved down at most move_limit per tick, and advance() returns at
+  most expiry_limit keys; the rest wait for the next tick. Work per
+  tick is therefore bounded, at the cost of a timer firing late when
+  more than move_limit timers come down at once.
+
+  A key has at most one timer: arming it again moves the deadline.
+ */
+class TimingWheel {
+public:
+  using time_point_t = std::chrono::steady_clock::time_point;
+
+private:
+  struct link_t {
+    link_t* prev;
+    link_t* next;
+  };
+
+  struct entry_t : link_t {
+    std::uint64_t due_tick;
+    const std::string* key;  // Key of this entry in timers
+  };
+
+  std::chrono::milliseconds tick_length;
+  std::size_t max_expiries;
+  std::size_t max_moves;
+  unsigned bits;
+  std::uint64_t mask;
+  unsigned level_count;
+  time_point_t origin;
+
+  mutable std::mutex lock;
+  std::uint64_t current;      // Last tick processed
+  std::vector<link_t> slots;  // level_count levels of 2^bits list heads
+  link_t backlog;             // Timers turned out of a higher level, to move down
+  link_t due;                 // Expired timers not yet returned
+  std::unordered_map<std::string,entry_t> timers;
+
+  link_t& slot (unsigned level, std::uint64_t tick);
+  std::uint64_t tick_of (time_point_t t) const;
+  void place (entry_t& entry);
+  void turn ();
+
+public:
+  TimingWheel (std::chrono::milliseconds tick,
+               std::size_t expiry_limit = 1000,
+               std::size_t move_limit = 10000,
+               unsigned slot_bits = 6,
+               unsigned levels = 4);
+
+  TimingWheel (const TimingWheel&) = delete;
+  TimingWheel& operator= (const TimingWheel&) = delete;
+
+  void arm (const std::string& key, time_point_t deadline);
+  bool cancel (const std::string& key);
+  std::vector<std::string> advance (time_point_t now);
+  std::size_t size () const;
+};
+
+#endif
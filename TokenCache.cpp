@@ -0,0 +1,87 @@
+#include "TokenCache.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+using std::string;
+using std::uint8_t;
+
+using std::chrono::milliseconds;
+using std::chrono::system_clock;
+
+using guard_t = std::lock_guard<std::mutex>;
+
+TokenCache::TokenCache (std::size_t max_entries, milliseconds margin) :
+  capacity {std::max<std::size_t>(1, max_entries)},
+  refresh_margin {margin},
+  lock {},
+  entries {},
+  hit_count {0},
+  miss_count {0}
+  {}
+
+/*
+  Azure keys cannot hold control characters, so NUL separates the
+  parts unambiguously
+ */
+string TokenCache::key_of (const string& partition, const string& row, uint8_t permissions) {
+  string key {partition};
+  key.push_back('\0');
+  key.append(row);
+  key.push_back('\0');
+  key.push_back(static_cast<char>(permissions));
+  return key;
+}
+
+/*
+  Set token to a cached token for the entity partition/row with
+  permissions, if there is one not yet within refresh_margin of expiring
+ */
+bool TokenCache::lookup (const string& partition, const string& row, uint8_t permissions,
+                         string& token) {
+  const string key {key_of(partition, row, permissions)};
+  guard_t guard {lock};
+  auto entry (entries.find(key));
+  if (entry == entries.end() || entry->second.expires - refresh_margin <= system_clock::now()) {
+    ++miss_count;
+    return false;
+  }
+  token = entry->second.token;
+  ++hit_count;
+  return true;
+}
+
+/*
+  Cache token, which expires at expires, for the entity partition/row
+  with permissions, replacing any token cached for it
+ */
+void TokenCache::insert (const string& partition, const string& row, uint8_t permissions,
+                         const string& token, wall_time_t expires) {
+  string key {key_of(partition, row, permissions)};
+  guard_t guard {lock};
+  auto entry (entries.find(key));
+  if (entry != entries.end()) {
+    entry->second = entry_t {token, expires};
+    return;
+  }
+
+  if (entries.size() >= capacity) {
+    const wall_time_t reuse_limit {system_clock::now() + refresh_margin};
+    for (auto e (entries.begin()); e != entries.end(); ) {
+      if (e->second.expires <= reuse_limit)
+        e = entries.erase(e);
+      else
+        ++e;
+    }
+    // Start afresh rather than sweep again on the next few inserts
+    if (entries.size() >= capacity / 4 * 3)
+      entries.clear();
+  }
+  entries.emplace(std::move(key), entry_t {token, expires});
+}
+
+TokenCache::metrics_t TokenCache::metrics () const {
+  guard_t guard {lock};
+  return metrics_t {hit_count, miss_count, entries.size()};
+}
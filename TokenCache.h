@@ -0,0 +1,63 @@
+#ifndef TokenCache_h
+#define TokenCache_h
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+  Cache of the SAS tokens AuthServer has issued, keyed by entity and
+  permissions
+
+  A token is handed out again by lookup() until it is within
+  refresh_margin of expiring, so that every sign-on of a user within
+  that time gets the same token without signing a new one. A client
+  keeping a token must therefore go by its expiry time (its "se"
+  parameter), not by when it received it.
+
+  At most capacity tokens are kept. When full, tokens no longer
+  handed out are dropped, and if that frees too little, all are.
+ */
+class TokenCache {
+public:
+  using wall_time_t = std::chrono::system_clock::time_point;
+
+  struct metrics_t {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::size_t size;
+  };
+
+private:
+  struct entry_t {
+    std::string token;
+    wall_time_t expires;
+  };
+
+  std::size_t capacity;
+  std::chrono::milliseconds refresh_margin;
+
+  mutable std::mutex lock;
+  std::unordered_map<std::string,entry_t> entries;
+  std::uint64_t hit_count;
+  std::uint64_t miss_count;
+
+  static std::string key_of (const std::string& partition, const std::string& row, std::uint8_t permissions);
+
+public:
+  TokenCache (std::size_t max_entries, std::chrono::milliseconds margin);
+
+  TokenCache (const TokenCache&) = delete;
+  TokenCache& operator= (const TokenCache&) = delete;
+
+  bool lookup (const std::string& partition, const std::string& row, std::uint8_t permissions,
+               std::string& token);
+  void insert (const std::string& partition, const std::string& row, std::uint8_t permissions,
+               const std::string& token, wall_time_t expires);
+
+  metrics_t metrics () const;
+};
+
+#endif
@@ -2,20 +2,37 @@
  User Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <tuple>
 
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
 #include <was/common.h>
 #include <was/table.h>
 
 #include "make_unique.h"
 #include "ClientUtils.h"
+#include "FriendGraph.h"
+#include "InternTable.h"
+#include "SessionStore.h"
+#include "TimingWheel.h"
 
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
@@ -61,10 +78,17 @@ constexpr const char* push_addr {"http://localhost:34574/"};
 
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
+const string list_add_auth {"ListAddAuth"};
+const string list_remove_auth {"ListRemoveAuth"};
+const string read_range_admin {"ReadRangeAdmin"};
+const string read_entity_admin {"ReadEntityAdmin"};
 
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
 const string get_update_data_op {"GetUpdateData"};
+const string refresh_update_tokens_op {"RefreshUpdateTokens"};
+const string check_data_row_opt {"CheckDataRow"};
+const string data_row_exists_prop {"DataRowExists"};
 
 const string auth_table_name {"AuthTable"};
 const string auth_table_userid_partition {"Userid"};
@@ -74,6 +98,12 @@ const string auth_table_row_prop {"DataRow"};
 const string data_table_name {"DataTable"};
 const string data_table_friends_prop {"Friends"};
 const string data_table_status_prop {"Status"};
+const string timeline_table_name {"TimelineTable"};
+const string timeline_author_prop {"Author"};
+const string timeline_status_prop {"Status"};
+const string outbox_table_name {"OutboxTable"};
+const string celebrity_table_name {"CelebrityTable"};
+const string celebrity_partition {"Celebrity"};
 
 const string sign_on_op {"SignOn"};
 const string sign_off_op {"SignOff"};
@@ -82,16 +112,148 @@ const string remove_friend_op {"UnFriend"};
 const string read_friend_list_op {"ReadFriendList"};
 const string update_status_op {"UpdateStatus"};
 const string push_status_op {"PushStatus"};
+const string set_followers_op {"SetFollowers"};
+const string add_follower_op {"AddFollower"};
+const string remove_follower_op {"RemoveFollower"};
+const string drop_followers_op {"DropFollowers"};
+const string read_updates_op {"ReadUpdates"};
+
+// Number of updates returned by ReadUpdates, by default and at most
+constexpr int default_updates_count {20};
+constexpr int max_updates_count {100};
+
+// How long the cached celebrity table is used before being read again
+constexpr std::chrono::seconds celebrity_ttl {30};
+
+// Most celebrities read from the celebrity table
+constexpr int max_celebrities {10000};
+
+// A session ends after this long without a request
+constexpr std::chrono::minutes session_idle_timeout {30};
+
+// A session ends shortly before the 24-hour token AuthServer issued for it
+constexpr std::chrono::hours token_lifetime {24};
+constexpr std::chrono::minutes session_lifetime {24 * 60 - 5};
+
+// Resolution of session expiry, and most sessions expired per tick
+constexpr std::chrono::seconds expiry_tick {1};
+constexpr std::size_t max_expiries_per_tick {1000};
+
+/*
+  Token refresh: a session's token is renewed this long after it was
+  issued, provided the session was active within the last
+  refresh_activity_window. Refreshes go to AuthServer at most
+  max_refreshes_per_tick a second, in batches of refresh_batch_size;
+  a refresh that fails is tried again after refresh_retry.
+ */
+constexpr std::chrono::minutes token_refresh_after {24 * 60 - 20};
+constexpr std::chrono::minutes refresh_activity_window {10};
+constexpr std::chrono::minutes refresh_retry {1};
+constexpr std::size_t max_refreshes_per_tick {200};
+constexpr std::size_t refresh_batch_size {50};
+
+// Sessions are written to a snapshot this often, and at shutdown
+constexpr std::chrono::minutes snapshot_interval {5};
+const string def_session_file {"sessions.snap"};
 
 /*
   A map that maps each userid  to a tuple comprising a token, a DataPartition, and a DataRow. 
-  When the user signs off, the entry is erased from the map
-  get<0>(user_map[userid]) = token
-  get<1>(user_map[userid]) = DataPartition
-  get<2>(user_map[userid]) = DataRow
+  When the user signs off, the entry is erased from the map.
+  Handlers run concurrently, so the map is a SessionStore, which
+  does its own locking; read a session into a local with find().
+  get<0>(session) = token
+  get<1>(session) = DataPartition
+  get<2>(session) = DataRow
 */
-typedef tuple<string, string, string> three_tuple_string;
-unordered_map<string, three_tuple_string> user_map {};
+typedef SessionStore::session_t three_tuple_string;
+SessionStore user_map {};
+
+/*
+  Expiry deadline of every session, keyed by userid
+
+  A timer is armed at SignOn and cancelled at SignOff. Requests do
+  not touch the wheel: when a timer fires, the session's deadline is
+  recomputed from its last activity and the timer armed again if the
+  session is still live.
+ */
+TimingWheel session_timers {expiry_tick, max_expiries_per_tick};
+
+/*
+  Token refresh time of every session, keyed by userid
+
+  The wheel releases at most max_refreshes_per_tick keys a tick,
+  which limits the rate of refreshes sent to AuthServer.
+ */
+TimingWheel refresh_timers {expiry_tick, max_refreshes_per_tick};
+
+/*
+  Locks ordering the changes to one user's session and its timers
+
+  Adding a session and arming its timers, or removing it and
+  cancelling them, is done holding the lock of the userid, so that a
+  SignOff's cancel cannot land on the timers of a session a
+  concurrent SignOn has just made. Userids share the locks by hash.
+ */
+std::array<std::mutex,64> session_locks {};
+
+std::mutex& session_lock (const string& userid) {
+  return session_locks[std::hash<string> {} (userid) % session_locks.size()];
+}
+
+std::atomic<bool> sessions_stopping {false};
+
+/*
+  Ids of every user this server has seen, in friends lists, sessions
+  and the celebrity cache
+ */
+InternTable user_ids {};
+
+/*
+  Friends lists of signed-on users, loaded from DataTable on first
+  use in a session and dropped when the session ends. AddFriend and
+  UnFriend change the list in memory and write it back; ReadFriendList
+  reads it from memory.
+
+  PushServer keeps its own copy of each list, to know whom a status
+  goes to: a list is sent to it whole when loaded here, and each
+  change after that as it is written, so UpdateStatus need only name
+  the author.
+ */
+FriendGraph friend_graph {user_ids};
+
+/*
+  Cache of the celebrity table
+
+  PushServer writes the statuses of users with very many friends
+  once, to their outbox, and lists them in the celebrity table.
+  Each such author's id maps to the ids of their friends, who are
+  the readers that must merge the author's outbox into their own
+  timeline.
+ */
+unordered_map<InternTable::id_t, std::unordered_set<InternTable::id_t>> celebrity_readers {};
+std::chrono::steady_clock::time_point celebrity_refreshed {};
+bool celebrity_loaded {false};
+bool celebrity_refreshing {false};    // A request is reloading the cache
+std::condition_variable celebrity_refreshed_cv {};
+std::mutex celebrity_lock {};
+
+/*
+  Return the id of the user whose session this is
+ */
+InternTable::id_t session_user (const three_tuple_string& session) {
+  return user_ids.intern(get<1>(session), get<2>(session));
+}
+
+/*
+  Forget the friends list of (country, name), so that it is read
+  from DataTable on its next use
+ */
+void drop_friends (const string& country, const string& name) {
+  InternTable::id_t user {0};
+  // A user never interned has no list to drop
+  if (user_ids.find(InternTable::key_of(country, name), user))
+    friend_graph.drop(user);
+}
 
 /*
   Utility to create JSON object value from vector of properties
@@ -143,6 +305,499 @@ unordered_map<string,string> get_json_body(http_request message) {
   return results;
 }
 
+/*
+  Read up to count entries of one partition of a timeline-shaped
+  table (the timeline or outbox table), most recent first
+
+  A missing table or partition is an empty timeline.
+ */
+pair<status_code,timeline_t> read_timeline (const string& table, const string& partition, int count) {
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr +
+                                              read_range_admin + "/" +
+                                              table + "/" +
+                                              partition + "/" +
+                                              std::to_string(count))};
+  timeline_t entries {};
+  if (result.first == status_codes::NotFound)
+    return make_pair(status_codes::OK, entries);
+  if (result.first != status_codes::OK)
+    return make_pair(result.first, entries);
+
+  for (const auto& row : result.second.as_array()) {
+    entries.push_back(timeline_entry_t {get_json_object_prop (row, "Row"),
+                                        get_json_object_prop (row, timeline_author_prop),
+                                        get_json_object_prop (row, timeline_status_prop)});
+  }
+  return make_pair(status_codes::OK, entries);
+}
+
+/*
+  Read the celebrity table and the celebrities' friends lists into
+  readers, returning false if the table could not be read
+ */
+bool read_celebrities (unordered_map<InternTable::id_t, std::unordered_set<InternTable::id_t>>& readers) {
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr +
+                                              read_range_admin + "/" +
+                                              celebrity_table_name + "/" +
+                                              celebrity_partition + "/" +
+                                              std::to_string(max_celebrities))};
+  if (result.first != status_codes::OK && result.first != status_codes::NotFound)
+    return false;
+
+  friends_view_t friend_views {};
+  if (result.first == status_codes::OK) {
+    for (const auto& row : result.second.as_array()) {
+      const string author {get_json_object_prop (row, "Row")};
+      const string::size_type delim {author.find(pair_delimiter)};
+      if (delim == string::npos)
+        continue;
+
+      pair<status_code,value> author_data {do_request (methods::GET,
+                                                       addr +
+                                                       read_entity_admin + "/" +
+                                                       data_table_name + "/" +
+                                                       author.substr(0, delim) + "/" +
+                                                       author.substr(delim + 1))};
+      if (author_data.first != status_codes::OK)
+        continue;
+      std::unordered_set<InternTable::id_t>& author_readers (readers[user_ids.intern(author)]);
+      const string friends {get_json_object_prop (author_data.second, data_table_friends_prop)};
+      try {
+        parse_friends_list (friends, friend_views);
+        for (const auto& f : friend_views)
+          author_readers.insert(user_ids.intern(timeline_partition(f)));
+      }
+      catch (const std::invalid_argument& e) {
+        cout << "Misformed friends list for " << author << endl;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+  Reload the celebrity cache if it is older than celebrity_ttl
+
+  Only one request reloads at a time, without holding celebrity_lock;
+  the others meanwhile use the old cache, or wait for the first load.
+  If the read fails the old cache is kept.
+ */
+void refresh_celebrities () {
+  {
+    std::unique_lock<std::mutex> guard {celebrity_lock};
+    if (celebrity_loaded && std::chrono::steady_clock::now() - celebrity_refreshed < celebrity_ttl)
+      return;
+    if (celebrity_refreshing) {
+      if ( ! celebrity_loaded)
+        celebrity_refreshed_cv.wait(guard, [] () { return ! celebrity_refreshing; });
+      return;
+    }
+    celebrity_refreshing = true;
+  }
+
+  unordered_map<InternTable::id_t, std::unordered_set<InternTable::id_t>> readers {};
+  bool read {false};
+  try {
+    read = read_celebrities(readers);
+  }
+  catch (const std::exception& e) {
+    cout << "Celebrity table not read: " << e.what() << endl;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard {celebrity_lock};
+    if (read) {
+      celebrity_readers.swap(readers);
+      celebrity_refreshed = std::chrono::steady_clock::now();
+      celebrity_loaded = true;
+    }
+    celebrity_refreshing = false;
+  }
+  celebrity_refreshed_cv.notify_all();
+}
+
+/*
+  Return the celebrities whose outboxes reader ("country;name") must merge
+ */
+vector<string> celebrities_read_by (const string& reader) {
+  refresh_celebrities();
+
+  vector<string> authors {};
+  InternTable::id_t reader_id {0};
+  // Every celebrity's friends were interned when the cache was loaded
+  if ( ! user_ids.find(reader, reader_id))
+    return authors;
+  std::lock_guard<std::mutex> guard {celebrity_lock};
+  for (const auto& celebrity : celebrity_readers) {
+    if (celebrity.second.count(reader_id) == 1)
+      authors.push_back(user_ids.key(celebrity.first));
+  }
+  return authors;
+}
+
+/*
+  Return when token was issued, judged by its expiry time
+
+  AuthServer hands out a token it issued earlier to every sign-on
+  until the token is close to expiring, so a token received now may
+  be hours old. A token whose expiry cannot be read is taken as new.
+ */
+SessionStore::steady_time_t token_issued (const string& token, SessionStore::steady_time_t now) {
+  std::map<string,string> params {uri::split_query(token)};
+  auto expiry (params.find("se"));
+  if (expiry == params.end())
+    return now;
+  utility::datetime exptime {utility::datetime::from_string(uri::decode(expiry->second),
+                                                            utility::datetime::ISO_8601)};
+  if ( ! exptime.is_initialized())
+    return now;
+
+  // datetime intervals are in units of 100 ns
+  const std::chrono::seconds remaining {static_cast<std::int64_t>(exptime.to_interval() / 10000000) -
+                                        static_cast<std::int64_t>(utility::datetime::utc_now().to_interval() / 10000000)};
+  const std::chrono::seconds age {std::chrono::duration_cast<std::chrono::seconds>(token_lifetime) - remaining};
+  return now - std::min(std::max(age, std::chrono::seconds {0}),
+                        std::chrono::duration_cast<std::chrono::seconds>(token_lifetime));
+}
+
+/*
+  Deadline of a session: idle timeout or token lifetime, whichever is first
+ */
+SessionStore::steady_time_t session_deadline (SessionStore::steady_time_t issued,
+                                              SessionStore::steady_time_t last_active) {
+  return std::min(issued + session_lifetime, last_active + session_idle_timeout);
+}
+
+/*
+  Expiry thread: each tick, end the sessions whose timers fired and
+  are past their deadline, and re-arm the rest
+ */
+void expire_sessions () {
+  while ( ! sessions_stopping) {
+    std::this_thread::sleep_for(expiry_tick);
+    const SessionStore::steady_time_t now {std::chrono::steady_clock::now()};
+    for (const string& userid : session_timers.advance(now)) {
+      three_tuple_string session {};
+      SessionStore::steady_time_t issued {};
+      SessionStore::steady_time_t last_active {};
+      std::lock_guard<std::mutex> guard {session_lock(userid)};
+      const bool found {user_map.inspect(userid, session, issued, last_active)};
+      SessionStore::steady_time_t next {};
+      if (user_map.expire(userid, now, &session_deadline, next)) {
+        cout << "Session of " << userid << " expired" << endl;
+        refresh_timers.cancel(userid);
+        if (found)
+          drop_friends (get<1>(session), get<2>(session));
+      }
+      else if (next != SessionStore::steady_time_t::max()) {
+        session_timers.arm(userid, next);
+      }
+    }
+  }
+}
+
+/*
+  Snapshot thread: write the sessions to their snapshot every
+  snapshot_interval
+ */
+void snapshot_sessions () {
+  std::chrono::steady_clock::time_point next {std::chrono::steady_clock::now() + snapshot_interval};
+  while ( ! sessions_stopping) {
+    std::this_thread::sleep_for(expiry_tick);
+    if (std::chrono::steady_clock::now() < next)
+      continue;
+    if ( ! user_map.snapshot())
+      cout << "Session snapshot failed" << endl;
+    next = std::chrono::steady_clock::now() + snapshot_interval;
+  }
+}
+
+/*
+  Renew the tokens of one batch of sessions through AuthServer
+
+  batch maps userid to current token. Renewed tokens replace the
+  old ones in user_map, unless the user signed off or on again in
+  the meantime, and are scheduled for their own refresh. If
+  AuthServer cannot be reached, the whole batch is retried later;
+  a token AuthServer rejects is not retried.
+ */
+void refresh_batch (const vector<pair<string,string>>& batch) {
+  vector<pair<string,value>> tokens {};
+  for (const auto& b : batch)
+    tokens.push_back(make_pair(b.first, value::string(b.second)));
+
+  pair<status_code,value> result {do_request (methods::POST,
+                                              auth_addr + refresh_update_tokens_op,
+                                              value::object(tokens))};
+  const SessionStore::steady_time_t now {std::chrono::steady_clock::now()};
+  if (result.first != status_codes::OK) {
+    cout << "Token refresh failed: " << result.first << endl;
+    for (const auto& b : batch)
+      refresh_timers.arm(b.first, now + refresh_retry);
+    return;
+  }
+
+  unordered_map<string,string> renewed {unpack_json_object (result.second)};
+  for (const auto& b : batch) {
+    auto token (renewed.find(b.first));
+    if (token == renewed.end()) {
+      cout << "Token of " << b.first << " not renewed" << endl;
+    }
+    else if (user_map.refresh(b.first, b.second, token->second)) {
+      refresh_timers.arm(b.first, now + token_refresh_after);
+    }
+  }
+}
+
+/*
+  Refresh thread: each tick, renew the tokens of sessions that are
+  due and were active recently
+
+  A due session that has been idle is checked again later, in case
+  it becomes active before it expires.
+ */
+void refresh_tokens () {
+  while ( ! sessions_stopping) {
+    std::this_thread::sleep_for(expiry_tick);
+    const SessionStore::steady_time_t now {std::chrono::steady_clock::now()};
+    vector<pair<string,string>> batch {};
+    for (const string& userid : refresh_timers.advance(now)) {
+      three_tuple_string session {};
+      SessionStore::steady_time_t issued {};
+      SessionStore::steady_time_t last_active {};
+      {
+        std::lock_guard<std::mutex> guard {session_lock(userid)};
+        if ( ! user_map.inspect(userid, session, issued, last_active))
+          continue;
+        if (now - last_active > refresh_activity_window) {
+          refresh_timers.arm(userid, now + refresh_retry);
+          continue;
+        }
+      }
+      batch.push_back(make_pair(userid, get<0>(session)));
+      if (batch.size() == refresh_batch_size) {
+        refresh_batch(batch);
+        batch.clear();
+      }
+    }
+    if ( ! batch.empty())
+      refresh_batch(batch);
+  }
+}
+
+/*
+  Copy the session of userid into session, as SessionStore::find()
+
+  A session restored from the snapshot is verified on first use by
+  having AuthServer refresh its token. If AuthServer rejects the
+  token, the session is ended and false returned. If AuthServer
+  cannot be reached, the session is used unverified.
+ */
+bool find_session (const string& userid, three_tuple_string& session) {
+  bool verified {true};
+  if ( ! user_map.find(userid, session, verified))
+    return false;
+  if (verified)
+    return true;
+
+  const string token {get<0>(session)};
+  pair<status_code,value> result {do_request (methods::POST,
+                                              auth_addr + refresh_update_tokens_op,
+                                              value::object(vector<pair<string,value>>
+                                                            {make_pair(userid, value::string(token))}))};
+  if (result.first != status_codes::OK)
+    return true;
+
+  if ( ! result.second.has_field(userid)) {
+    cout << "Restored session of " << userid << " rejected" << endl;
+    std::lock_guard<std::mutex> guard {session_lock(userid)};
+    three_tuple_string current {};
+    // Only the session that was rejected, not one a SignOn made since
+    if (user_map.find(userid, current) && get<0>(current) == token && user_map.erase(userid)) {
+      session_timers.cancel(userid);
+      refresh_timers.cancel(userid);
+      drop_friends (get<1>(session), get<2>(session));
+    }
+    return false;
+  }
+
+  const string renewed {result.second[userid].as_string()};
+  if (user_map.refresh(userid, token, renewed)) {
+    refresh_timers.arm(userid, std::chrono::steady_clock::now() + token_refresh_after);
+    get<0>(session) = renewed;
+    return true;
+  }
+  // Changed meanwhile, by a concurrent request or a SignOff
+  return user_map.find(userid, session);
+}
+
+/*
+  Read the friends list of the user whose session this is, from the
+  user's DataTable entity with the session's token
+
+  AddFriend, UnFriend and UpdateStatus call this directly, rather
+  than send ReadFriendList to this server.
+ */
+pair<status_code,string> read_friend_list (const three_tuple_string& session) {
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr +
+                                              read_entity_auth + "/" +
+                                              data_table_name + "/" +
+                                              get<0>(session) + "/" +
+                                              get<1>(session) + "/" +
+                                              get<2>(session))};
+  if (result.first != status_codes::OK)
+    return make_pair(result.first, string {});
+  return make_pair(result.first, get_json_object_prop (result.second, data_table_friends_prop));
+}
+
+/*
+  POST path to PushServer, returning true if it answered OK
+ */
+bool post_push (const string& path, const value& body) {
+  try {
+    pair<status_code,value> result {do_request (methods::POST, push_addr + path, body)};
+    if (result.first == status_codes::OK)
+      return true;
+    cout << "PushServer " << path << ": " << result.first << endl;
+  }
+  catch (const std::exception& e) {
+    cout << "PushServer " << path << ": " << e.what() << endl;
+  }
+  return false;
+}
+
+/*
+  Send op, a change to the friends list of the session's user, to
+  PushServer's follower index, with the path segments in rest and
+  body
+
+  PushServer applies changes to the list it holds, so one it misses
+  would leave that list wrong. If it does not take the change, it is
+  sent DropFollowers instead, and reads the list from DataTable when
+  next needed. Returns false if that fails too, as when PushServer
+  cannot be reached.
+ */
+bool notify_followers (const three_tuple_string& session, const string& op, const string& rest, const value& body) {
+  const string author {get<1>(session) + "/" + get<2>(session)};
+  if (post_push (op + "/" + author + rest, body))
+    return true;
+  return post_push (drop_followers_op + "/" + author, value {});
+}
+
+/*
+  Load the friends list of the session's user into friend_graph from
+  DataTable, unless it is loaded already
+
+  The list is also sent to PushServer, which may hold one from
+  before this session that was since changed in DataTable directly.
+ */
+status_code load_friends (const three_tuple_string& session) {
+  const InternTable::id_t owner {session_user (session)};
+  if (friend_graph.loaded(owner))
+    return status_codes::OK;
+
+  pair<status_code,string> stored {read_friend_list (session)};
+  if (stored.first != status_codes::OK)
+    return stored.first;
+  FriendGraph::list_t list {};
+  try {
+    list = parse_friends_list(stored.second);
+  }
+  catch (const std::invalid_argument& e) {
+    cout << "Error: " << e.what() << endl;
+    return status_codes::InternalError;
+  }
+  // Only the request that loads the list sends it, and change() waits
+  // until it has, so no change to the list can overtake it
+  friend_graph.load(owner, list, [&session, &stored] () {
+      return notify_followers (session, set_followers_op, string {},
+                               build_json_value (data_table_friends_prop, stored.second));
+    });
+  return status_codes::OK;
+}
+
+/*
+  Return the friends list of the session's user, as a friends-list
+  string, from friend_graph
+ */
+pair<status_code,string> session_friends (const three_tuple_string& session) {
+  const InternTable::id_t owner {session_user (session)};
+  // A list dropped by a concurrent sign-on is loaded again
+  for (int attempt {0}; attempt < 2; ++attempt) {
+    status_code loaded {load_friends (session)};
+    if (loaded != status_codes::OK)
+      return make_pair(loaded, string {});
+    FriendGraph::list_t list {};
+    if (friend_graph.friends(owner, list))
+      return make_pair(status_codes::OK, friends_list_to_string(list));
+  }
+  return make_pair(status_codes::ServiceUnavailable, string {});
+}
+
+/*
+  Add (country, name) to the friends of the session's user, or
+  remove it if adding is false, in DataTable with the session's
+  token and then in friend_graph
+
+  BasicServer edits the stored list itself, so the change costs one
+  request of one friend, and a change made meanwhile from another
+  device is kept rather than overwritten. Adding a friend already
+  listed, or removing one not listed, is OK and writes nothing.
+
+  Once written, the change is sent to PushServer while change() still
+  holds the user's write lock, so PushServer gets one user's changes
+  in the order DataTable did. If PushServer takes neither the change
+  nor the drop of its list, the list is dropped here too, so that the
+  next use loads it again and resends it whole.
+ */
+status_code change_friends (const three_tuple_string& session, const FriendGraph::friend_t& f, bool adding) {
+  const InternTable::id_t owner {session_user (session)};
+  for (int attempt {0}; attempt < 2; ++attempt) {
+    status_code loaded {load_friends (session)};
+    if (loaded != status_codes::OK)
+      return loaded;
+
+    InternTable::id_t friend_id {0};
+    if (adding)
+      friend_id = user_ids.intern(f.first, f.second);
+    else if ( ! user_ids.find(InternTable::key_of(f.first, f.second), friend_id))
+      return status_codes::OK;    // Never seen, so in nobody's list
+
+    status_code written {status_codes::ServiceUnavailable};
+    auto write = [&session, &f, owner, adding, &written] () {
+      pair<status_code,value> result {do_request (methods::PUT,
+                                                  addr +
+                                                  (adding ? list_add_auth : list_remove_auth) + "/" +
+                                                  data_table_name + "/" +
+                                                  get<0>(session) + "/" +
+                                                  get<1>(session) + "/" +
+                                                  get<2>(session),
+                                                  value::object (vector<pair<string,value>>
+                                                                 {make_pair(data_table_friends_prop,
+                                                                            value::string(InternTable::key_of(f.first, f.second)))}))};
+      written = result.first;
+      if (result.first != status_codes::OK)
+        return false;
+      if ( ! notify_followers (session, adding ? add_follower_op : remove_follower_op,
+                               "/" + f.first + "/" + f.second, value {}))
+        friend_graph.drop(owner);
+      return true;
+    };
+    FriendGraph::update_t update {friend_graph.change(owner, friend_id, adding, write)};
+    if (update == FriendGraph::update_t::not_loaded)
+      continue;
+    if (update == FriendGraph::update_t::unchanged)
+      return status_codes::OK;
+    if (update == FriendGraph::update_t::failed)
+      return written;
+    return status_codes::OK;
+  }
+  return status_codes::ServiceUnavailable;
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
  */
@@ -157,25 +812,18 @@ void handle_get(http_request message) {
   }
 
   string userid {paths[1]};
-  if (user_map.find(userid) == user_map.end()) {
+  three_tuple_string session {};
+  if ( ! find_session(userid, session)) {
       message.reply(status_codes::Forbidden);
       return;
   }
 
   if (paths[0] == read_friend_list_op) {
-    pair<status_code,value> result {do_request (methods::GET,
-                                                addr +
-                                                read_entity_auth + "/" +
-                                                data_table_name + "/" + 
-                                                get<0>(user_map[userid]) + "/" +
-                                                get<1>(user_map[userid]) + "/" +
-                                                get<2>(user_map[userid]))}; 
-    
+    pair<status_code,string> result {session_friends (session)};
     if (result.first == status_codes::OK) {
-      unordered_map<string, string> data_props {unpack_json_object (result.second)};
       vector<pair<string,value>> json_friends {
                 make_pair(data_table_friends_prop, 
-                          value::string(data_props[data_table_friends_prop]))};
+                          value::string(result.second))};
       
       message.reply(result.first, value::object(json_friends));
     }
@@ -184,6 +832,62 @@ void handle_get(http_request message) {
     }
   }
 
+  /*
+    ReadUpdates/userid[/count]
+
+    Return the user's latest count updates (default_updates_count
+    if omitted, never more than max_updates_count), most recent
+    first, as a JSON array of {"Author", "Status"} objects.
+   */
+  else if (paths[0] == read_updates_op) {
+    if (paths.size() > 3) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+
+    int count {default_updates_count};
+    if (paths.size() == 3) {
+      try {
+        count = std::stoi(paths[2]);
+      }
+      catch (const std::exception& e) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      if (count <= 0) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      count = std::min(count, max_updates_count);
+    }
+
+    /*
+      The user's own timeline holds statuses fanned out on write;
+      those of celebrity friends are merged in from their outboxes.
+     */
+    const string reader {timeline_partition(get<1>(session), get<2>(session))};
+    vector<timeline_t> timelines {};
+    pair<status_code,timeline_t> own {read_timeline (timeline_table_name, reader, count)};
+    if (own.first != status_codes::OK) {
+      message.reply(own.first);
+      return;
+    }
+    timelines.push_back(own.second);
+
+    for (const string& celebrity : celebrities_read_by (reader)) {
+      pair<status_code,timeline_t> outbox {read_timeline (outbox_table_name, celebrity, count)};
+      if (outbox.first == status_codes::OK)
+        timelines.push_back(outbox.second);
+    }
+
+    vector<value> updates {};
+    for (const auto& entry : merge_timelines (timelines, count)) {
+      updates.push_back(build_json_value (timeline_author_prop, entry.author,
+                                          timeline_status_prop, entry.status));
+    }
+    message.reply(status_codes::OK, value::array(updates));
+  }
+
   else {
     message.reply(status_codes::BadRequest);
   }
@@ -217,14 +921,17 @@ void handle_post(http_request message) {
           {make_pair(message_properties.begin()->first, 
                      message_properties.begin()->second)})};
 
+    // AuthServer also checks that the user's DataTable entity exists
     pair<status_code,value> result {do_request (methods::GET,
                                                 auth_addr +
                                                 get_update_data_op + "/" +
-                                                userid,
+                                                userid + "/" +
+                                                check_data_row_opt,
                                                 pwd)}; 
 
     if (result.first == status_codes::OK) {
-      if (user_map.find(userid) == user_map.end()){
+      three_tuple_string existing {};
+      if ( ! find_session(userid, existing)){
         unordered_map<string, string> auth_props {unpack_json_object (result.second)};
         string token {result.second["token"].as_string()};
         
@@ -232,19 +939,20 @@ void handle_post(http_request message) {
         cout << auth_table_partition_prop << ": " << auth_props[auth_table_partition_prop] << endl;
         cout << auth_table_row_prop << ": " << auth_props[auth_table_row_prop] << endl;
 
-        pair<status_code,value> exist_chk {do_request (methods::GET,
-                                                       addr +
-                                                       read_entity_auth + "/" +
-                                                       data_table_name + "/" +
-                                                       token + "/" +
-                                                       auth_props[auth_table_partition_prop] + "/" +
-                                                       auth_props[auth_table_row_prop])};
-
-        if (exist_chk.first == status_codes::OK) {
+        if (result.second.has_field(data_row_exists_prop) && result.second[data_row_exists_prop].as_bool()) {
           three_tuple_string user_map_vals {make_tuple(token, 
                                                        auth_props[auth_table_partition_prop], 
                                                        auth_props[auth_table_row_prop])};
-          user_map[userid] = user_map_vals;
+          // A concurrent SignOn may have won; either way the user is signed on
+          const SessionStore::steady_time_t now {std::chrono::steady_clock::now()};
+          const SessionStore::steady_time_t issued {token_issued(token, now)};
+          std::lock_guard<std::mutex> guard {session_lock(userid)};
+          if (user_map.insert(userid, user_map_vals, issued)) {
+            session_timers.arm(userid, session_deadline(issued, now));
+            refresh_timers.arm(userid, issued + token_refresh_after);
+            // A new session reads the friends list afresh
+            drop_friends (auth_props[auth_table_partition_prop], auth_props[auth_table_row_prop]);
+          }
           //added Does this need to return token as second param?
           message.reply(result.first);
         }
@@ -270,8 +978,16 @@ void handle_post(http_request message) {
       return;
     }
 
-    if (user_map.find(userid) != user_map.end()) {
-      user_map.erase(userid);
+    three_tuple_string session {};
+    SessionStore::steady_time_t issued {};
+    SessionStore::steady_time_t last_active {};
+    std::lock_guard<std::mutex> guard {session_lock(userid)};
+    const bool found {user_map.inspect(userid, session, issued, last_active)};
+    if (user_map.erase(userid)) {
+      session_timers.cancel(userid);
+      refresh_timers.cancel(userid);
+      if (found)
+        drop_friends (get<1>(session), get<2>(session));
       message.reply(status_codes::OK);
     }
 
@@ -299,14 +1015,15 @@ void handle_put(http_request message) {
   }
 
   string userid {paths[1]};
-  if (user_map.find(userid) == user_map.end()) {
+  three_tuple_string session {};
+  if ( ! find_session(userid, session)) {
       message.reply(status_codes::Forbidden);
       return;
   }
 
-  string token {get<0>(user_map[userid])};
-  string data_partition {get<1>(user_map[userid])};
-  string data_row {get<2>(user_map[userid])};
+  string token {get<0>(session)};
+  string data_partition {get<1>(session)};
+  string data_row {get<2>(session)};
 
   if (paths[0] == add_friend_op) {
 	  // Needs four parameters
@@ -315,52 +1032,8 @@ void handle_put(http_request message) {
       return;
     }
 	
-  	// Create string country and name
-  	// Create string new_friend with country and name separated by ';' character
-  	string country {paths[2]}; 
-  	string name {paths[3]};
-  	string new_friend {country + ";" + name};
-  	
-  	// Retrieve friends list and assign it to string friend_list
-  	pair<status_code,value> get_friends {do_request (methods::GET,
-                                                     string(def_url) + "/" + 
-                                                     read_friend_list_op + "/" + 
-                                                     userid)};		
-  	
-    if (get_friends.first != status_codes::OK) {
-      message.reply(get_friends.first);
-      return;
-    }
-
-    unordered_map<string, string> friend_prop {unpack_json_object (get_friends.second)};
-    string friend_list_string {friend_prop[data_table_friends_prop]};
-
-  	// Search for new_friend in friend_list to see if the friend already exists in the user's friendlist
-  	std::size_t found = friend_list_string.find(new_friend);
-  	
-  	// if it does, then return status code OK
-  	if (found != string::npos) {
-    	message.reply(status_codes::OK);
-    	return;
-  	}
-  	else {
-  	  // Otherwise, add the new friend to the user's friends list
-      friends_list_t friend_list_vector {parse_friends_list(friend_list_string)};
-      friend_list_vector.push_back(make_pair(country,name));
-      friend_list_string = friends_list_to_string(friend_list_vector);
-
-      pair<status_code,value> update_result {do_request (methods::PUT,
-                                                         addr +
-                                                         update_entity_auth + "/" +
-                                                         data_table_name + "/" +
-                                                         token + "/" +
-                                                         data_partition + "/" +
-                                                         data_row,
-                                                         value::object (vector<pair<string,value>>
-                                                                        {make_pair(data_table_friends_prop,
-                                                                                   value::string(friend_list_string))}))}; 
-  	  message.reply(update_result.first);
-    }
+    // Add the friend in friend_graph, which writes the list back if it changed
+    message.reply(change_friends (session, make_pair(paths[2], paths[3]), true));
   }
 
   else if (paths[0] == remove_friend_op) {
@@ -370,60 +1043,8 @@ void handle_put(http_request message) {
       return;
     }
   	  
-  	// Create string country and name
-  	// Create string new_friend with country and name separated by ';' character
-  	string country {paths[2]}; 
-  	string name {paths[3]};
-  	string new_friend {country + ";" + name};
-  	  
-  	// Retrieve friends list and assign it to string friend_list
-  	pair<status_code,value> get_friends {do_request (methods::GET,
-                                                     string(def_url) + "/" + 
-                                                     read_friend_list_op + "/" + 
-                                                     userid)};		
-
-    if (get_friends.first != status_codes::OK) {
-      message.reply(get_friends.first);
-      return;
-    }
-
-    unordered_map<string, string> friend_prop {unpack_json_object (get_friends.second)};
-    string friend_list_string {friend_prop[data_table_friends_prop]};
-
-  	
-  	// Search for new_friend in friend_list to see if the friend exists in the user's friendlist
-  	std::size_t found = friend_list_string.find(new_friend);  
-  	  
-  	// if it doesn't, then return status code OK
-  	if (found == string::npos) {
-      message.reply(status_codes::OK);
-  	  return;
-  	}
-
-  	// Otherwise, delete friend
-    else {
-      friends_list_t friend_list_vector {parse_friends_list(friend_list_string)};
-      friends_list_t new_friend_list_vector {};
-      pair<string,string> new_friend_pair {make_pair(country,name)};
-      for (auto user_friend = friend_list_vector.begin(); user_friend != friend_list_vector.end(); ++user_friend) {
-        if (make_pair(user_friend->first, user_friend->second) != new_friend_pair) {
-          new_friend_list_vector.push_back(make_pair(user_friend->first, user_friend->second));
-        }
-      }
-      friend_list_string = friends_list_to_string(new_friend_list_vector);
-
-      pair<status_code,value> update_result {do_request (methods::PUT,
-                                                         addr +
-                                                         update_entity_auth + "/" +
-                                                         data_table_name + "/" +
-                                                         token + "/" +
-                                                         data_partition + "/" +
-                                                         data_row,
-                                                         value::object (vector<pair<string,value>>
-                                                                        {make_pair(data_table_friends_prop,
-                                                                                   value::string(friend_list_string))}))}; 
-      message.reply(update_result.first);
-    }
+    // Remove the friend in friend_graph, which writes the list back if it changed
+    message.reply(change_friends (session, make_pair(paths[2], paths[3]), false));
   }
 
   else if (paths[0] == update_status_op) {
@@ -433,7 +1054,22 @@ void handle_put(http_request message) {
       return;
     }
 
+    /*
+      PushServer finds the author's friends in its follower index,
+      which load_friends() brings up to date on the session's first
+      use of the list. That is done while the status is written, and
+      the push, naming only the author, is sent once both are done.
+     */
     string status {paths[2]};
+    pplx::task<status_code> sync_friends {pplx::create_task([session] () -> status_code {
+          try {
+            return load_friends (session);
+          }
+          catch (const std::exception& e) {
+            cout << "Error: " << e.what() << endl;
+            return status_codes::ServiceUnavailable;
+          }
+        })};
     pair<status_code,value> update_result {do_request (methods::PUT,
                                                 addr +
                                                 update_entity_auth + "/" +
@@ -444,14 +1080,10 @@ void handle_put(http_request message) {
                                                 value::object (vector<pair<string,value>>
                                                           {make_pair(data_table_status_prop,
                                                                      value::string(status))}))};  
+    status_code synced {sync_friends.get()};
     if (update_result.first == status_codes::OK) {
-      pair<status_code,value> get_friends {do_request (methods::GET,
-                                                       string(def_url) + "/" + 
-                                                       read_friend_list_op + "/" + 
-                                                       userid)};
-
-      if (get_friends.first != status_codes::OK) {
-        message.reply(get_friends.first);
+      if (synced != status_codes::OK) {
+        message.reply(synced);
         return;
       }
 
@@ -461,9 +1093,13 @@ void handle_put(http_request message) {
                                                          push_status_op + "/" + 
                                                          data_partition + "/" +
                                                          data_row + "/" + 
-                                                         status,
-                                                         get_friends.second)};
-        message.reply(push_result.first);
+                                                         status)};
+
+        // PushServer acknowledges once the push is queued; to our client that is success
+        if (push_result.first == status_codes::Accepted)
+          message.reply(status_codes::OK);
+        else
+          message.reply(push_result.first);
       }
 
       catch (const std::exception& e) {
@@ -505,9 +1141,32 @@ void handle_delete(http_request message) {
   the call below that hooks in a the appropriate 
   listener.
   
+  Usage: userserver [session_file]
+
+  session_file names the snapshot of signed-on users (default
+  sessions.snap, in the working directory; its journal is beside
+  it). Sessions in it are restored at startup, so users stay
+  signed on across restarts.
+
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
+  string session_file {argc > 1 ? argv[1] : def_session_file};
+  SessionJournal session_journal {session_file};
+  std::chrono::steady_clock::time_point restore_start {std::chrono::steady_clock::now()};
+  std::uint64_t records {user_map.restore(session_journal)};
+  const SessionStore::steady_time_t now {std::chrono::steady_clock::now()};
+  user_map.for_each([now] (const string& userid, const three_tuple_string&, SessionStore::steady_time_t issued) {
+      session_timers.arm(userid, session_deadline(issued, now));
+      refresh_timers.arm(userid, issued + token_refresh_after);
+    });
+  cout << "UserServer: Restored " << user_map.size() << " sessions from " << records
+       << " records in " << std::chrono::duration_cast<std::chrono::milliseconds>(now - restore_start).count()
+       << " ms" << endl;
+
+  session_journal.open();
+  user_map.attach(&session_journal);
+
   cout << "UserServer: Opening listener" << endl;
   http_listener listener {def_url};
   listener.support(methods::GET, &handle_get);
@@ -516,11 +1175,21 @@ int main (int argc, char const * argv[]) {
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
 
+  std::thread expiry {&expire_sessions};
+  std::thread refresh {&refresh_tokens};
+  std::thread snapshot {&snapshot_sessions};
+
   cout << "Enter carriage return to stop UserServer." << endl;
   string line;
   getline(std::cin, line);
 
   // Shut it down
   listener.close().wait();
+  sessions_stopping = true;
+  expiry.join();
+  refresh.join();
+  snapshot.join();
+  user_map.snapshot();
+  user_map.attach(nullptr);
   cout << "UserServer closed" << endl;
 }
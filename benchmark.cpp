@@ -0,0 +1,967 @@
+/*
+  Benchmarks for the server components
+
+  Usage: benchmark [name]
+
+  Runs every benchmark, or only the one called name. Each
+  benchmark runs in-process and prints its own report.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include <was/storage_account.h>
+#include <was/table.h>
+
+#include "ClientUtils.h"
+#include "FriendGraph.h"
+#include "InternTable.h"
+#include "PropertyIndex.h"
+#include "SasSigner.h"
+#include "SessionStore.h"
+#include "TimingWheel.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+/*
+  Return the number of seconds taken by one call of f
+ */
+double time_seconds (const std::function<void ()>& f) {
+  steady_clock::time_point start {steady_clock::now()};
+  f();
+  return duration<double> (steady_clock::now() - start).count();
+}
+
+/*
+  Return a random friend-count generator for a named distribution
+
+  uniform: every user has between 10 and 200 friends
+  zipf: power-law counts (Pareto, alpha 1.2) from 10 up to 100000,
+    so a few users have vastly more friends than the rest
+ */
+std::function<std::size_t (std::mt19937&)> degree_distribution (const string& name) {
+  if (name == "uniform") {
+    return [] (std::mt19937& rng) {
+      return std::uniform_int_distribution<std::size_t> {10, 200} (rng);
+    };
+  }
+  return [] (std::mt19937& rng) {
+    const double u {std::uniform_real_distribution<double> {0.0, 1.0} (rng)};
+    const double degree {10.0 / std::pow(1.0 - u, 1.0 / 1.2)};
+    return static_cast<std::size_t>(std::min(degree, 100000.0));
+  };
+}
+
+/*
+  Hybrid fan-out: write amplification and read cost
+
+  A random friend graph is built for each friend-count distribution,
+  then statuses are posted by random authors and timelines read by
+  random users, under fan-out thresholds as PushServer applies them
+  (an author with more friends than the threshold is fanned out on
+  read).
+
+  Write amplification is the number of timeline rows written per
+  status. Read cost is the number of range reads one ReadUpdates
+  needs (the reader's timeline plus one outbox per celebrity that
+  lists the reader) and the time merge_timelines() takes to combine
+  them.
+ */
+void bench_fanout () {
+  constexpr std::size_t users {20000};
+  constexpr std::size_t statuses {100000};
+  constexpr std::size_t reads {2000};
+  constexpr std::size_t page {20};
+  const vector<std::size_t> thresholds {std::numeric_limits<std::size_t>::max(), 1000, 100};
+
+  cout << "fanout: " << users << " users, " << statuses << " statuses, "
+       << reads << " reads of " << page << " updates" << endl;
+  cout << std::setw(10) << "degrees" << std::setw(12) << "threshold"
+       << std::setw(14) << "writes/status" << std::setw(14) << "reads/read"
+       << std::setw(14) << "max reads" << std::setw(14) << "merge us" << endl;
+
+  for (const string& dist_name : vector<string> {"uniform", "zipf"}) {
+    std::mt19937 rng {276};
+    auto degree_of = degree_distribution (dist_name);
+    std::uniform_int_distribution<std::size_t> any_user {0, users - 1};
+
+    vector<vector<std::size_t>> friends (users);
+    for (auto& list : friends) {
+      list.resize(std::min(degree_of (rng), users - 1));
+      for (auto& f : list)
+        f = any_user (rng);
+    }
+
+    for (std::size_t threshold : thresholds) {
+      // Readers that must merge each celebrity's outbox
+      vector<vector<std::size_t>> celebrities_of (users);
+      for (std::size_t u {0}; u < users; ++u) {
+        if (friends[u].size() > threshold) {
+          for (auto f : friends[u])
+            celebrities_of[f].push_back(u);
+        }
+      }
+
+      std::uint64_t writes {0};
+      for (std::size_t s {0}; s < statuses; ++s) {
+        const std::size_t degree {friends[any_user (rng)].size()};
+        writes += degree > threshold ? 1 : degree;
+      }
+
+      std::uint64_t range_reads {0};
+      std::size_t max_range_reads {0};
+      double merge_seconds {0.0};
+      for (std::size_t r {0}; r < reads; ++r) {
+        const std::size_t reader {any_user (rng)};
+        vector<timeline_t> timelines (1 + celebrities_of[reader].size());
+        std::uint64_t key {0};
+        for (auto& timeline : timelines) {
+          for (std::size_t e {0}; e < page; ++e) {
+            key += 1 + rng() % 1000;
+            timeline.push_back(timeline_entry_t {std::to_string(1000000000000 + key), "author", "status"});
+          }
+          std::sort(timeline.begin(), timeline.end(),
+                    [] (const timeline_entry_t& a, const timeline_entry_t& b) { return a.row < b.row; });
+        }
+        range_reads += timelines.size();
+        max_range_reads = std::max(max_range_reads, timelines.size());
+        merge_seconds += time_seconds ([&timelines] () { merge_timelines (timelines, page); });
+      }
+
+      cout << std::setw(10) << dist_name
+           << std::setw(12) << (threshold == std::numeric_limits<std::size_t>::max() ? string {"never"} : std::to_string(threshold))
+           << std::setw(14) << std::fixed << std::setprecision(1) << static_cast<double>(writes) / statuses
+           << std::setw(14) << std::setprecision(2) << static_cast<double>(range_reads) / reads
+           << std::setw(14) << max_range_reads
+           << std::setw(14) << std::setprecision(2) << 1e6 * merge_seconds / reads << endl;
+    }
+  }
+}
+
+/*
+  Session expiry timing wheel
+
+  Arms one timer per session with a deadline spread over a day of
+  one-second ticks (as UserServer does), re-arms and cancels some,
+  then turns the wheel through the whole day. Reports the cost of
+  arm and cancel, and the mean and worst time of one tick.
+ */
+void bench_timingwheel () {
+  constexpr std::size_t sessions {1000000};
+  constexpr std::size_t day {24 * 60 * 60};
+  constexpr std::size_t expiry_limit {1000};
+  constexpr std::size_t move_limit {10000};
+
+  std::mt19937 rng {276};
+  std::uniform_int_distribution<std::size_t> any_second {1, day};
+  vector<string> keys (sessions);
+  for (std::size_t i {0}; i < sessions; ++i)
+    keys[i] = "user" + std::to_string(i);
+
+  TimingWheel wheel {milliseconds {1000}, expiry_limit, move_limit};
+  const steady_clock::time_point start {steady_clock::now()};
+
+  const double arm_seconds {time_seconds ([&] () {
+    for (const auto& key : keys)
+      wheel.arm(key, start + seconds {any_second (rng)});
+  })};
+  const double rearm_seconds {time_seconds ([&] () {
+    for (std::size_t i {0}; i < sessions; i += 2)
+      wheel.arm(keys[i], start + seconds {any_second (rng)});
+  })};
+  const double cancel_seconds {time_seconds ([&] () {
+    for (std::size_t i {1}; i < sessions; i += 4)
+      wheel.cancel(keys[i]);
+  })};
+
+  std::size_t expired {0};
+  double worst_tick {0.0};
+  const double turn_seconds {time_seconds ([&] () {
+    for (std::size_t t {1}; t <= day + 1 || wheel.size() > 0; ++t) {
+      const double tick {time_seconds ([&] () {
+        expired += wheel.advance(start + seconds {t}).size();
+      })};
+      worst_tick = std::max(worst_tick, tick);
+    }
+  })};
+
+  cout << "timingwheel: " << sessions << " sessions over " << day << " ticks, "
+       << expiry_limit << " expiries and " << move_limit << " moves per tick at most" << endl;
+  cout << std::fixed << std::setprecision(1)
+       << "  arm " << 1e9 * arm_seconds / sessions << " ns"
+       << ", re-arm " << 1e9 * rearm_seconds / (sessions / 2) << " ns"
+       << ", cancel " << 1e9 * cancel_seconds / (sessions / 4) << " ns" << endl;
+  cout << "  " << expired << " expired, tick mean " << std::setprecision(2)
+       << 1e6 * turn_seconds / day << " us, worst " << 1e6 * worst_tick << " us" << endl;
+}
+
+/*
+  Session snapshot and restore
+
+  Fills a SessionStore with signed-on users holding realistic SAS
+  tokens, journals a tenth as many changes after a snapshot, then
+  restores a fresh store from the snapshot and journal, as
+  UserServer does at startup. The files are written to the working
+  directory and removed afterwards.
+ */
+void bench_sessions () {
+  constexpr std::size_t sessions {1000000};
+  const string path {"benchmark_sessions.snap"};
+  const string token {"sv=2015-04-05&tn=DataTable&spk=USA&srk=Franklin%2CAretha"
+                      "&epk=USA&erk=Franklin%2CAretha&se=2016-03-02T00%3A00%3A00Z&sp=ru"
+                      "&sig=Qm9ndXNTaWduYXR1cmVGb3JCZW5jaG1hcmtpbmdPbmx5MDE%3D"};
+
+  double snapshot_seconds {0.0};
+  {
+    SessionJournal journal {path};
+    SessionStore store {};
+    journal.open();
+    store.attach(&journal);
+    for (std::size_t i {0}; i < sessions; ++i)
+      store.insert("user" + std::to_string(i),
+                   SessionStore::session_t {token, "Country" + std::to_string(i % 200),
+                                            "Name" + std::to_string(i)});
+    snapshot_seconds = time_seconds ([&store] () { store.snapshot(); });
+    for (std::size_t i {0}; i < sessions / 10; ++i)
+      store.erase("user" + std::to_string(i));
+    store.attach(nullptr);
+  }
+
+  SessionJournal journal {path};
+  SessionStore store {};
+  std::uint64_t records {0};
+  const double restore_seconds {time_seconds ([&] () { records = store.restore(journal); })};
+
+  cout << "sessions: " << sessions << " sessions" << endl;
+  cout << std::fixed << std::setprecision(1)
+       << "  snapshot " << 1e3 * snapshot_seconds << " ms, restore of "
+       << records << " records to " << store.size() << " sessions "
+       << 1e3 * restore_seconds << " ms" << endl;
+
+  for (const string& suffix : vector<string> {"", ".journal", ".journal.old"})
+    std::remove((path + suffix).c_str());
+}
+
+/*
+  Return the resident set size of this process in bytes
+ */
+std::size_t resident_bytes () {
+  std::ifstream statm {"/proc/self/statm"};
+  std::size_t pages {0};
+  std::size_t resident {0};
+  statm >> pages >> resident;
+  return resident * 4096;
+}
+
+/*
+  Return a SAS token for the entity partition, row of the kind
+  AuthServer issues, with a signature derived from seed
+ */
+string sas_token (const string& partition, const string& row, std::mt19937& seed) {
+  const string base64 {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+  string sig {};
+  for (int i {0}; i < 42; ++i) {
+    const char c {base64[seed() % 64]};
+    sig += c == '+' ? "%2B" : c == '/' ? "%2F" : string(1, c);
+  }
+  // 32 bytes of base64 end in a character with its two low bits clear
+  sig += base64[(seed() % 16) * 4];
+  sig += "%3D";
+  const string expiry {"2016-03-" + std::to_string(10 + seed() % 18) + "T" +
+                       std::to_string(10 + seed() % 14) + "%3A" + std::to_string(10 + seed() % 50) +
+                       "%3A" + std::to_string(10 + seed() % 50) + "Z"};
+  return "sv=2015-04-05&tn=DataTable&spk=" + partition + "&srk=" + row +
+    "&epk=" + partition + "&erk=" + row + "&se=" + expiry + "&sp=ru&sig=" + sig;
+}
+
+/*
+  Session memory
+
+  Resident bytes per session for 1M signed-on users in SessionStore,
+  against the same sessions kept as plain strings in an
+  unordered_map, as UserServer's user_map once did.
+ */
+void bench_sessionmemory () {
+  constexpr std::size_t sessions {1000000};
+  using plain_map_t = std::unordered_map<string,std::tuple<string,string,string>>;
+
+  auto make_session = [] (std::size_t i, std::mt19937& seed) {
+    const string partition {"Country" + std::to_string(i % 200)};
+    const string row {"Name" + std::to_string(i)};
+    return SessionStore::session_t {sas_token(partition, row, seed), partition, row};
+  };
+
+  // Both are kept until the end, so neither reuses memory freed by the other
+  std::mt19937 seed {7};
+  std::size_t before {resident_bytes()};
+  SessionStore store {};
+  for (std::size_t i {0}; i < sessions; ++i)
+    store.insert("user" + std::to_string(i), make_session(i, seed));
+  const std::size_t store_bytes {resident_bytes() - before};
+
+  std::mt19937 plain_seed {7};
+  before = resident_bytes();
+  plain_map_t plain {};
+  for (std::size_t i {0}; i < sessions; ++i)
+    plain.emplace("user" + std::to_string(i), make_session(i, plain_seed));
+  const std::size_t plain_bytes {resident_bytes() - before};
+
+  // Every session must read back exactly as inserted
+  std::mt19937 check_seed {7};
+  SessionStore::session_t found {};
+  std::size_t mismatches {0};
+  for (std::size_t i {0}; i < sessions; ++i) {
+    if ( ! store.find("user" + std::to_string(i), found) || found != make_session(i, check_seed))
+      ++mismatches;
+  }
+
+  cout << "sessionmemory: " << sessions << " sessions, token "
+       << std::get<0>(found).size() << " bytes, " << mismatches << " mismatches" << endl;
+  cout << std::fixed << std::setprecision(1)
+       << "  unordered_map of strings " << double(plain_bytes) / sessions << " bytes/session" << endl
+       << "  SessionStore " << double(store_bytes) / sessions << " bytes/session" << endl;
+}
+
+/*
+  Token signing
+
+  Time to sign a read/update token for one entity with SasSigner,
+  on one thread and on four at once, against the storage library's
+  get_shared_access_signature(), after checking that the two agree.
+ */
+void bench_sassign () {
+  using azure::storage::table_shared_access_policy;
+
+  constexpr int tokens {200000};
+  constexpr int threads {4};
+  const azure::storage::storage_credentials credentials {"cmpt276bench",
+                                                         "YmVuY2htYXJrIGtleSBub3QgdXNlZCBmb3IgYW55dGhpbmcgZWxzZQ=="};
+  const azure::storage::cloud_table_client client {
+    azure::storage::storage_uri {web::http::uri {"https://cmpt276bench.table.core.windows.net"}}, credentials};
+  const azure::storage::cloud_table table {client.get_table_reference("DataTable")};
+  SasSigner signer {credentials.account_name(), credentials.account_key()};
+
+  // utility::datetime counts 100 ns ticks from 1601
+  const std::time_t expiry {std::time(nullptr) + 24 * 60 * 60};
+  const table_shared_access_policy policy {
+    utility::datetime {} + (static_cast<std::uint64_t>(expiry) + 11644473600ULL) * 10000000ULL,
+    table_shared_access_policy::permissions::read | table_shared_access_policy::permissions::update};
+  const string permissions {policy.permissions_to_string()};
+
+  vector<string> rows {};
+  for (int i {0}; i < 1000; ++i)
+    rows.push_back("Name," + std::to_string(i));
+  std::size_t mismatches {0};
+  for (const string& row : rows) {
+    if (signer.table_token("DataTable", "USA", row, permissions, expiry) !=
+        table.get_shared_access_signature(policy, string(), "USA", row, "USA", row))
+      ++mismatches;
+  }
+
+  std::size_t sink {0};
+  const double library_seconds {time_seconds ([&] () {
+        for (int i {0}; i < tokens; ++i) {
+          const string& row {rows[i % rows.size()]};
+          sink += table.get_shared_access_signature(policy, string(), "USA", row, "USA", row).size();
+        }
+      })};
+  const double native_seconds {time_seconds ([&] () {
+        for (int i {0}; i < tokens; ++i)
+          sink += signer.table_token("DataTable", "USA", rows[i % rows.size()], permissions, expiry).size();
+      })};
+  const double parallel_seconds {time_seconds ([&] () {
+        vector<std::size_t> sinks (threads, 0);
+        vector<std::thread> workers {};
+        for (int t {0}; t < threads; ++t) {
+          workers.emplace_back([&signer, &rows, &permissions, &sinks, expiry, t] () {
+              for (int i {0}; i < tokens; ++i)
+                sinks[t] += signer.table_token("DataTable", "USA", rows[i % rows.size()], permissions, expiry).size();
+            });
+        }
+        for (auto& w : workers)
+          w.join();
+        for (std::size_t s : sinks)
+          sink += s;
+      })};
+
+  cout << "sassign: " << tokens << " tokens, " << mismatches << " mismatches of "
+       << rows.size() << " checked (" << sink << " bytes)" << endl;
+  cout << std::fixed << std::setprecision(2)
+       << "  library " << 1e6 * library_seconds / tokens << " us/token" << endl
+       << "  SasSigner " << 1e6 * native_seconds / tokens << " us/token, "
+       << 1e6 * parallel_seconds / (tokens * threads) << " us/token over " << threads << " threads" << endl;
+}
+
+/*
+  Friends-list loopback
+
+  Per-operation cost of the HTTP hop AddFriend, UnFriend and
+  UpdateStatus once made to UserServer's own ReadFriendList: a GET to
+  a local listener that replies with a friends list, and the parse
+  of its reply, against building the same reply in-process as
+  read_friend_list() now does. The BasicServer read both share is
+  left out.
+ */
+void bench_loopback () {
+  using web::http::http_request;
+  using web::http::methods;
+  using web::http::status_codes;
+  using web::json::value;
+
+  constexpr int operations {2000};
+  const string url {"http://localhost:34599"};
+  std::mt19937 rng {11};
+  friends_list_t friends {};
+  for (int i {0}; i < 50; ++i)
+    friends.push_back(make_pair("Country" + std::to_string(rng() % 200), "Name" + std::to_string(rng())));
+  const string friends_string {friends_list_to_string (friends)};
+  auto reply_body = [&friends_string] () {
+    return value::object(vector<pair<string,value>> {make_pair("Friends", value::string(friends_string))});
+  };
+
+  web::http::experimental::listener::http_listener listener {url};
+  listener.support(methods::GET, [&reply_body] (http_request message) {
+      message.reply(status_codes::OK, reply_body());
+    });
+  listener.open().wait();
+
+  std::size_t sink {0};
+  do_request (methods::GET, url + "/ReadFriendList/user");  // Connect before timing
+  const double loopback_seconds {time_seconds ([&] () {
+        for (int i {0}; i < operations; ++i)
+          sink += get_json_object_prop (do_request (methods::GET, url + "/ReadFriendList/user").second, "Friends").size();
+      })};
+  const double direct_seconds {time_seconds ([&] () {
+        for (int i {0}; i < operations; ++i)
+          sink += get_json_object_prop (reply_body(), "Friends").size();
+      })};
+  listener.close().wait();
+
+  cout << "loopback: " << operations << " friends-list reads of " << friends_string.size()
+       << " bytes (" << sink << ")" << endl;
+  cout << std::fixed << std::setprecision(1)
+       << "  HTTP to self " << 1e6 * loopback_seconds / operations << " us/op" << endl
+       << "  in-process " << 1e6 * direct_seconds / operations << " us/op" << endl;
+}
+
+/*
+  Sign-on throughput
+
+  SignOn as UserServer made it before and after AuthServer learned to
+  check the data row: GetUpdateData and then a ReadEntityAuth of the
+  user's entity, against a single GetUpdateData/userid/CheckDataRow.
+  Local listeners stand in for AuthServer and BasicServer and reply
+  at once, so the difference is the HTTP hop saved; the storage read
+  of the entity happens in both, from BasicServer or from AuthServer.
+ */
+void bench_signon () {
+  using web::http::http_request;
+  using web::http::methods;
+  using web::http::status_codes;
+  using web::json::value;
+
+  constexpr int clients {8};
+  constexpr int signons {500};
+  const string auth_url {"http://localhost:34597"};
+  const string basic_url {"http://localhost:34598"};
+
+  web::http::experimental::listener::http_listener auth {auth_url};
+  auth.support(methods::GET, [] (http_request message) {
+      vector<pair<string,value>> reply {make_pair("token", value::string("sv=2015-04-05&sig=x")),
+                                        make_pair("DataPartition", value::string("USA")),
+                                        make_pair("DataRow", value::string("Franklin,Aretha"))};
+      if (message.relative_uri().path().find("CheckDataRow") != string::npos)
+        reply.push_back(make_pair("DataRowExists", value::boolean(true)));
+      message.reply(status_codes::OK, value::object(reply));
+    });
+  web::http::experimental::listener::http_listener basic {basic_url};
+  basic.support(methods::GET, [] (http_request message) {
+      message.reply(status_codes::OK, build_json_value ("Friends", ""));
+    });
+  auth.open().wait();
+  basic.open().wait();
+
+  const value password {build_json_value ("Password", "user")};
+  auto two_hops = [&] () {
+    req_res_t data {do_request (methods::GET, auth_url + "/GetUpdateData/user", password)};
+    req_res_t entity {do_request (methods::GET, basic_url + "/ReadEntityAuth/DataTable/" +
+                                  get_json_object_prop (data.second, "token") + "/" +
+                                  get_json_object_prop (data.second, "DataPartition") + "/" +
+                                  get_json_object_prop (data.second, "DataRow"))};
+    return entity.first == status_codes::OK;
+  };
+  auto one_hop = [&] () {
+    req_res_t data {do_request (methods::GET, auth_url + "/GetUpdateData/user/CheckDataRow", password)};
+    return data.first == status_codes::OK && get_json_object_prop (data.second, "DataRowExists") == "true";
+  };
+
+  auto throughput = [] (const std::function<bool ()>& signon, std::size_t& failures) {
+    vector<std::size_t> failed (clients, 0);
+    const double seconds {time_seconds ([&] () {
+          vector<std::thread> workers {};
+          for (int c {0}; c < clients; ++c) {
+            workers.emplace_back([&signon, &failed, c] () {
+                for (int i {0}; i < signons; ++i)
+                  failed[c] += signon() ? 0 : 1;
+              });
+          }
+          for (auto& w : workers)
+            w.join();
+        })};
+    for (std::size_t f : failed)
+      failures += f;
+    return clients * signons / seconds;
+  };
+
+  std::size_t failures {0};
+  two_hops();  // Connect before timing
+  one_hop();
+  const double before {throughput(two_hops, failures)};
+  const double after {throughput(one_hop, failures)};
+  auth.close().wait();
+  basic.close().wait();
+
+  cout << "signon: " << clients << " clients x " << signons << " sign-ons, "
+       << failures << " failures" << endl;
+  cout << std::fixed << std::setprecision(0)
+       << "  GetUpdateData + ReadEntityAuth " << before << " sign-ons/s" << endl
+       << "  GetUpdateData/CheckDataRow " << after << " sign-ons/s" << endl;
+}
+
+/*
+  Friend graph
+
+  Time of one AddFriend and one UnFriend of a user with a given
+  number of friends: FriendGraph's change() against UserServer's
+  former handling of the Friends string (a substring search, then a
+  parse, an edit and a rebuild of the string). The friend is looked
+  up in the intern table, as UserServer does with the name in the
+  request. The write back to storage, which both need, is left out:
+  change() is given one that does nothing.
+ */
+void bench_friendgraph () {
+  constexpr int operations {2000};
+  std::mt19937 rng {13};
+
+  cout << "friendgraph: " << operations << " add/remove pairs per degree" << endl;
+  for (std::size_t degree : vector<std::size_t> {10, 100, 1000, 10000}) {
+    friends_list_t friends {};
+    for (std::size_t i {0}; i < degree; ++i)
+      friends.push_back(make_pair("Country" + std::to_string(rng() % 200), "Name" + std::to_string(rng())));
+    vector<pair<string,string>> others {};
+    for (int i {0}; i < operations; ++i)
+      others.push_back(make_pair("Country" + std::to_string(rng() % 200), "Other" + std::to_string(rng())));
+
+    InternTable ids {};
+    FriendGraph graph {ids};
+    const InternTable::id_t owner {ids.intern("Country", "Owner")};
+    const FriendGraph::write_t write {[] () { return true; }};
+    graph.load(owner, friends, write);
+    const double graph_seconds {time_seconds ([&] () {
+          for (const auto& f : others) {
+            const InternTable::id_t id {ids.intern(f.first, f.second)};
+            graph.change(owner, id, true, write);
+            graph.change(owner, id, false, write);
+          }
+        })};
+
+    string stored {friends_list_to_string (friends)};
+    const double string_seconds {time_seconds ([&] () {
+          for (const auto& f : others) {
+            const string key {f.first + ";" + f.second};
+            if (stored.find(key) == string::npos) {
+              friends_list_t list {parse_friends_list (stored)};
+              list.push_back(f);
+              stored = friends_list_to_string (list);
+            }
+            if (stored.find(key) != string::npos) {
+              friends_list_t list {parse_friends_list (stored)};
+              list.erase(std::remove(list.begin(), list.end(), f), list.end());
+              stored = friends_list_to_string (list);
+            }
+          }
+        })};
+
+    cout << std::fixed << std::setprecision(2)
+         << "  " << degree << " friends: FriendGraph " << 1e6 * graph_seconds / operations
+         << " us, Friends string " << 1e6 * string_seconds / operations << " us per pair"
+         << " (" << graph.metrics().writes << " writes)" << endl;
+  }
+}
+
+/*
+  Intern table
+
+  Cost of naming users by id rather than by "country;name": a
+  membership test in a set of 1000 users, keyed by string and by id,
+  and the lookup of a known user's id, which turns a string into an
+  id at the API boundary, on one thread and on several at once.
+ */
+void bench_intern () {
+  constexpr int lookups {1000000};
+  constexpr int threads {4};
+  std::mt19937 rng {17};
+
+  InternTable ids {};
+  vector<string> keys {};
+  for (int i {0}; i < 100000; ++i)
+    keys.push_back(InternTable::key_of("Country" + std::to_string(rng() % 200), "Name," + std::to_string(rng())));
+  for (const string& key : keys)
+    ids.intern(key);
+
+  std::unordered_set<string> key_set {};
+  std::unordered_set<InternTable::id_t> id_set {};
+  for (std::size_t i {0}; i < 1000; ++i) {
+    key_set.insert(keys[i * 7]);
+    id_set.insert(ids.intern(keys[i * 7]));
+  }
+  vector<InternTable::id_t> probe_ids {};
+  for (const string& key : keys)
+    probe_ids.push_back(ids.intern(key));
+
+  std::size_t sink {0};
+  const double key_set_seconds {time_seconds ([&] () {
+        for (int i {0}; i < lookups; ++i)
+          sink += key_set.count(keys[i % keys.size()]);
+      })};
+  const double id_set_seconds {time_seconds ([&] () {
+        for (int i {0}; i < lookups; ++i)
+          sink += id_set.count(probe_ids[i % probe_ids.size()]);
+      })};
+  const double intern_seconds {time_seconds ([&] () {
+        for (int i {0}; i < lookups; ++i)
+          sink += ids.intern(keys[i % keys.size()]);
+      })};
+  const double parallel_seconds {time_seconds ([&] () {
+        vector<std::size_t> sinks (threads, 0);
+        vector<std::thread> workers {};
+        for (int t {0}; t < threads; ++t) {
+          workers.emplace_back([&ids, &keys, &sinks, t] () {
+              for (int i {0}; i < lookups; ++i)
+                sinks[t] += ids.intern(keys[(i + t * 7919) % keys.size()]);
+            });
+        }
+        for (auto& w : workers)
+          w.join();
+        for (std::size_t s : sinks)
+          sink += s;
+      })};
+
+  cout << "intern: " << ids.size() << " users, " << lookups << " lookups (" << sink << ")" << endl;
+  cout << std::fixed << std::setprecision(1)
+       << "  set of 1000 by string " << 1e9 * key_set_seconds / lookups << " ns, by id "
+       << 1e9 * id_set_seconds / lookups << " ns per test" << endl
+       << "  intern known user " << 1e9 * intern_seconds / lookups << " ns, "
+       << 1e9 * parallel_seconds / (lookups * threads) << " ns over " << threads << " threads" << endl;
+}
+
+/*
+  Friends-list parsing
+
+  The parser ClientUtils had before its scans were vectorized: two
+  string::find calls and two substr copies per friend
+ */
+static friends_list_t find_parse_friends_list (const string& friends_list) {
+  friends_list_t res {};
+  string::size_type start {0};
+  if (friends_list[start] == pair_separator)
+    start++;
+  for (string::size_type delim {friends_list.find(pair_delimiter, start)};
+       delim != string::npos;
+       delim = friends_list.find(pair_delimiter, start)) {
+    string::size_type end {friends_list.find(pair_separator, start)};
+    if (end == string::npos)
+      end = friends_list.size();
+    if (end <= delim + 1)
+      throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+    res.push_back(make_pair(friends_list.substr(start, delim - start), friends_list.substr(delim + 1, end - delim - 1)));
+    start = end + 1;
+  }
+  return res;
+}
+
+/*
+  Time to parse a friends list of a given length with the old
+  parser, parse_friends_list() into strings, and parse_friends_list()
+  into views in a reused vector, after checking on random strings
+  that the new parsers accept and reject what the old one did
+ */
+void bench_parsefriends () {
+  std::mt19937 rng {19};
+
+  std::size_t mismatches {0};
+  const string alphabet {"ab;|;|xyz"};
+  friends_view_t views {};
+  for (int i {0}; i < 100000; ++i) {
+    string s {};
+    for (std::size_t n {rng() % 40}; n > 0; --n)
+      s.push_back(alphabet[rng() % alphabet.size()]);
+    string old_error {};
+    string new_error {};
+    friends_list_t old_list {};
+    friends_list_t new_list {};
+    try {
+      old_list = find_parse_friends_list(s);
+    }
+    catch (const std::invalid_argument& e) {
+      old_error = e.what();
+    }
+    try {
+      new_list = parse_friends_list(s);
+    }
+    catch (const std::invalid_argument& e) {
+      new_error = e.what();
+    }
+    bool views_match {true};
+    try {
+      parse_friends_list(s, views);
+      views_match = views.size() == new_list.size();
+      for (std::size_t v {0}; views_match && v < views.size(); ++v)
+        views_match = views[v].first == new_list[v].first && views[v].second == new_list[v].second;
+    }
+    catch (const std::invalid_argument& e) {
+      views_match = ! new_error.empty();
+    }
+    if (old_list != new_list || old_error != new_error || ! views_match)
+      ++mismatches;
+  }
+  cout << "parsefriends: " << mismatches << " mismatches in 100000 random lists" << endl;
+
+  for (std::size_t degree : vector<std::size_t> {10, 100, 1000, 10000}) {
+    friends_list_t friends {};
+    for (std::size_t i {0}; i < degree; ++i)
+      friends.push_back(make_pair("Country" + std::to_string(rng() % 200), "Surname,Name" + std::to_string(rng())));
+    const string list {friends_list_to_string (friends)};
+    const int repeats {static_cast<int>(2000000 / degree)};
+
+    std::size_t sink {0};
+    const double find_seconds {time_seconds ([&] () {
+          for (int i {0}; i < repeats; ++i)
+            sink += find_parse_friends_list(list).size();
+        })};
+    const double strings_seconds {time_seconds ([&] () {
+          for (int i {0}; i < repeats; ++i)
+            sink += parse_friends_list(list).size();
+        })};
+    const double views_seconds {time_seconds ([&] () {
+          for (int i {0}; i < repeats; ++i) {
+            parse_friends_list(list, views);
+            sink += views.size();
+          }
+        })};
+
+    const double per_friend {1e9 / (static_cast<double>(repeats) * degree)};
+    cout << std::fixed << std::setprecision(1)
+         << "  " << degree << " friends (" << list.size() << " bytes, " << sink << "): find "
+         << per_friend * find_seconds << " ns, strings " << per_friend * strings_seconds
+         << " ns, views " << per_friend * views_seconds << " ns per friend" << endl;
+  }
+}
+
+/*
+  Friend membership
+
+  Membership tests against a 10000-friend list, as AddFriend makes
+  them: the substring search UserServer once used on the Friends
+  string, and an intern-table lookup plus FriendGraph's change(),
+  which writes only for a friend not yet listed. Probes are a third
+  friends, a third near misses whose key is a prefix of a friend's
+  ("USA;Ann" for "USA;Anna"), and a third strangers; a near miss
+  found by the search is a wrong answer. The write stands in for
+  storage, and a friend it adds is removed again, so the list stays
+  as loaded.
+ */
+void bench_membership () {
+  constexpr std::size_t degree {10000};
+  constexpr int probes {300000};
+  std::mt19937 rng {23};
+
+  InternTable ids {};
+  FriendGraph graph {ids};
+  friends_list_t friends {};
+  for (std::size_t i {0}; i < degree; ++i)
+    friends.push_back(make_pair("Country" + std::to_string(rng() % 200), "Surname,Name" + std::to_string(rng())));
+  const InternTable::id_t owner {ids.intern("Country", "Owner")};
+  graph.load(owner, friends, [] () { return true; });
+  const string stored {friends_list_to_string (friends)};
+
+  vector<pair<string,bool>> keys {};    // (key, is a friend)
+  for (int i {0}; i < probes; ++i) {
+    const auto& f (friends[rng() % degree]);
+    if (i % 3 == 0)
+      keys.push_back(make_pair(InternTable::key_of(f.first, f.second), true));
+    else if (i % 3 == 1)
+      keys.push_back(make_pair(InternTable::key_of(f.first, f.second.substr(0, f.second.size() - 1)), false));
+    else
+      keys.push_back(make_pair(InternTable::key_of(f.first, "Stranger" + std::to_string(rng())), false));
+  }
+
+  std::size_t search_wrong {0};
+  const double search_seconds {time_seconds ([&] () {
+        for (const auto& k : keys) {
+          if ((stored.find(k.first) != string::npos) != k.second)
+            ++search_wrong;
+        }
+      })};
+  std::size_t graph_wrong {0};
+  bool written {false};
+  const FriendGraph::write_t write {[&written] () { written = true; return true; }};
+  const double graph_seconds {time_seconds ([&] () {
+        for (const auto& k : keys) {
+          InternTable::id_t id {0};
+          written = false;
+          const bool known {ids.find(k.first, id)};
+          if (known && graph.change(owner, id, true, write) == FriendGraph::update_t::changed)
+            graph.change(owner, id, false, write);
+          if ((known && ! written) != k.second)
+            ++graph_wrong;
+        }
+      })};
+
+  cout << "membership: " << probes << " tests against " << degree << " friends ("
+       << stored.size() << " bytes)" << endl;
+  cout << std::fixed << std::setprecision(2)
+       << "  substring search " << 1e6 * search_seconds / probes << " us, " << search_wrong << " wrong" << endl
+       << "  FriendGraph " << 1e6 * graph_seconds / probes << " us, " << graph_wrong << " wrong" << endl;
+}
+
+/*
+  Property index
+
+  GET by properties on a table of a million entities: BasicServer's
+  former scan, which copied each entity's properties and looked up
+  every requested name, against PropertyIndex's intersection of
+  posting lists. Both run over entities held in memory, so the cost
+  of reading them from storage, which only the scan pays, is left
+  out. Every entity has "Name"; "Home", "Song", "Friends" and "Rare"
+  are given to a half, a tenth, a hundredth and a ten-thousandth.
+ */
+void bench_propertyindex () {
+  using azure::storage::entity_property;
+  using azure::storage::table_entity;
+
+  constexpr std::size_t entity_count {1000000};
+  std::mt19937 rng {29};
+  const vector<pair<string,std::uint32_t>> rarity {
+    make_pair("Home", 2u), make_pair("Song", 10u), make_pair("Friends", 100u), make_pair("Rare", 10000u)};
+
+  vector<table_entity> entities {};
+  entities.reserve(entity_count);
+  for (std::size_t i {0}; i < entity_count; ++i) {
+    table_entity entity {"Country" + std::to_string(i % 200), "Surname,Name" + std::to_string(i)};
+    table_entity::properties_type& properties = entity.properties();
+    properties["Name"] = entity_property {string {"value"}};
+    for (const auto& r : rarity) {
+      if (rng() % r.second == 0)
+        properties[r.first] = entity_property {string {"value"}};
+    }
+    entities.push_back(entity);
+  }
+
+  PropertyIndex index {};
+  index.start("Bench");
+  const double build_seconds {time_seconds ([&] () {
+        for (const auto& e : entities) {
+          PropertyIndex::names_t names {};
+          for (const auto& p : e.properties())
+            names.push_back(p.first);
+          index.add("Bench", e.partition_key(), e.row_key(), names);
+        }
+      })};
+  index.finish("Bench");
+  const PropertyIndex::metrics_t m {index.metrics()};
+  cout << "propertyindex: " << entity_count << " entities, " << m.postings << " postings, built in "
+       << std::fixed << std::setprecision(2) << build_seconds << " s" << endl;
+
+  for (const auto& names : vector<PropertyIndex::names_t> {{"Rare"},
+                                                           {"Friends", "Song"},
+                                                           {"Song", "Home"},
+                                                           {"Home"}}) {
+    std::size_t scan_found {0};
+    const double scan_seconds {time_seconds ([&] () {
+          for (const auto& e : entities) {
+            table_entity::properties_type properties = e.properties();
+            bool contains_property {true};
+            for (const auto& name : names) {
+              if (properties.find(name) == properties.end())
+                contains_property = false;
+            }
+            if (contains_property)
+              ++scan_found;
+          }
+        })};
+    vector<PropertyIndex::key_t> keys {};
+    const double index_seconds {time_seconds ([&] () { index.find("Bench", names, keys); })};
+
+    string query {};
+    for (const auto& name : names)
+      query += (query.empty() ? "" : ",") + name;
+    cout << "  " << std::setw(13) << query << ": " << std::setw(6) << keys.size() << " found"
+         << (keys.size() == scan_found ? "" : " (scan disagrees)") << std::fixed << std::setprecision(3)
+         << ", scan " << 1e3 * scan_seconds << " ms, index " << 1e3 * index_seconds << " ms" << endl;
+  }
+}
+
+/*
+  Run every benchmark, or the one named on the command line
+ */
+int main (int argc, const char* argv[]) {
+  const vector<pair<string,std::function<void ()>>> benchmarks {
+    make_pair("fanout", &bench_fanout),
+    make_pair("timingwheel", &bench_timingwheel),
+    make_pair("sessions", &bench_sessions),
+    make_pair("sessionmemory", &bench_sessionmemory),
+    make_pair("sassign", &bench_sassign),
+    make_pair("loopback", &bench_loopback),
+    make_pair("signon", &bench_signon),
+    make_pair("friendgraph", &bench_friendgraph),
+    make_pair("intern", &bench_intern),
+    make_pair("parsefriends", &bench_parsefriends),
+    make_pair("membership", &bench_membership),
+    make_pair("propertyindex", &bench_propertyindex)
+  };
+
+  bool ran {false};
+  for (const auto& b : benchmarks) {
+    if (argc < 2 || b.first == argv[1]) {
+      b.second();
+      ran = true;
+    }
+  }
+  if ( ! ran) {
+    cerr << "Usage: benchmark [name]" << endl;
+    return 1;
+  }
+}
@@ -3,12 +3,26 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
@@ -16,10 +30,26 @@
 
 #include <UnitTest++/UnitTest++.h>
 
+#include <was/storage_account.h>
+#include <was/table.h>
+
+#include "FollowerIndex.h"
+#include "FriendGraph.h"
+#include "InternTable.h"
+#include "PasswordVerifier.h"
+#include "PropertyIndex.h"
+#include "PushQueue.h"
+#include "SasSigner.h"
+#include "SessionCodec.h"
+#include "SessionJournal.h"
+#include "TimingWheel.h"
+
 using std::cerr;
 using std::cout;
 using std::endl;
+using std::get;
 using std::make_pair;
+using std::make_tuple;
 using std::pair;
 using std::string;
 using std::vector;
@@ -47,9 +77,15 @@ const string delete_entity_admin {"DeleteEntityAdmin"};
 
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
+const string list_add_auth {"ListAddAuth"};
+const string list_remove_auth {"ListRemoveAuth"};
 
 const string get_read_token_op  {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
+const string refresh_update_tokens_op {"RefreshUpdateTokens"};
+const string get_update_data_op {"GetUpdateData"};
+const string get_update_data_batch_op {"GetUpdateDataBatch"};
+const string auth_cache_metrics_op {"AuthCacheMetrics"};
 
 // The two optional operations from Assignment 1
 const string add_property_admin {"AddPropertyAdmin"};
@@ -62,6 +98,11 @@ const string remove_friend_op {"UnFriend"};
 const string read_friend_list_op {"ReadFriendList"};
 const string update_status_op {"UpdateStatus"};
 const string push_status_op {"PushStatus"};
+const string read_updates_op {"ReadUpdates"};
+
+const string read_range_admin {"ReadRangeAdmin"};
+
+const string push_metrics_op {"PushMetrics"};
 
 /*
   Make an HTTP request, returning the status code and any JSON value in the body
@@ -365,6 +406,67 @@ pair<status_code,string> get_read_token(const string& addr,  const string& useri
   }
 }
 
+/*
+  Utility to read the statuses in a user's timeline, most recent first
+
+  addr: Prefix of the URI (protocol, address, and port)
+  table: Timeline table
+  partition: Timeline partition of the user ("country;name")
+  count: Maximum number of entries to read
+ */
+vector<string> read_timeline (const string& addr, const string& table, const string& partition, int count = 100) {
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr + read_range_admin + "/" + table + "/" + partition + "/" + std::to_string(count))};
+  vector<string> statuses {};
+  if (result.first != status_codes::OK || ! result.second.is_array())
+    return statuses;
+  for (const auto& row : result.second.as_array()) {
+    statuses.push_back (row.as_object().at("Status").as_string());
+  }
+  return statuses;
+}
+
+/*
+  Utility to read a user's timeline once it holds at least count entries
+
+  PushServer delivers statuses asynchronously, so a test must wait
+  for the deliveries it expects. Gives up after about ten seconds
+  and returns whatever the timeline then holds.
+ */
+vector<string> await_timeline (const string& addr, const string& table, const string& partition, vector<string>::size_type count) {
+  vector<string> statuses {read_timeline (addr, table, partition)};
+  for (int tries {0}; statuses.size() < count && tries < 100; ++tries) {
+    std::this_thread::sleep_for (std::chrono::milliseconds(100));
+    statuses = read_timeline (addr, table, partition);
+  }
+  return statuses;
+}
+
+/*
+  Utility to delete every entry in a user's timeline
+
+  addr: Prefix of the URI (protocol, address, and port)
+  table: Timeline table
+  partition: Timeline partition of the user ("country;name")
+
+  Stops at the first delete that fails, so a timeline that cannot be
+  cleared is left as it is rather than read forever.
+ */
+void clear_timeline (const string& addr, const string& table, const string& partition) {
+  for (;;) {
+    pair<status_code,value> result {do_request (methods::GET,
+                                                addr + read_range_admin + "/" + table + "/" + partition + "/100")};
+    if (result.first != status_codes::OK || ! result.second.is_array() || result.second.as_array().size() == 0)
+      return;
+    for (const auto& row : result.second.as_array()) {
+      if (delete_entity (addr, table, partition, row.as_object().at("Row").as_string()) != status_codes::OK) {
+        cerr << "Could not clear timeline " << partition << endl;
+        return;
+      }
+    }
+  }
+}
+
 /*
   A sample fixture that ensures TestTable exists, and
   at least has the entity Franklin,Aretha/USA
@@ -814,6 +916,43 @@ TEST_FIXTURE(GetFixture, GetByPartition_MissingPartition) {
     
     CHECK_EQUAL(status_codes::BadRequest, result.first);
   }
+
+  /*
+    A test that GET by properties sees entities written and deleted
+    after the table was first queried, and so indexed
+   */
+  TEST_FIXTURE(GetFixture, GetByProp_AfterWrites) {
+    auto count_with = [] (const vector<string>& props) {
+      vector<pair<string,value>> body {};
+      for (const auto& p : props)
+        body.push_back(make_pair(p, value::string("*")));
+      pair<status_code,value> result {
+        do_request (methods::GET,
+        string(GetFixture::addr)
+        + read_entity_admin + "/"
+        + string(GetFixture::table),
+        value::object (body))};
+      CHECK_EQUAL(status_codes::OK, result.first);
+      return result.second.is_array() ? result.second.as_array().size() : 0;
+    };
+
+    CHECK_EQUAL(0, count_with({"Indexed"}));
+
+    CHECK_EQUAL(status_codes::OK, put_entity (GetFixture::addr, GetFixture::table, "Katherines,The", "Canada", "Indexed", "1"));
+    CHECK_EQUAL(1, count_with({"Indexed"}));
+
+    CHECK_EQUAL(status_codes::OK, put_entity (GetFixture::addr, GetFixture::table, "Bennett,Chancelor", "USA", "Indexed", "2"));
+    CHECK_EQUAL(status_codes::OK, put_entity (GetFixture::addr, GetFixture::table, "Bennett,Chancelor", "USA", "Also", "3"));
+    CHECK_EQUAL(2, count_with({"Indexed"}));
+    CHECK_EQUAL(1, count_with({"Indexed", "Also"}));
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (GetFixture::addr, GetFixture::table, "Bennett,Chancelor", "USA"));
+    CHECK_EQUAL(1, count_with({"Indexed"}));
+    CHECK_EQUAL(0, count_with({"Indexed", "Also"}));
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (GetFixture::addr, GetFixture::table, "Katherines,The", "Canada"));
+    CHECK_EQUAL(0, count_with({"Indexed"}));
+  }
 }
 
 /*
@@ -1094,6 +1233,102 @@ SUITE(GET_AUTH) {
 	}
 	
 	
+/*
+  Test that a password stored as a salted hash is checked against
+  the hash, as the fixture's plaintext password is against itself
+ */
+
+	TEST_FIXTURE(AuthFixture,  GetAuth_HashedPassword) {
+	int hash_result {put_entity (AuthFixture::addr,
+				     AuthFixture::auth_table,
+				     AuthFixture::auth_table_partition,
+				     AuthFixture::userid,
+				     AuthFixture::auth_pwd_prop,
+				     PasswordVerifier::hash(AuthFixture::user_pwd))};
+	CHECK_EQUAL (status_codes::OK, hash_result);
+
+	pair<status_code,string> token_res {
+	  get_read_token(AuthFixture::auth_addr,
+			 AuthFixture::userid,
+			 AuthFixture::user_pwd)};
+	CHECK_EQUAL (status_codes::OK, token_res.first);
+
+	pair<status_code,string> wrong_res {
+	  get_read_token(AuthFixture::auth_addr,
+			 AuthFixture::userid,
+			 "WrongPassword")};
+	CHECK_EQUAL (status_codes::NotFound, wrong_res.first);
+
+	// The fixture expects the plaintext password
+	CHECK_EQUAL (status_codes::OK, put_entity (AuthFixture::addr,
+						   AuthFixture::auth_table,
+						   AuthFixture::auth_table_partition,
+						   AuthFixture::userid,
+						   AuthFixture::auth_pwd_prop,
+						   AuthFixture::user_pwd));
+	}
+
+
+/*
+  Test that a plaintext password that starts with '$' but is not
+  wholly a hash is still compared as plaintext
+ */
+
+	TEST_FIXTURE(AuthFixture,  GetAuth_DollarPlaintext) {
+	const string dollar_pwd {"$pbkdf2-sha256$notahash"};
+	CHECK_EQUAL (status_codes::OK, put_entity (AuthFixture::addr,
+						   AuthFixture::auth_table,
+						   AuthFixture::auth_table_partition,
+						   AuthFixture::userid,
+						   AuthFixture::auth_pwd_prop,
+						   dollar_pwd));
+
+	CHECK_EQUAL (status_codes::OK,
+		     get_read_token(AuthFixture::auth_addr, AuthFixture::userid, dollar_pwd).first);
+	CHECK_EQUAL (status_codes::NotFound,
+		     get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+
+	// The fixture expects the plaintext password
+	CHECK_EQUAL (status_codes::OK, put_entity (AuthFixture::addr,
+						   AuthFixture::auth_table,
+						   AuthFixture::auth_table_partition,
+						   AuthFixture::userid,
+						   AuthFixture::auth_pwd_prop,
+						   AuthFixture::user_pwd));
+	}
+
+
+/*
+  Test that InvalidateAuth, which only BasicServer may send, is
+  refused without the key it carries
+ */
+
+	TEST_FIXTURE(AuthFixture,  GetAuth_InvalidateForbidden) {
+	CHECK_EQUAL (status_codes::Forbidden,
+		     do_request (methods::POST, string(AuthFixture::auth_addr) + "InvalidateAuth/Made,Up").first);
+	CHECK_EQUAL (status_codes::Forbidden,
+		     do_request (methods::POST, string(AuthFixture::auth_addr) + "InvalidateAuth",
+				 build_json_object (vector<pair<string,string>> {make_pair("Key", "guess")})).first);
+
+	// Writes through BasicServer still reach AuthServer
+	const string new_pwd {"NewPassword"};
+	CHECK_EQUAL (status_codes::OK, put_entity (AuthFixture::addr,
+						   AuthFixture::auth_table,
+						   AuthFixture::auth_table_partition,
+						   AuthFixture::userid,
+						   AuthFixture::auth_pwd_prop,
+						   new_pwd));
+	CHECK_EQUAL (status_codes::OK,
+		     get_read_token(AuthFixture::auth_addr, AuthFixture::userid, new_pwd).first);
+	CHECK_EQUAL (status_codes::OK, put_entity (AuthFixture::addr,
+						   AuthFixture::auth_table,
+						   AuthFixture::auth_table_partition,
+						   AuthFixture::userid,
+						   AuthFixture::auth_pwd_prop,
+						   AuthFixture::user_pwd));
+	}
+
+
 /* Test User not found */
 
 	TEST_FIXTURE(AuthFixture,  GetAuth_UserNotFound) {
@@ -1266,6 +1501,60 @@ SUITE(GET_AUTH) {
 
 	CHECK_EQUAL(status_codes::BadRequest, result.first);
   }
+
+  /*
+    Test of AuthServer's cache of AuthTable entries: a repeated token
+    request is a cache hit, and a password changed through
+    BasicServer takes effect at once
+   */
+  TEST_FIXTURE(AuthFixture,  GetAuth_CachedPasswordChange) {
+    CHECK_EQUAL (status_codes::OK,
+                 get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+
+    pair<status_code,value> before {do_request (methods::GET, string(AuthFixture::auth_addr) + auth_cache_metrics_op)};
+    CHECK_EQUAL (status_codes::OK, before.first);
+    CHECK_EQUAL (status_codes::OK,
+                 get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+    pair<status_code,value> after {do_request (methods::GET, string(AuthFixture::auth_addr) + auth_cache_metrics_op)};
+    CHECK_EQUAL (status_codes::OK, after.first);
+    CHECK_EQUAL (before.second["Hits"].as_number().to_uint64() + 1,
+                 after.second["Hits"].as_number().to_uint64());
+
+    const string new_pwd {"NewPassword"};
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (AuthFixture::addr, AuthFixture::auth_table, AuthFixture::auth_table_partition,
+                             AuthFixture::userid, AuthFixture::auth_pwd_prop, new_pwd));
+    CHECK_EQUAL (status_codes::NotFound,
+                 get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+    CHECK_EQUAL (status_codes::OK,
+                 get_read_token(AuthFixture::auth_addr, AuthFixture::userid, new_pwd).first);
+
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (AuthFixture::addr, AuthFixture::auth_table, AuthFixture::auth_table_partition,
+                             AuthFixture::userid, AuthFixture::auth_pwd_prop, AuthFixture::user_pwd));
+  }
+
+  /*
+    Test that repeated requests for an unknown userid are answered
+    from memory: at most the first reads AuthTable
+   */
+  TEST_FIXTURE(AuthFixture,  GetAuth_UnknownUserInMemory) {
+    const string unknown {"NoSuchUser"};
+    pair<status_code,value> before {do_request (methods::GET, string(AuthFixture::auth_addr) + auth_cache_metrics_op)};
+    CHECK_EQUAL (status_codes::OK, before.first);
+    for (int i {0}; i < 3; ++i)
+      CHECK_EQUAL (status_codes::NotFound,
+                   get_read_token(AuthFixture::auth_addr, unknown, AuthFixture::user_pwd).first);
+    pair<status_code,value> after {do_request (methods::GET, string(AuthFixture::auth_addr) + auth_cache_metrics_op)};
+    CHECK_EQUAL (status_codes::OK, after.first);
+
+    auto count = [] (const value& metrics, const string& name) {
+      return metrics.at(name).as_number().to_uint64();
+    };
+    const uint64_t in_memory {count(after.second, "FilterRejections") - count(before.second, "FilterRejections") +
+                              count(after.second, "AbsentHits") - count(before.second, "AbsentHits")};
+    CHECK (in_memory >= 2);
+  }
 }
 
 
@@ -1687,6 +1976,299 @@ SUITE(UPDATE_AUTH) {
                   )};
     CHECK_EQUAL(status_codes::Forbidden, result.first);
   }
+
+  /*
+    Test of RefreshUpdateTokens: a valid update token is exchanged
+    for a new one that can update the user's entity
+   */
+  TEST_FIXTURE(AuthFixture,  RefreshUpdateTokens) {
+    pair<string,string> added_prop {make_pair(string("born"),string("1942"))};
+
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr,
+                       AuthFixture::userid,
+                       AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    pair<status_code,value> refresh_res {
+      do_request (methods::POST,
+                  string(AuthFixture::auth_addr)
+                  + refresh_update_tokens_op,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(string(AuthFixture::userid),
+                                              value::string(token_res.second))}))};
+    CHECK_EQUAL (status_codes::OK, refresh_res.first);
+    CHECK (refresh_res.second.has_field(AuthFixture::userid));
+    if ( ! refresh_res.second.has_field(AuthFixture::userid))
+      return;
+
+    pair<status_code,value> result {
+      do_request (methods::PUT,
+                  string(AuthFixture::addr)
+                  + update_entity_auth + "/"
+                  + AuthFixture::table + "/"
+                  + refresh_res.second[AuthFixture::userid].as_string() + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(added_prop.first,
+                                              value::string(added_prop.second))})
+                  )};
+    CHECK_EQUAL(status_codes::OK, result.first);
+  }
+
+  /*
+    Test that AuthServer hands the same token to repeated requests,
+    until RefreshUpdateTokens issues a new one, which is then handed
+    out instead
+   */
+  TEST_FIXTURE(AuthFixture,  GetUpdateToken_Reused) {
+    pair<status_code,string> first {
+      get_update_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd)};
+    pair<status_code,string> second {
+      get_update_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, first.first);
+    CHECK_EQUAL (status_codes::OK, second.first);
+    CHECK_EQUAL (first.second, second.second);
+
+    pair<status_code,value> refresh_res {
+      do_request (methods::POST,
+                  string(AuthFixture::auth_addr)
+                  + refresh_update_tokens_op,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(string(AuthFixture::userid),
+                                              value::string(first.second))}))};
+    CHECK_EQUAL (status_codes::OK, refresh_res.first);
+    CHECK (refresh_res.second.has_field(AuthFixture::userid));
+    if ( ! refresh_res.second.has_field(AuthFixture::userid))
+      return;
+
+    pair<status_code,string> third {
+      get_update_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, third.first);
+    CHECK_EQUAL (refresh_res.second[AuthFixture::userid].as_string(), third.second);
+  }
+
+  /*
+    Test of RefreshUpdateTokens with tokens that must not be renewed:
+    a read-only token, a forged token and an unknown user
+   */
+  TEST_FIXTURE(AuthFixture,  RefreshUpdateTokens_Rejected) {
+    pair<status_code,string> read_token_res {
+      get_read_token(AuthFixture::auth_addr,
+                     AuthFixture::userid,
+                     AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, read_token_res.first);
+
+    for (const string& token : vector<string> {read_token_res.second, "se=2099-01-01T00%3A00%3A00Z&sp=ru&sig=forged"}) {
+      pair<status_code,value> refresh_res {
+        do_request (methods::POST,
+                    string(AuthFixture::auth_addr)
+                    + refresh_update_tokens_op,
+                    value::object (vector<pair<string,value>>
+                                     {make_pair(string(AuthFixture::userid),
+                                                value::string(token)),
+                                      make_pair(string("NonExistingUser"),
+                                                value::string(token))}))};
+      CHECK_EQUAL (status_codes::OK, refresh_res.first);
+      CHECK_EQUAL (0u, refresh_res.second.size());
+    }
+  }
+
+  /*
+    Test that GetUpdateData/userid/CheckDataRow reports that the
+    user's DataTable entity exists, and only when asked
+   */
+  TEST_FIXTURE(AuthFixture,  GetUpdateData_CheckDataRow) {
+    value pwd {build_json_object (vector<pair<string,string>> {make_pair("Password", AuthFixture::user_pwd)})};
+    pair<status_code,value> checked {
+      do_request (methods::GET,
+                  string(AuthFixture::auth_addr)
+                  + get_update_data_op + "/"
+                  + AuthFixture::userid + "/"
+                  + "CheckDataRow",
+                  pwd)};
+    CHECK_EQUAL (status_codes::OK, checked.first);
+    CHECK (checked.second.has_field("DataRowExists"));
+    if (checked.second.has_field("DataRowExists"))
+      CHECK (checked.second["DataRowExists"].as_bool());
+    CHECK_EQUAL (string(AuthFixture::partition), checked.second["DataPartition"].as_string());
+    CHECK_EQUAL (string(AuthFixture::row), checked.second["DataRow"].as_string());
+
+    pair<status_code,value> unchecked {
+      do_request (methods::GET,
+                  string(AuthFixture::auth_addr)
+                  + get_update_data_op + "/"
+                  + AuthFixture::userid,
+                  pwd)};
+    CHECK_EQUAL (status_codes::OK, unchecked.first);
+    CHECK ( ! unchecked.second.has_field("DataRowExists"));
+  }
+
+  /*
+    Test of GetUpdateDataBatch: a known user with the right password
+    gets a working update token and data location, while an unknown
+    user and a wrong password are left out
+   */
+  TEST_FIXTURE(AuthFixture,  GetUpdateDataBatch) {
+    auto user = [] (const string& userid, const string& password) {
+      return value::object (vector<pair<string,value>> {make_pair(string("Userid"), value::string(userid)),
+                                                        make_pair(string("Password"), value::string(password))});
+    };
+    pair<status_code,value> batch_res {
+      do_request (methods::POST,
+                  string(AuthFixture::auth_addr)
+                  + get_update_data_batch_op,
+                  value::array (vector<value> {user("NonExistingUser", AuthFixture::user_pwd),
+                                               user(AuthFixture::userid, "WrongPassword"),
+                                               user(AuthFixture::userid, AuthFixture::user_pwd)}))};
+    CHECK_EQUAL (status_codes::OK, batch_res.first);
+    CHECK_EQUAL (1u, batch_res.second.size());
+    CHECK (batch_res.second.has_field(AuthFixture::userid));
+    if ( ! batch_res.second.has_field(AuthFixture::userid))
+      return;
+
+    value data {batch_res.second[AuthFixture::userid]};
+    CHECK_EQUAL (string(AuthFixture::partition), data["DataPartition"].as_string());
+    CHECK_EQUAL (string(AuthFixture::row), data["DataRow"].as_string());
+
+    pair<string,string> added_prop {make_pair(string("born"),string("1942"))};
+    pair<status_code,value> result {
+      do_request (methods::PUT,
+                  string(AuthFixture::addr)
+                  + update_entity_auth + "/"
+                  + AuthFixture::table + "/"
+                  + data["token"].as_string() + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(added_prop.first,
+                                              value::string(added_prop.second))})
+                  )};
+    CHECK_EQUAL(status_codes::OK, result.first);
+  }
+
+  /*
+    Test that GetUpdateDataBatch rejects a body that is not an array
+    of userid and password objects
+   */
+  TEST(GetUpdateDataBatch_BadBody) {
+    for (const value& body : vector<value> {value::array(),
+                                            value::object (vector<pair<string,value>> {
+                                                make_pair(string("user"), value::string("user"))}),
+                                            value::array (vector<value> {value::string("user")})}) {
+      pair<status_code,value> batch_res {
+        do_request (methods::POST,
+                    string(AuthFixture::auth_addr)
+                    + get_update_data_batch_op,
+                    body)};
+      CHECK_EQUAL (status_codes::BadRequest, batch_res.first);
+    }
+  }
+
+  /*
+    Test that ListAddAuth and ListRemoveAuth edit a list property as
+    a set of whole items
+   */
+  TEST_FIXTURE(AuthFixture, ListAuth_SetSemantics) {
+    const string list_prop {"Friends"};
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr,
+                       AuthFixture::userid,
+                       AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    auto list_op = [&token_res, &list_prop] (const string& op, const string& item) {
+      return do_request (methods::PUT,
+                         string(AuthFixture::addr)
+                         + op + "/"
+                         + AuthFixture::table + "/"
+                         + token_res.second + "/"
+                         + AuthFixture::partition + "/"
+                         + AuthFixture::row,
+                         value::object (vector<pair<string,value>>
+                                          {make_pair(list_prop, value::string(item))})).first;
+    };
+    auto stored_list = [&list_prop] () {
+      pair<status_code,value> ret_res {
+        do_request (methods::GET,
+                    string(AuthFixture::addr)
+                    + read_entity_admin + "/"
+                    + AuthFixture::table + "/"
+                    + AuthFixture::partition + "/"
+                    + AuthFixture::row)};
+      CHECK_EQUAL (status_codes::OK, ret_res.first);
+      return ret_res.second.has_field(list_prop) ? ret_res.second[list_prop].as_string() : string {};
+    };
+
+    // The property is created by the first add
+    CHECK_EQUAL (status_codes::OK, list_op(list_add_auth, "USA;Ann"));
+    CHECK_EQUAL (string("USA;Ann"), stored_list());
+
+    // A prefix of a listed item is a different item
+    CHECK_EQUAL (status_codes::OK, list_op(list_add_auth, "USA;An"));
+    CHECK_EQUAL (status_codes::OK, list_op(list_add_auth, "USA;Ann"));
+    CHECK_EQUAL (string("USA;Ann|USA;An"), stored_list());
+
+    CHECK_EQUAL (status_codes::OK, list_op(list_remove_auth, "USA;Ann"));
+    CHECK_EQUAL (status_codes::OK, list_op(list_remove_auth, "USA;Ann"));
+    CHECK_EQUAL (string("USA;An"), stored_list());
+
+    // An item may not hold the separator
+    CHECK_EQUAL (status_codes::BadRequest, list_op(list_add_auth, "USA;Ann|USA;Bob"));
+    CHECK_EQUAL (status_codes::BadRequest, list_op(list_add_auth, ""));
+    CHECK_EQUAL (string("USA;An"), stored_list());
+  }
+
+  /*
+    Test that concurrent ListAddAuth requests on one entity lose no
+    item
+   */
+  TEST_FIXTURE(AuthFixture, ListAuth_ConcurrentAdds) {
+    constexpr int threads {8};
+    const string list_prop {"Friends"};
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr,
+                       AuthFixture::userid,
+                       AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    vector<std::thread> clients {};
+    vector<status_code> results (threads, status_codes::OK);
+    for (int t {0}; t < threads; ++t) {
+      clients.emplace_back([t, &token_res, &list_prop, &results] () {
+        results[t] = do_request (methods::PUT,
+                                 string(AuthFixture::addr)
+                                 + list_add_auth + "/"
+                                 + AuthFixture::table + "/"
+                                 + token_res.second + "/"
+                                 + AuthFixture::partition + "/"
+                                 + AuthFixture::row,
+                                 value::object (vector<pair<string,value>>
+                                                  {make_pair(list_prop,
+                                                             value::string("Stress;Friend" + std::to_string(t)))})).first;
+      });
+    }
+    for (auto& c : clients)
+      c.join();
+    for (int t {0}; t < threads; ++t)
+      CHECK_EQUAL (status_codes::OK, results[t]);
+
+    pair<status_code,value> ret_res {
+      do_request (methods::GET,
+                  string(AuthFixture::addr)
+                  + read_entity_admin + "/"
+                  + AuthFixture::table + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row)};
+    CHECK_EQUAL (status_codes::OK, ret_res.first);
+    CHECK (ret_res.second.has_field(list_prop));
+    if ( ! ret_res.second.has_field(list_prop))
+      return;
+    const string list {"|" + ret_res.second[list_prop].as_string() + "|"};
+    for (int t {0}; t < threads; ++t)
+      CHECK (list.find("|Stress;Friend" + std::to_string(t) + "|") != string::npos);
+  }
 }
 
 
@@ -1710,6 +2292,7 @@ public:
   static constexpr const char* friends_property {"Friends"};
   static constexpr const char* status_property {"Status"};
   static constexpr const char* updates_property {"Updates"};
+  static constexpr const char* timeline_table {"TimelineTable"};
 
 public:
   UserFixture() {
@@ -1767,6 +2350,60 @@ public:
   }
 };
 
+/*
+  Sign the fixture's user on, make each of edits, an operation and
+  "country/name", expecting OK, and sign off. Returns the friends
+  list as ReadFriendList gives it and as DataTable holds it, both
+  read before signing off.
+ */
+pair<string,string> edit_friends (const vector<pair<string,string>>& edits) {
+  pair<status_code,value> sign_on_result {
+    do_request (methods::POST,
+                string(UserFixture::user_addr)
+                + sign_on_op + "/"
+                + UserFixture::userid,
+                value::object (vector<pair<string,value>>
+                                 {make_pair(string(UserFixture::auth_pwd_prop),
+                                            value::string(UserFixture::user_pwd))}))};
+  CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+  for (const auto& edit : edits) {
+    pair<status_code,value> edit_result {
+      do_request (methods::PUT,
+                  string(UserFixture::user_addr)
+                  + edit.first + "/"
+                  + UserFixture::userid + "/"
+                  + edit.second)};
+    CHECK_EQUAL(status_codes::OK, edit_result.first);
+  }
+
+  pair<status_code,value> read_result {
+    do_request (methods::GET,
+                string(UserFixture::user_addr)
+                + read_friend_list_op + "/"
+                + UserFixture::userid)};
+  CHECK_EQUAL(status_codes::OK, read_result.first);
+
+  pair<status_code,value> get_result {
+    do_request (methods::GET,
+                string(UserFixture::addr)
+                + read_entity_admin + "/"
+                + UserFixture::table + "/"
+                + UserFixture::partition + "/"
+                + UserFixture::row)};
+  CHECK_EQUAL(status_codes::OK, get_result.first);
+
+  pair<status_code,value> sign_off_result {
+    do_request (methods::POST,
+                string(UserFixture::user_addr)
+                + sign_off_op + "/"
+                + UserFixture::userid)};
+  CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+  return make_pair(read_result.second[UserFixture::friends_property].as_string(),
+                   get_result.second[UserFixture::friends_property].as_string());
+}
+
 SUITE(USER_OP) {
   /*
     Simple Test of SignIn and SignOff operation
@@ -2046,6 +2683,41 @@ SUITE(USER_OP) {
 
 }
 
+  /*
+    Test that repeated AddFriend and UnFriend requests keep each
+    friend once, in the order added, both in ReadFriendList and in
+    DataTable
+   */
+  TEST_FIXTURE(UserFixture, AddFriend_Repeated) {
+    const string expected {"USA;Shinoda,Mike|Canada;Edwards,Kathleen"};
+    pair<string,string> lists {edit_friends (vector<pair<string,string>> {
+                                  make_pair(add_friend_op, "USA/Shinoda,Mike"),
+                                  make_pair(add_friend_op, "Korea/Bae,Doona"),
+                                  make_pair(add_friend_op, "USA/Shinoda,Mike"),
+                                  make_pair(add_friend_op, "Canada/Edwards,Kathleen"),
+                                  make_pair(remove_friend_op, "Korea/Bae,Doona"),
+                                  make_pair(remove_friend_op, "Korea/Bae,Doona")})};
+    CHECK_EQUAL(expected, lists.first);
+    CHECK_EQUAL(expected, lists.second);
+  }
+
+  /*
+    Test that friends are matched exactly, not by a prefix of their names
+   */
+  TEST_FIXTURE(UserFixture, AddFriend_PrefixNames) {
+    int put_result {put_entity (UserFixture::addr, UserFixture::table, UserFixture::partition, UserFixture::row, UserFixture::friends_property, "USA;Anna")};
+    if (put_result != status_codes::OK) {
+      throw std::exception();
+    }
+
+    pair<string,string> lists {edit_friends (vector<pair<string,string>> {
+                                  make_pair(add_friend_op, "USA/Ann"),
+                                  make_pair(remove_friend_op, "USA/An"),
+                                  make_pair(remove_friend_op, "USA/Anna")})};
+    CHECK_EQUAL("USA;Ann", lists.first);
+    CHECK_EQUAL("USA;Ann", lists.second);
+  }
+
   /* 
     Test of AddFriend operation when userid does not have an active session (is not signed in)
    */
@@ -2232,6 +2904,9 @@ SUITE(USER_OP) {
       throw std::exception();
     }
 
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, "Canada;Reynolds,Ryan");
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, "USA;Curry,Stephen");
+
     // Adding Friends to fixture entity in DataTable, Note that friends are added without the AddFriend operation for simplicity
     string friend_list {"Canada;Reynolds,Ryan|USA;Curry,Stephen"};
     put_result = put_entity (UserFixture::addr, UserFixture::table, UserFixture::partition, UserFixture::row, UserFixture::friends_property, friend_list);
@@ -2319,9 +2994,10 @@ SUITE(USER_OP) {
     expect = build_json_object (vector<pair<string,string>> {
                                        make_pair(string(UserFixture::friends_property), ""),
                                        make_pair(string(UserFixture::status_property), ""),
-                                       make_pair(string(UserFixture::updates_property), "Happy\nSad\n")});
+                                       make_pair(string(UserFixture::updates_property), "")});
 
     compare_json_values (expect, get_result.second);
+    CHECK (vector<string> ({"Sad", "Happy"}) == await_timeline (UserFixture::addr, UserFixture::timeline_table, "Canada;Reynolds,Ryan", 2));
 
     get_result = do_request (methods::GET,
                              string(UserFixture::addr)
@@ -2334,9 +3010,10 @@ SUITE(USER_OP) {
     expect = build_json_object (vector<pair<string,string>> {
                                        make_pair(string(UserFixture::friends_property), ""),
                                        make_pair(string(UserFixture::status_property), ""),
-                                       make_pair(string(UserFixture::updates_property), "Happy\nSad\n")});
+                                       make_pair(string(UserFixture::updates_property), "")});
 
     compare_json_values (expect, get_result.second);
+    CHECK (vector<string> ({"Sad", "Happy"}) == await_timeline (UserFixture::addr, UserFixture::timeline_table, "USA;Curry,Stephen", 2));
     
     // Sign off
     pair<status_code,value> sign_off_result {
@@ -2349,6 +3026,8 @@ SUITE(USER_OP) {
 
     CHECK_EQUAL(status_codes::OK, delete_entity (UserFixture::addr, UserFixture::table, "Canada", "Reynolds,Ryan"));
     CHECK_EQUAL(status_codes::OK, delete_entity (UserFixture::addr, UserFixture::table, "USA", "Curry,Stephen"));
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, "Canada;Reynolds,Ryan");
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, "USA;Curry,Stephen");
 
   }
 
@@ -2454,6 +3133,8 @@ SUITE(USER_OP) {
       throw std::exception();
     }
 
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, new_partition + ";" + new_row);
+
     // Add entity to AuthTable where DataPartion="USA" and DataRow="Bennett,Chancelor"
     string new_userid {"user2"};
     string pwd {"foo"};
@@ -2580,8 +3261,9 @@ SUITE(USER_OP) {
     expect = build_json_object (vector<pair<string,string>> {
                                        make_pair(string(UserFixture::friends_property), ""),
                                        make_pair(string(UserFixture::status_property), "Happy"),
-                                       make_pair(string(UserFixture::updates_property), "Sad\n")});
+                                       make_pair(string(UserFixture::updates_property), "")});
     compare_json_values (expect, get_result.second);
+    CHECK (vector<string> {"Sad"} == await_timeline (UserFixture::addr, UserFixture::timeline_table, new_partition + ";" + new_row, 1));
 
     // User UnFriend user2
     pair<status_code,value> delete_friend_result {
@@ -2634,5 +3316,1018 @@ SUITE(USER_OP) {
 
     CHECK_EQUAL(status_codes::OK, delete_entity (UserFixture::addr, UserFixture::table, new_partition, new_row));
     CHECK_EQUAL(status_codes::OK, delete_entity (UserFixture::addr, UserFixture::auth_table, UserFixture::auth_table_partition, new_userid));
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, new_partition + ";" + new_row);
+  }
+
+  /*
+    Test of ReadUpdates returning the latest entries of the user's timeline, most recent first
+   */
+  TEST_FIXTURE(UserFixture, ReadUpdates) {
+    const string timeline {string(UserFixture::partition) + ";" + UserFixture::row};
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, timeline);
+    int make_result {create_table (UserFixture::addr, UserFixture::timeline_table)};
+    if (make_result != status_codes::Created && make_result != status_codes::Accepted) {
+      throw std::exception();
+    }
+
+    // Timeline rows are ordered by row key, so the smallest key is the most recent update
+    vector<pair<string,string>> entries {make_pair("3", "Oldest"), make_pair("2", "Middle"), make_pair("1", "Newest")};
+    for (const auto& entry : entries) {
+      int put_result {put_entity (UserFixture::addr, UserFixture::timeline_table, timeline, entry.first, "Status", entry.second)};
+      if (put_result != status_codes::OK) {
+        throw std::exception();
+      }
+    }
+
+    pair<status_code,value> sign_on_result {
+            do_request (methods::POST,
+                        string(UserFixture::user_addr)
+                        + sign_on_op + "/"
+                        + UserFixture::userid,
+                        value::object (vector<pair<string,value>>
+                                         {make_pair(string(UserFixture::auth_pwd_prop),
+                                                    value::string(UserFixture::user_pwd))}))};
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    pair<status_code,value> read_result {
+            do_request (methods::GET,
+                        string(UserFixture::user_addr)
+                        + read_updates_op + "/"
+                        + UserFixture::userid + "/"
+                        + "2")};
+    CHECK_EQUAL(status_codes::OK, read_result.first);
+    CHECK(read_result.second.is_array());
+    if (read_result.second.is_array()) {
+      const web::json::array& updates {read_result.second.as_array()};
+      CHECK_EQUAL(2, updates.size());
+      if (updates.size() == 2) {
+        CHECK_EQUAL("Newest", updates.at(0).as_object().at("Status").as_string());
+        CHECK_EQUAL("Middle", updates.at(1).as_object().at("Status").as_string());
+      }
+    }
+
+    // Count must be a positive number
+    read_result = do_request (methods::GET,
+                              string(UserFixture::user_addr)
+                              + read_updates_op + "/"
+                              + UserFixture::userid + "/"
+                              + "none");
+    CHECK_EQUAL(status_codes::BadRequest, read_result.first);
+
+    pair<status_code,value> sign_off_result {
+            do_request (methods::POST,
+                        string(UserFixture::user_addr)
+                        + sign_off_op + "/"
+                        + UserFixture::userid)};
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    clear_timeline (UserFixture::addr, UserFixture::timeline_table, timeline);
+  }
+
+  /*
+    Test of ReadUpdates operation when userid does not have an active session (is not signed in)
+   */
+  TEST_FIXTURE(UserFixture, ReadUpdates_Unactive) {
+    pair<status_code,value> read_result {
+            do_request (methods::GET,
+                        string(UserFixture::user_addr)
+                        + read_updates_op + "/"
+                        + UserFixture::userid)};
+    CHECK_EQUAL(status_codes::Forbidden, read_result.first);
+  }
+
+  /*
+    Stress test of the session store: several threads concurrently
+    sign the same user on and off while issuing AddFriend. Every
+    request must be answered with one of its legal codes, and the
+    server must still serve the user afterwards.
+   */
+  TEST_FIXTURE(UserFixture, Sessions_ConcurrentSignOnSignOff) {
+    constexpr int threads {8};
+    constexpr int rounds {25};
+    const value password {value::object (vector<pair<string,value>>
+                                           {make_pair(string(UserFixture::auth_pwd_prop),
+                                                      value::string(UserFixture::user_pwd))})};
+
+    vector<std::thread> clients {};
+    vector<int> unexpected (threads, 0);
+    for (int t {0}; t < threads; ++t) {
+      clients.emplace_back([t, &password, &unexpected] () {
+        for (int r {0}; r < rounds; ++r) {
+          pair<status_code,value> sign_on_result {
+            do_request (methods::POST,
+                        string(UserFixture::user_addr)
+                        + sign_on_op + "/"
+                        + UserFixture::userid,
+                        password)};
+          if (sign_on_result.first != status_codes::OK)
+            ++unexpected[t];
+
+          pair<status_code,value> add_friend_result {
+            do_request (methods::PUT,
+                        string(UserFixture::user_addr)
+                        + add_friend_op + "/"
+                        + UserFixture::userid + "/"
+                        + "Stress/Friend," + std::to_string(t))};
+          if (add_friend_result.first != status_codes::OK
+              && add_friend_result.first != status_codes::Forbidden)
+            ++unexpected[t];
+
+          pair<status_code,value> sign_off_result {
+            do_request (methods::POST,
+                        string(UserFixture::user_addr)
+                        + sign_off_op + "/"
+                        + UserFixture::userid)};
+          if (sign_off_result.first != status_codes::OK
+              && sign_off_result.first != status_codes::NotFound)
+            ++unexpected[t];
+        }
+      });
+    }
+    for (auto& c : clients)
+      c.join();
+
+    for (int t {0}; t < threads; ++t)
+      CHECK_EQUAL(0, unexpected[t]);
+
+    pair<status_code,value> sign_on_result {
+      do_request (methods::POST,
+                  string(UserFixture::user_addr)
+                  + sign_on_op + "/"
+                  + UserFixture::userid,
+                  password)};
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    pair<status_code,value> sign_off_result {
+      do_request (methods::POST,
+                  string(UserFixture::user_addr)
+                  + sign_off_op + "/"
+                  + UserFixture::userid)};
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+  }
+}
+
+SUITE(PUSH) {
+  static constexpr const char* push_addr {"http://localhost:34574/"};
+
+  /*
+    Test that PushStatus is acknowledged once queued and shows up in the queue metrics
+   */
+  TEST(PushStatus_Queued) {
+    pair<status_code,value> before {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, before.first);
+
+    pair<status_code,value> push_result {
+      do_request (methods::POST,
+                  string(push_addr)
+                  + push_status_op + "/"
+                  + "Nowhere" + "/"
+                  + "Nobody" + "/"
+                  + "Queued",
+                  build_json_object (vector<pair<string,string>> {make_pair("Friends", "")}))};
+    CHECK_EQUAL(status_codes::Accepted, push_result.first);
+
+    pair<status_code,value> after {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, after.first);
+    CHECK_EQUAL(before.second["Enqueued"].as_number().to_uint64() + 1,
+                after.second["Enqueued"].as_number().to_uint64());
+    CHECK(after.second.has_field("Depth"));
+    CHECK(after.second.has_field("DrainLagMs"));
+  }
+
+  /*
+    Test that a burst of statuses to one recipient is written with fewer storage writes than deliveries
+   */
+  TEST(PushStatus_BurstCoalesced) {
+    const string timeline_table {"TimelineTable"};
+    const string recipient {"Canada;Burst,Receiver"};
+    clear_timeline ("http://localhost:34568/", timeline_table, recipient);
+
+    pair<status_code,value> before {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, before.first);
+
+    const int burst {10};
+    for (int i {0}; i < burst; ++i) {
+      pair<status_code,value> push_result {
+        do_request (methods::POST,
+                    string(push_addr)
+                    + push_status_op + "/"
+                    + "USA" + "/"
+                    + "Poster," + std::to_string(i) + "/"
+                    + "Burst",
+                    build_json_object (vector<pair<string,string>> {make_pair("Friends", recipient)}))};
+      CHECK_EQUAL(status_codes::Accepted, push_result.first);
+    }
+    CHECK_EQUAL(burst, await_timeline ("http://localhost:34568/", timeline_table, recipient, burst).size());
+
+    pair<status_code,value> after {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, after.first);
+    const uint64_t deliveries {after.second["Deliveries"].as_number().to_uint64()
+                               - before.second["Deliveries"].as_number().to_uint64()};
+    const uint64_t writes {after.second["Writes"].as_number().to_uint64()
+                           - before.second["Writes"].as_number().to_uint64()};
+    cout << "Burst of " << deliveries << " deliveries took " << writes << " writes" << endl;
+    CHECK(deliveries >= static_cast<uint64_t>(burst));
+    CHECK(writes < deliveries);
+
+    clear_timeline ("http://localhost:34568/", timeline_table, recipient);
+  }
+
+  /*
+    Test that a malformed friends list is rejected before it is queued
+   */
+  TEST(PushStatus_BadFriendsList) {
+    pair<status_code,value> push_result {
+      do_request (methods::POST,
+                  string(push_addr)
+                  + push_status_op + "/"
+                  + "Nowhere" + "/"
+                  + "Nobody" + "/"
+                  + "Queued",
+                  build_json_object (vector<pair<string,string>> {make_pair("Friends", "USAMadonna|Canada;Edwards,Kathleen")}))};
+    CHECK_EQUAL(status_codes::BadRequest, push_result.first);
+  }
+
+  /*
+    Test that PushStatus without a friends list goes to the recipients
+    in the follower index, as set and then changed one at a time
+   */
+  TEST(PushStatus_FollowerIndex) {
+    const string timeline_table {"TimelineTable"};
+    const string kept {"Canada;Index,Kept"};
+    const string added {"Canada;Index,Added"};
+    const string removed {"Canada;Index,Removed"};
+    for (const auto& recipient : vector<string> {kept, added, removed})
+      clear_timeline ("http://localhost:34568/", timeline_table, recipient);
+
+    pair<status_code,value> set_result {
+      do_request (methods::POST,
+                  string(push_addr) + "SetFollowers/USA/Index,Author",
+                  build_json_object (vector<pair<string,string>> {make_pair("Friends", kept + "|" + removed)}))};
+    CHECK_EQUAL(status_codes::OK, set_result.first);
+    CHECK_EQUAL(status_codes::OK,
+                do_request (methods::POST, string(push_addr) + "AddFollower/USA/Index,Author/Canada/Index,Added").first);
+    CHECK_EQUAL(status_codes::OK,
+                do_request (methods::POST, string(push_addr) + "RemoveFollower/USA/Index,Author/Canada/Index,Removed").first);
+
+    pair<status_code,value> push_result {
+      do_request (methods::POST,
+                  string(push_addr)
+                  + push_status_op + "/"
+                  + "USA" + "/"
+                  + "Index,Author" + "/"
+                  + "Indexed")};
+    CHECK_EQUAL(status_codes::Accepted, push_result.first);
+
+    CHECK (vector<string> {"Indexed"} == await_timeline ("http://localhost:34568/", timeline_table, kept, 1));
+    CHECK (vector<string> {"Indexed"} == await_timeline ("http://localhost:34568/", timeline_table, added, 1));
+    // Had it been delivered, it would have been written with the others
+    CHECK_EQUAL (0u, read_timeline ("http://localhost:34568/", timeline_table, removed).size());
+
+    pair<status_code,value> metrics {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, metrics.first);
+    CHECK(metrics.second["IndexedAuthors"].as_number().to_uint64() >= 1);
+
+    // Dropping the list, or that of an author never seen, is OK
+    CHECK_EQUAL(status_codes::OK,
+                do_request (methods::POST, string(push_addr) + "DropFollowers/USA/Index,Author").first);
+    CHECK_EQUAL(status_codes::OK,
+                do_request (methods::POST, string(push_addr) + "DropFollowers/Nowhere/Index,Nobody").first);
+    pair<status_code,value> dropped {do_request (methods::GET, string(push_addr) + push_metrics_op)};
+    CHECK_EQUAL(status_codes::OK, dropped.first);
+    CHECK(dropped.second["IndexedAuthors"].as_number().to_uint64() <
+          metrics.second["IndexedAuthors"].as_number().to_uint64());
+
+    for (const auto& recipient : vector<string> {kept, added, removed})
+      clear_timeline ("http://localhost:34568/", timeline_table, recipient);
+  }
+}
+
+/*
+  Tests of SasSigner against the storage library
+
+  These run offline: a token is computed from the account key alone,
+  so any account name and key will do.
+ */
+SUITE(SAS_SIGNER) {
+  /*
+    Test that native tokens are byte-for-byte the library's, for
+    entity keys and table names that need encoding
+   */
+  TEST(SasSigner_MatchesLibrary) {
+    using azure::storage::cloud_table;
+    using azure::storage::table_shared_access_policy;
+
+    const azure::storage::storage_credentials credentials {"cmpt276test",
+                                                           "c2lnbmVyIHRlc3Qga2V5IG5vdCB1c2VkIGZvciBhbnl0aGluZyBlbHNl"};
+    const azure::storage::cloud_table_client client {
+      azure::storage::storage_uri {web::http::uri {"https://cmpt276test.table.core.windows.net"}}, credentials};
+    SasSigner signer {credentials.account_name(), credentials.account_key()};
+
+    // Whole seconds, as AuthServer truncates expiry times to.
+    // utility::datetime counts 100 ns ticks from 1601.
+    const std::time_t expiry {std::time(nullptr) + 24 * 60 * 60};
+    const utility::datetime exptime {utility::datetime {} +
+                                     (static_cast<uint64_t>(expiry) + 11644473600ULL) * 10000000ULL};
+
+    const vector<pair<string,string>> entities {
+      make_pair("USA", "Franklin,Aretha"),
+      make_pair("Canada", "Cohen Leonard"),
+      make_pair("A&B=C+D/E?F", "caf\xc3\xa9 ~-._%"),
+      make_pair("", "")};
+    for (const string& table_name : vector<string> {"DataTable", "MixedCaseTable"}) {
+      cloud_table table {client.get_table_reference(table_name)};
+      for (const auto& entity : entities) {
+        for (uint8_t permissions : {table_shared_access_policy::permissions::read,
+                                    table_shared_access_policy::permissions::read |
+                                    table_shared_access_policy::permissions::update}) {
+          table_shared_access_policy policy {exptime, permissions};
+          const string expected {table.get_shared_access_signature(policy, string(),
+                                                                   entity.first, entity.second,
+                                                                   entity.first, entity.second)};
+          CHECK_EQUAL(expected,
+                      signer.table_token(table_name, entity.first, entity.second,
+                                         policy.permissions_to_string(), expiry));
+        }
+      }
+    }
+  }
+}
+
+/*
+  Tests of InternTable, which run offline
+ */
+SUITE(INTERN_TABLE) {
+  /*
+    Test that ids are dense, stable under concurrent interning, and
+    map back to the user they were given for
+   */
+  TEST(InternTable_DenseAndStable) {
+    InternTable ids {4};
+    const InternTable::id_t ann {ids.intern("USA", "Ann")};
+    CHECK_EQUAL(0u, ann);
+    CHECK_EQUAL(1u, ids.intern("USA;Anna"));
+    CHECK_EQUAL(ann, ids.intern("USA;Ann"));
+    CHECK_EQUAL("USA;Ann", ids.key(ann));
+    CHECK(make_pair(string("USA"), string("Ann")) == ids.user(ann));
+
+    InternTable::id_t found {0};
+    CHECK(! ids.find("USA;An", found));
+    CHECK(ids.find("USA;Anna", found) && found == 1u);
+
+    constexpr int users {2000};
+    vector<vector<InternTable::id_t>> seen (4);
+    vector<std::thread> threads {};
+    for (std::size_t t {0}; t < seen.size(); ++t) {
+      threads.emplace_back([&ids, &seen, t] () {
+          for (int i {0}; i < users; ++i)
+            seen[t].push_back(ids.intern("Canada", "User," + std::to_string(i)));
+        });
+    }
+    for (auto& t : threads)
+      t.join();
+    for (const auto& s : seen)
+      CHECK(seen[0] == s);
+    CHECK_EQUAL(static_cast<std::size_t>(users + 2), ids.size());
+    for (int i {0}; i < users; ++i)
+      CHECK_EQUAL("Canada;User," + std::to_string(i), ids.key(seen[0][i]));
+  }
+}
+
+/*
+  Tests of PropertyIndex's stamps, which BasicServer relies on when
+  writes and deletes of one entity race. These run offline.
+ */
+SUITE(PROPERTY_INDEX) {
+  /*
+    Test that a remove with a stamp taken before a later add leaves
+    the entity indexed
+   */
+  TEST(PropertyIndex_LaterAddWins) {
+    PropertyIndex index {};
+    vector<PropertyIndex::key_t> keys {};
+    CHECK(index.start("T"));
+    index.finish("T");
+
+    index.add("T", "P", "R", PropertyIndex::names_t {"A"});
+    const std::uint64_t before_merge {index.stamp("T", "P", "R")};
+    index.add("T", "P", "R", PropertyIndex::names_t {"B"});
+    index.remove("T", "P", "R", before_merge);
+    CHECK(index.find("T", PropertyIndex::names_t {"B"}, keys));
+    CHECK(vector<PropertyIndex::key_t> {make_pair(string("P"), string("R"))} == keys);
+
+    index.remove("T", "P", "R", index.stamp("T", "P", "R"));
+    CHECK(index.find("T", PropertyIndex::names_t {"B"}, keys));
+    CHECK(keys.empty());
+  }
+
+  /*
+    Test that undo() takes back just what a refused write added: a
+    new entity entirely, and only the new names of an existing one
+   */
+  TEST(PropertyIndex_Undo) {
+    PropertyIndex index {};
+    vector<PropertyIndex::key_t> keys {};
+    CHECK(index.start("T"));
+    index.finish("T");
+
+    index.undo("T", "Forged", "Row", index.add("T", "Forged", "Row", PropertyIndex::names_t {"Junk"}));
+    CHECK(index.find("T", PropertyIndex::names_t {"Junk"}, keys));
+    CHECK(keys.empty());
+    CHECK_EQUAL(0u, index.metrics().entities);
+
+    index.add("T", "P", "R", PropertyIndex::names_t {"A"});
+    index.undo("T", "P", "R", index.add("T", "P", "R", PropertyIndex::names_t {"A", "Junk"}));
+    CHECK(index.find("T", PropertyIndex::names_t {"A"}, keys));
+    CHECK_EQUAL(1u, keys.size());
+    CHECK(index.find("T", PropertyIndex::names_t {"Junk"}, keys));
+    CHECK(keys.empty());
+
+    // An add since the refused one is not taken back
+    const std::uint64_t refused {index.add("T", "P", "R", PropertyIndex::names_t {"C"})};
+    index.add("T", "P", "R", PropertyIndex::names_t {"C"});
+    index.undo("T", "P", "R", refused);
+    CHECK(index.find("T", PropertyIndex::names_t {"C"}, keys));
+    CHECK_EQUAL(1u, keys.size());
+  }
+}
+
+/*
+  Tests of how FriendGraph and FollowerIndex load a list while
+  changes to it arrive. These run offline.
+ */
+SUITE(FRIEND_LISTS) {
+  /*
+    Test that changes arriving while a list is read are applied to
+    what was read, that a set() meanwhile supersedes them, and that
+    nothing read is kept across a drop()
+   */
+  TEST(FollowerIndex_ChangesDuringLoad) {
+    FollowerIndex index {};
+    FollowerIndex::recipients_t recipients {};
+
+    CHECK(! index.add(1, 7));
+    index.begin_load(1);
+    CHECK(index.add(1, 7));
+    CHECK(index.remove(1, 2));
+    index.load(1, FollowerIndex::recipients_t {3, 2});
+    CHECK(index.find(1, recipients));
+    CHECK((FollowerIndex::recipients_t {3, 7}) == recipients);
+    CHECK(! index.add(2, 7));
+
+    index.begin_load(2);
+    index.add(2, 5);
+    index.set(2, FollowerIndex::recipients_t {9});
+    index.load(2, FollowerIndex::recipients_t {4});
+    CHECK(index.find(2, recipients));
+    CHECK((FollowerIndex::recipients_t {9}) == recipients);
+
+    index.begin_load(3);
+    index.drop(3);
+    index.load(3, FollowerIndex::recipients_t {4});
+    CHECK(! index.find(3, recipients));
+    index.begin_load(3);
+    index.abandon(3);
+    CHECK(! index.add(3, 4));
+  }
+
+  /*
+    Test that only the load() that inserts a list announces it, and
+    that a failed announcement leaves the list unloaded
+   */
+  TEST(FriendGraph_LoadAnnouncesOnce) {
+    InternTable ids {};
+    FriendGraph graph {ids};
+    const FriendGraph::list_t friends {make_pair(string("USA"), string("Ann"))};
+    int announced {0};
+    const FriendGraph::write_t announce {[&announced] () { ++announced; return true; }};
+
+    CHECK(graph.load(1, friends, announce));
+    CHECK(! graph.load(1, friends, announce));
+    CHECK_EQUAL(1, announced);
+    CHECK(graph.loaded(1));
+
+    CHECK(graph.load(2, friends, [] () { return false; }));
+    CHECK(! graph.loaded(2));
+  }
+}
+
+/*
+  Tests of SessionCodec, which must give back every session exactly
+  as it was stored. These run offline.
+ */
+SUITE(SESSION_CODEC) {
+  // Shared query parameters of the tokens below
+  const string token_head {"se=2016-12-01T00%3A00%3A00Z&sp=ru&sv=2015-04-05&tn=DataTable"};
+
+  // 43 base64 digits and an escaped '=': 32 zero bytes, as signed
+  const string zero_sig {string(43, 'A') + "%3D"};
+
+  /*
+    Encode session, check that it decodes to itself, and return it
+    encoded
+   */
+  SessionCodec::encoded_t check_round_trip (SessionCodec& codec, const SessionCodec::session_t& session) {
+    const SessionCodec::encoded_t encoded {codec.encode(session)};
+    SessionCodec::session_t decoded {};
+    codec.decode(encoded, decoded);
+    CHECK_EQUAL(get<0>(session), get<0>(decoded));
+    CHECK_EQUAL(get<1>(session), get<1>(decoded));
+    CHECK_EQUAL(get<2>(session), get<2>(decoded));
+    CHECK_EQUAL(get<0>(session), codec.token(encoded));
+    return encoded;
+  }
+
+  /*
+    Test that a partition and row percent-encoded in spk/srk, in
+    either case and whether or not encoding was needed, come back as
+    the token had them, and that the shape is shared
+   */
+  TEST(SessionCodec_PercentEncodedKeys) {
+    SessionCodec codec {};
+    vector<SessionCodec::encoded_t> encoded {};
+    const vector<SessionCodec::session_t> sessions {
+      make_tuple(token_head + "&spk=USA&srk=Franklin%2CAretha&epk=USA&erk=Franklin%2CAretha&sig=" + zero_sig,
+                 "USA", "Franklin,Aretha"),
+      make_tuple(token_head + "&spk=C%61nada&srk=Cohen%20Leonard&epk=C%61nada&erk=Cohen%20Leonard&sig=" + zero_sig,
+                 "Canada", "Cohen Leonard"),
+      make_tuple(token_head + "&spk=A%26B&srk=caf%c3%a9&epk=A%26B&erk=caf%C3%A9&sig=" + zero_sig,
+                 "A&B", "caf\xc3\xa9"),
+      // Keys that are not the entity's are kept in the token as they are
+      make_tuple(token_head + "&spk=Mexico&srk=Other&epk=Mexico&erk=Other&sig=" + zero_sig,
+                 "USA", "Franklin,Aretha")};
+    for (const auto& s : sessions)
+      encoded.push_back(check_round_trip(codec, s));
+    CHECK_EQUAL(encoded[0].shape, encoded[1].shape);
+    CHECK_EQUAL(encoded[0].partition, encoded[3].partition);
+    for (const auto& e : encoded)
+      codec.release(e);
+  }
+
+  /*
+    Test that signatures the compact form cannot reproduce are kept as
+    they were written: leftover bits set, lower-case escapes, a wrong
+    length or padding
+   */
+  TEST(SessionCodec_NonCanonicalSignature) {
+    SessionCodec codec {};
+    const string keys {"&spk=USA&srk=Ann&epk=USA&erk=Ann&sig="};
+    const vector<string> sigs {
+      string(42, 'A') + "B%3D",                         // Low bits of the last digit set
+      "%2b%2f" + string(41, 'A') + "%3D",               // Escapes in lower case
+      "+/" + string(41, 'A') + "%3D",                   // Not escaped at all
+      string(42, 'A') + "%3D",                          // One digit short
+      string(43, 'A') + "=",                            // Padding not escaped
+      string(43, 'A'),                                  // No padding
+      "",
+      "%2B%2F" + string(41, 'z') + "%3D"};              // Canonical, for contrast
+    for (const string& sig : sigs)
+      codec.release(check_round_trip(codec, make_tuple(token_head + keys + sig, "USA", "Ann")));
+  }
+
+  /*
+    Test that a token holding a marker character, or not shaped like
+    a query string at all, is kept whole
+   */
+  TEST(SessionCodec_WholeTokenFallback) {
+    SessionCodec codec {};
+    const vector<SessionCodec::session_t> sessions {
+      make_tuple(token_head + "&spk=USA&srk=A\x01" "nn&sig=" + zero_sig, "USA", "A\x01nn"),
+      make_tuple(string {"\x05"}, "USA", "Ann"),
+      make_tuple(string {}, "USA", "Ann"),
+      make_tuple(string {"&&=&spk&srk="}, "", "")};
+    for (const auto& s : sessions)
+      codec.release(check_round_trip(codec, s));
+  }
+
+  /*
+    Test that released shape and partition ids and arena blocks are
+    reused, so that sessions coming and going do not grow the codec
+   */
+  TEST(SessionCodec_ReleaseAndReuse) {
+    SessionCodec codec {};
+    const SessionCodec::session_t first {make_tuple(token_head + "&spk=USA&srk=Ann&sig=" + zero_sig, "USA", "Ann")};
+    const SessionCodec::session_t other {make_tuple(token_head + "&sp=r&spk=Peru&srk=Bo&sig=" + zero_sig, "Peru", "Bo")};
+
+    const SessionCodec::encoded_t a {check_round_trip(codec, first)};
+    const SessionCodec::encoded_t b {check_round_trip(codec, first)};
+    CHECK_EQUAL(a.shape, b.shape);
+    CHECK(a.block != b.block);
+    codec.release(a);
+
+    // b still holds the shape, so its id is not handed out again
+    const SessionCodec::encoded_t c {check_round_trip(codec, other)};
+    CHECK(c.shape != b.shape);
+    CHECK(c.block == a.block);
+    CHECK_EQUAL(2u, codec.shape_count());
+    codec.release(b);
+    codec.release(c);
+    CHECK_EQUAL(0u, codec.shape_count());
+
+    const SessionCodec::encoded_t d {check_round_trip(codec, other)};
+    CHECK(d.shape == b.shape || d.shape == c.shape);
+    CHECK(d.block == c.block || d.block == b.block);
+    codec.release(d);
+
+    const std::size_t reserved {codec.arena_bytes()};
+    for (int i {0}; i < 100000; ++i)
+      codec.release(check_round_trip(codec, i % 2 ? first : other));
+    CHECK_EQUAL(reserved, codec.arena_bytes());
+    CHECK_EQUAL(0u, codec.shape_count());
+  }
+}
+
+/*
+  Tests of TimingWheel, driven by advance() with made-up times rather
+  than by waiting. These run offline.
+
+  Times are whole ticks from when the wheel was made, tick_length 1 s.
+  The wheel's origin is a little after start, so a deadline half a
+  tick before tick d falls due at d, and half a tick after tick k the
+  wheel has turned exactly k times.
+ */
+SUITE(TIMING_WHEEL) {
+  const std::chrono::milliseconds tick {1000};
+
+  TimingWheel::time_point_t deadline (TimingWheel::time_point_t start, int d) {
+    return start + d * tick - tick / 2;
+  }
+
+  TimingWheel::time_point_t at (TimingWheel::time_point_t start, int k) {
+    return start + k * tick + tick / 2;
+  }
+
+  /*
+    Test that timers in every level, and beyond the top level, fire
+    at their tick and not before, with 2-bit slots in 3 levels
+    covering 64 ticks
+   */
+  TEST(TimingWheel_Cascade) {
+    const TimingWheel::time_point_t start {std::chrono::steady_clock::now()};
+    TimingWheel wheel {tick, 1000, 10000, 2, 3};
+    const vector<int> ticks {1, 3, 4, 5, 15, 16, 17, 33, 63, 64, 65, 100, 200};
+    for (int d : ticks)
+      wheel.arm(std::to_string(d), deadline(start, d));
+    CHECK_EQUAL(ticks.size(), wheel.size());
+
+    CHECK(wheel.advance(at(start, 0)).empty());
+    for (int k {1}; k <= 200; ++k) {
+      const vector<string> expired {wheel.advance(at(start, k))};
+      if (std::find(ticks.begin(), ticks.end(), k) == ticks.end()) {
+        CHECK(expired.empty());
+      }
+      else {
+        CHECK_EQUAL(1u, expired.size());
+        CHECK(expired == vector<string> {std::to_string(k)});
+      }
+    }
+    CHECK_EQUAL(0u, wheel.size());
+  }
+
+  /*
+    Test that a late advance() returns everything due meanwhile,
+    including a deadline beyond the top level, and that a deadline
+    already passed fires on the next advance()
+   */
+  TEST(TimingWheel_LateAdvance) {
+    const TimingWheel::time_point_t start {std::chrono::steady_clock::now()};
+    TimingWheel wheel {tick, 1000, 10000, 2, 3};
+    wheel.arm("near", deadline(start, 2));
+    wheel.arm("far", deadline(start, 130));
+    wheel.arm("later", deadline(start, 131));
+    vector<string> expired {wheel.advance(at(start, 130))};
+    std::sort(expired.begin(), expired.end());
+    CHECK(expired == (vector<string> {"far", "near"}));
+
+    wheel.arm("past", deadline(start, 1));
+    CHECK(wheel.advance(at(start, 130)) == vector<string> {"past"});
+    CHECK(wheel.advance(at(start, 131)) == vector<string> {"later"});
+  }
+
+  /*
+    Test that a timer can be cancelled or armed again while it waits
+    in the backlog to be moved down, or in the due list to be
+    returned
+   */
+  TEST(TimingWheel_RearmAndCancelPending) {
+    const TimingWheel::time_point_t start {std::chrono::steady_clock::now()};
+
+    // One move per tick: at tick 4, "a" comes down and "b" and "c" wait
+    TimingWheel moving {tick, 1000, 1, 2, 3};
+    for (const string key : {"a", "b", "c"})
+      moving.arm(key, deadline(start, 5));
+    CHECK(moving.advance(at(start, 4)).empty());
+    CHECK(moving.cancel("b"));
+    CHECK(! moving.cancel("b"));
+    moving.arm("c", deadline(start, 9));
+    CHECK_EQUAL(2u, moving.size());
+    CHECK(moving.advance(at(start, 5)) == vector<string> {"a"});
+    for (int k {6}; k < 9; ++k)
+      CHECK(moving.advance(at(start, k)).empty());
+    CHECK(moving.advance(at(start, 9)) == vector<string> {"c"});
+    CHECK_EQUAL(0u, moving.size());
+
+    // One expiry per advance(): "d" is returned and "e" and "f" stay due
+    TimingWheel expiring {tick, 1, 10000, 2, 3};
+    for (const string key : {"d", "e", "f"})
+      expiring.arm(key, deadline(start, 10));
+    CHECK(expiring.advance(at(start, 10)) == vector<string> {"d"});
+    CHECK(expiring.cancel("e"));
+    expiring.arm("f", deadline(start, 12));
+    CHECK(expiring.advance(at(start, 10)).empty());
+    CHECK(expiring.advance(at(start, 11)).empty());
+    CHECK(expiring.advance(at(start, 12)) == vector<string> {"f"});
+    CHECK_EQUAL(0u, expiring.size());
+  }
+
+  /*
+    Test that each tick moves at most move_limit timers down and each
+    advance() returns at most expiry_limit keys, and that nothing is
+    lost to either limit
+   */
+  TEST(TimingWheel_BoundedWork) {
+    const TimingWheel::time_point_t start {std::chrono::steady_clock::now()};
+    TimingWheel wheel {tick, 5, 10, 2, 3};
+    constexpr int timers {40};
+    for (int i {0}; i < timers; ++i)
+      wheel.arm(std::to_string(i), deadline(start, 6));
+
+    // The level 1 slot turns at tick 4; ticks 4, 5 and 6 move 30 down
+    CHECK(wheel.advance(at(start, 5)).empty());
+    vector<string> fired {};
+    for (;;) {
+      const vector<string> expired {wheel.advance(at(start, 6))};
+      CHECK(expired.size() <= 5u);
+      if (expired.empty())
+        break;
+      fired.insert(fired.end(), expired.begin(), expired.end());
+    }
+    CHECK_EQUAL(30u, fired.size());
+    for (;;) {
+      const vector<string> expired {wheel.advance(at(start, 7))};
+      CHECK(expired.size() <= 5u);
+      if (expired.empty())
+        break;
+      fired.insert(fired.end(), expired.begin(), expired.end());
+    }
+    CHECK_EQUAL(static_cast<std::size_t>(timers), fired.size());
+    std::sort(fired.begin(), fired.end());
+    CHECK(std::unique(fired.begin(), fired.end()) == fired.end());
+    CHECK_EQUAL(0u, wheel.size());
+  }
+}
+
+/*
+  A fresh directory for the files of one offline test, removed
+  afterwards with everything in it
+ */
+class TempDirFixture {
+public:
+  string dir;
+
+  TempDirFixture() : dir {} {
+    char name[] {"/tmp/testerXXXXXX"};
+    if ( ! ::mkdtemp(name))
+      throw std::exception();
+    dir = name;
+  }
+
+  ~TempDirFixture() {
+    // Tests leave only files and empty directories here
+    if (DIR* d {::opendir(dir.c_str())}) {
+      while (const struct dirent* e {::readdir(d)}) {
+        const string name {e->d_name};
+        if (name != "." && name != ".." && ::unlink(file(name).c_str()) != 0)
+          ::rmdir(file(name).c_str());
+      }
+      ::closedir(d);
+    }
+    ::rmdir(dir.c_str());
+  }
+
+  string file(const string& name) const {
+    return dir + "/" + name;
+  }
+};
+
+/*
+  Tests of SessionJournal against files in a temporary directory.
+  These run offline.
+ */
+SUITE(SESSION_JOURNAL) {
+  using sessions_t = std::map<string,pair<SessionJournal::session_t,SessionJournal::wall_time_t>>;
+
+  const SessionJournal::wall_time_t issued {std::chrono::milliseconds {1480000000123}};
+
+  SessionJournal::session_t session_of (const string& userid) {
+    return make_tuple("sv=2015-04-05&sig=" + userid, "USA", userid);
+  }
+
+  /*
+    Return the sessions restored from path, and set count to the
+    number of records applied
+   */
+  sessions_t restore (const string& path, std::uint64_t& count) {
+    sessions_t sessions {};
+    SessionJournal journal {path};
+    count = journal.restore([&sessions] (const string& userid,
+                                         const SessionJournal::session_t& session,
+                                         SessionJournal::wall_time_t when) {
+                              sessions[userid] = make_pair(session, when);
+                            },
+                            [&sessions] (const string& userid) {
+                              sessions.erase(userid);
+                            });
+    return sessions;
+  }
+
+  /*
+    Check that sessions holds exactly the users in userids, each with
+    the session session_of() gives
+   */
+  void check_sessions (const sessions_t& sessions, const vector<string>& userids) {
+    CHECK_EQUAL(userids.size(), sessions.size());
+    for (const string& userid : userids) {
+      auto found (sessions.find(userid));
+      CHECK(found != sessions.end() &&
+            found->second.first == session_of(userid) &&
+            found->second.second == issued);
+    }
+  }
+
+  /*
+    Return an each_t that gives the sessions of userids
+   */
+  SessionJournal::each_t each_of (const vector<string>& userids) {
+    return [userids] (const SessionJournal::put_t& put) {
+      for (const string& userid : userids)
+        put(userid, session_of(userid), issued);
+    };
+  }
+
+  /*
+    Test that a torn record at the end of the journal is ignored and
+    cut off, so that records appended after it are restored too
+   */
+  TEST_FIXTURE(TempDirFixture, SessionJournal_TornRecord) {
+    const string path {file("sessions")};
+    {
+      SessionJournal journal {path};
+      journal.open();
+      journal.put("Ann", session_of("Ann"), issued);
+      journal.put("Bo", session_of("Bo"), issued);
+      journal.erase("Ann");
+      journal.put("Cy", session_of("Cy"), issued);
+    }
+    {
+      // Part of a put record, as left by a crash during write()
+      std::ofstream out {path + ".journal", std::ios::binary | std::ios::app};
+      out.write("P\x05\x00\x00\x00" "Da", 7);
+    }
+
+    std::uint64_t count {0};
+    check_sessions(restore(path, count), vector<string> {"Bo", "Cy"});
+    CHECK_EQUAL(4u, count);
+
+    {
+      SessionJournal journal {path};
+      journal.open();
+      journal.put("Di", session_of("Di"), issued);
+    }
+    check_sessions(restore(path, count), vector<string> {"Bo", "Cy", "Di"});
+    CHECK_EQUAL(5u, count);
+  }
+
+  /*
+    Test that a failed snapshot keeps the journal it rotated out, that
+    the next snapshot adds its journal to that one rather than
+    replacing it, and that restore() replays both over the last
+    snapshot written
+   */
+  TEST_FIXTURE(TempDirFixture, SessionJournal_FailedSnapshot) {
+    const string path {file("sessions")};
+    std::uint64_t count {0};
+    SessionJournal journal {path};
+    journal.open();
+
+    journal.put("Ann", session_of("Ann"), issued);
+    journal.put("Bo", session_of("Bo"), issued);
+    CHECK(journal.snapshot(each_of(vector<string> {"Ann", "Bo"})));
+    CHECK(::access((path + ".journal.old").c_str(), F_OK) != 0);
+    check_sessions(restore(path, count), vector<string> {"Ann", "Bo"});
+    CHECK_EQUAL(2u, count);
+
+    // A directory where the snapshot is written makes it fail
+    CHECK_EQUAL(0, ::mkdir((path + ".tmp").c_str(), 0755));
+    journal.put("Cy", session_of("Cy"), issued);
+    journal.erase("Ann");
+    CHECK(! journal.snapshot(each_of(vector<string> {"Bo", "Cy"})));
+    CHECK(::access((path + ".journal.old").c_str(), F_OK) == 0);
+    journal.put("Di", session_of("Di"), issued);
+    CHECK(! journal.snapshot(each_of(vector<string> {"Bo", "Cy", "Di"})));
+    journal.put("Ed", session_of("Ed"), issued);
+    journal.erase("Bo");
+
+    // Snapshot Ann, Bo; old journal +Cy -Ann +Di; journal +Ed -Bo
+    check_sessions(restore(path, count), vector<string> {"Cy", "Di", "Ed"});
+    CHECK_EQUAL(7u, count);
+
+    CHECK_EQUAL(0, ::rmdir((path + ".tmp").c_str()));
+    journal.put("Fay", session_of("Fay"), issued);
+    CHECK(journal.snapshot(each_of(vector<string> {"Cy", "Di", "Ed", "Fay"})));
+    CHECK(::access((path + ".journal.old").c_str(), F_OK) != 0);
+    journal.put("Gus", session_of("Gus"), issued);
+    check_sessions(restore(path, count), vector<string> {"Cy", "Di", "Ed", "Fay", "Gus"});
+    CHECK_EQUAL(5u, count);
+  }
+
+  /*
+    Test that a snapshot larger than one write is restored whole
+   */
+  TEST_FIXTURE(TempDirFixture, SessionJournal_LargeSnapshot) {
+    const string path {file("sessions")};
+    vector<string> userids {};
+    for (int i {0}; i < 5000; ++i)
+      userids.push_back("User," + std::to_string(i));
+    {
+      SessionJournal journal {path};
+      journal.open();
+      CHECK(journal.snapshot(each_of(userids)));
+    }
+    std::uint64_t count {0};
+    check_sessions(restore(path, count), userids);
+    CHECK_EQUAL(userids.size(), count);
+  }
+}
+
+/*
+  Tests of PushQueue against a log in a temporary directory. These
+  run offline.
+ */
+SUITE(PUSH_QUEUE) {
+  /*
+    Return once condition holds, or false after ten seconds
+   */
+  bool wait_until (const std::function<bool ()>& condition) {
+    for (int i {0}; i < 1000; ++i) {
+      if (condition())
+        return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds {10});
+    }
+    return false;
+  }
+
+  /*
+    Test that after jobs are completed and the log compacted, a queue
+    reopened on the same log delivers exactly the jobs not completed
+
+    The queue compacts once a megabyte of its log is completed jobs,
+    so each round ends with one job that big. With one worker, that
+    job is the last to complete before the compaction.
+   */
+  TEST_FIXTURE(TempDirFixture, PushQueue_ReopenAfterCompaction) {
+    const string path {file("push.log")};
+    const string big (1200 * 1024, 'x');
+    vector<string> kept {};
+    std::size_t done {0};
+    {
+      // Jobs not marked done fail, and are retried for longer than the test runs
+      PushQueue queue {path, [] (const string& payload) { return payload.compare(0, 4, "done") == 0; }, 1, 1000};
+      queue.start();
+      for (int round {0}; round < 2; ++round) {
+        for (int i {0}; i < 20; ++i) {
+          const string id {std::to_string(round) + "-" + std::to_string(i)};
+          if (i % 3 == 0) {
+            kept.push_back("keep-" + id);
+            CHECK(queue.enqueue(kept.back()));
+          }
+          else {
+            CHECK(queue.enqueue("done-" + id));
+            ++done;
+          }
+        }
+        CHECK(queue.enqueue("done-big-" + std::to_string(round) + big));
+        ++done;
+        CHECK(wait_until([&queue, done] () { return queue.metrics().completed == done; }));
+      }
+      CHECK_EQUAL(kept.size(), queue.metrics().depth);
+    }
+    std::ifstream log {path, std::ios::binary | std::ios::ate};
+    CHECK(log && log.tellg() < static_cast<std::streamoff>(big.size()));
+
+    std::mutex delivered_lock {};
+    vector<string> delivered {};
+    PushQueue reopened {path, [&delivered_lock, &delivered] (const string& payload) {
+        std::lock_guard<std::mutex> guard {delivered_lock};
+        delivered.push_back(payload);
+        return true;
+      }, 1};
+    reopened.start();
+    CHECK(wait_until([&reopened, &kept] () { return reopened.metrics().completed == kept.size(); }));
+    CHECK_EQUAL(0u, reopened.metrics().depth);
+    reopened.stop();
+    std::sort(kept.begin(), kept.end());
+    std::sort(delivered.begin(), delivered.end());
+    CHECK(kept == delivered);
   }
 }